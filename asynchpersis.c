@@ -9,10 +9,16 @@
 int my_rank;
 int np;
 
+//Output settings for the current forecast, shared by every link
+typedef struct OutputCycle
+{
+	unsigned int offset;
+} OutputCycle;
+
 typedef struct CustomParams
 {
 	unsigned int ID;
-	int offset;
+	OutputCycle* cycle;
 } CustomParams;
 
 int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user);
@@ -44,14 +50,14 @@ int main(int argc,char* argv[])
 	}
 
 	//Declare variables
-	unsigned int i,j,k,current_offset;
+	unsigned int i,j,k,current_offset,dry_forecasts = 0;
+	short int reuse_forecast;
 	double holder,longest,total_time = 0.0;
 	time_t start,start2,stop;
 	asynchsolver* asynch;
 	PGresult *res;
 	MPI_Status status;
 	char* query = (char*) malloc(1024*sizeof(char));
-	Link* current;
 
 	if(my_rank == 0)
 		printf("\nBeginning initialization...\n*****************************\n");
@@ -71,6 +77,7 @@ int main(int argc,char* argv[])
 	holder = Asynch_Get_Total_Simulation_Time(asynch);
 	longest = (holder < forecast_time) ? forecast_time : holder;
 	Asynch_Set_Total_Simulation_Time(asynch,longest);
+	UseNetworkCache(asynch->GlobalVars,asynch->db_connections[ASYNCH_DB_LOC_TOPO],asynch->db_connections[ASYNCH_DB_LOC_PARAMS],Forecaster,argv[1]);
 	if(my_rank == 0)	printf("Loading network...\n");
 	Asynch_Load_Network(asynch);
 	if(my_rank == 0)	printf("Partitioning network...\n");
@@ -127,14 +134,9 @@ int main(int argc,char* argv[])
 	}
 
 	//Reserve space for backups
-	VEC** backup = (VEC**) malloc(N*sizeof(VEC*));
-	for(i=0;i<N;i++)
-	{
-		if(asynch->assignments[i] == my_rank || asynch->getting[i] == 1)
-			backup[i] = v_get(asynch->sys[i]->dim);
-		else
-			backup[i] = NULL;
-	}
+	StateCheckpoint* checkpoint = Init_StateCheckpoint(asynch->sys,N,asynch->assignments,asynch->getting);
+	RainCache* rain_cache = Init_RainCache(Forecaster,asynch->db_connections[ASYNCH_DB_LOC_FORCING_START + forecast_idx],asynch->GlobalVars);
+	RainPrefetch* prefetch = Init_RainPrefetch(Forecaster,rain_cache);
 
 	if(my_rank == 0)
 	{
@@ -194,8 +196,7 @@ int main(int argc,char* argv[])
 	unsigned int last_file = asynch->forcings[forecast_idx]->last_file;
 	unsigned int first_file = asynch->forcings[forecast_idx]->first_file;
 	k = 0;
-	for(i=0;i<N;i++)
-		if(backup[i] != NULL)	v_copy(asynch->sys[i]->list->tail->y_approx,backup[i]);
+	StateCheckpoint_Save(checkpoint,asynch->sys);
 
 	double simulation_time_with_data = 0.0;
 	simulation_time_with_data = max(simulation_time_with_data,asynch->forcings[forecast_idx]->file_time * Forecaster->num_rainsteps);
@@ -233,7 +234,7 @@ int main(int argc,char* argv[])
 		start = time(NULL);
 
 		//Connect to hydrograph database
-		ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 		//Make sure the hydrographs table exists
 		sprintf(query,"SELECT 1 FROM pg_class WHERE relname='%s';",asynch->GlobalVars->hydro_table);
@@ -261,8 +262,8 @@ int main(int argc,char* argv[])
 		DeleteFutureValues(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],num_tables,asynch->GlobalVars,"archive_hydroforecast",Forecaster->model_name,first_file,1,schema);
 
 		//Disconnect from hydrograph database, connect to peakflow database
-		DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
-		ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
 
 		//Clear all future peakflows
 		sprintf(query,"TRUNCATE %s;",asynch->GlobalVars->peak_table);
@@ -271,7 +272,7 @@ int main(int argc,char* argv[])
 		PQclear(res);
 
 		//Disconnect
-		DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
 
 		stop = time(NULL);
 		printf("Total time to initialize tables: %.2f.\n",difftime(stop,start));
@@ -299,7 +300,7 @@ int main(int argc,char* argv[])
 		nextforcingtime = first_file + 60 * (unsigned int) rint(asynch->forcings[forecast_idx]->file_time) * (num_rainsteps-1);	//This is the actual timestamp of the last needed forcing data. This will be downloaded (unlike last_file)
 
 		//Reset each link
-		Asynch_Set_System_State(asynch,0.0,backup);
+		Asynch_Set_System_State(asynch,0.0,checkpoint->backup);
 		Set_Output_User_forecastparams(asynch,first_file);
 		Set_Output_PeakflowUser_Offset(asynch,first_file);
 		Asynch_Write_Current_Step(asynch);
@@ -330,19 +331,19 @@ int main(int argc,char* argv[])
 		{
 			if(my_rank == 0)
 			{
-				ConnectPGDB(Forecaster->rainmaps_db);
+				ConnectPooledPGDB(Forecaster->rainmaps_db);
+				if(Forecaster->rain_channel)	ListenPGDB(Forecaster->rainmaps_db,Forecaster->rain_channel);
 
 				//Find the next rainfall time
 				time(&start);
-				sprintf(query,Forecaster->rainmaps_db->queries[0],nextforcingtime);;
-				res = PQexec(Forecaster->rainmaps_db->conn,query);
+				res = ExecPreparedPGDB(Forecaster->rainmaps_db,Forecaster->rainmaps_probe,1,(int[]) { (int) nextforcingtime });
 				CheckResError(res,"checking for new rainfall data");
 				time(&stop);
 				printf("Total time to check for new rainfall data: %f.\n",difftime(stop,start));
 				isnull = PQgetisnull(res,0,0);
 
 				PQclear(res);
-				DisconnectPGDB(Forecaster->rainmaps_db);
+				DisconnectPooledPGDB(Forecaster->rainmaps_db);
 			}
 			MPI_Bcast(&isnull,1,MPI_INT,0,MPI_COMM_WORLD);
 
@@ -364,7 +365,13 @@ int main(int argc,char* argv[])
 				else
 				{
 					fflush(stdout);
-					sleep(wait_time);
+					if(Forecaster->rain_channel)	//Wake up as soon as new rainfall is announced. Polling is the fallback.
+					{
+						if(my_rank == 0 && WaitForNotify(Forecaster->rainmaps_db,wait_time) < 0)	sleep(wait_time);
+						MPI_Barrier(MPI_COMM_WORLD);
+					}
+					else
+						sleep(wait_time);
 				}
 			}
 		} while(isnull && !halt);
@@ -372,6 +379,13 @@ int main(int argc,char* argv[])
 		if(halt)	break;
 
 		//Read in next set of rainfall data
+		RainCache_Fill(rain_cache,first_file,last_file);
+
+		//Without rain anywhere in this block, the states follow the last forecast, so it still holds.
+		//Rain at any link means a full forecast. There is no partial solve of the subbasins that got rain.
+		reuse_forecast = (k > 0 && dry_forecasts < Forecaster->reuse_dry_forecasts
+			&& !ForcingHasRain(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START + forecast_idx],asynch->GlobalVars,first_file,last_file));
+		dry_forecasts = (reuse_forecast) ? dry_forecasts + 1 : 0;
 
 		//Initialize some data for the first phase of calculations
 		Asynch_Set_Total_Simulation_Time(asynch,simulation_time_with_data);		// !!!! This may not work for multiple forcings for forecasting. How do you handle different time resolutions? !!!!
@@ -397,24 +411,14 @@ printf("first: %u last: %u\n",first_file,last_file);
 		Flush_TransData(asynch->my_data);
 
 		//Reset the links (mostly) and make a backup for the second phase
-		for(i=0;i<N;i++)	//Set time to 0.0
-		{
-			current = asynch->sys[i];
-			if(current->list != NULL)
-			{
-				while(current->current_iterations > 1)
-				{
-					Remove_Head_Node(current->list);
-					(current->current_iterations)--;
-				}
+		StateCheckpoint_ResetLinks(checkpoint,asynch->sys);
 
-				current->steps_on_diff_proc = 1;
-				current->iters_removed = 0;
-				current->rejected = 0;
-				if(current->numparents == 0)	current->ready = 1;
-				else				current->ready = 0;
-				v_copy(current->list->head->y_approx,backup[i]);
-			}
+		//Skip the second phase and the uploads
+		if(reuse_forecast)
+		{
+			if(my_rank == 0)	printf("No rainfall from %u to %u. Keeping the last forecast (%u in a row).\n",first_file,last_file,dry_forecasts);
+			Asynch_Reset_Temp_Files(asynch,0.0);	//Drop the first phase samples
+			goto next_pass;
 		}
 
 		//Make second phase calculations
@@ -422,6 +426,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 		time(&start);
 		Asynch_Set_Total_Simulation_Time(asynch,forecast_time);
 		Asynch_Deactivate_Forcing(asynch,forecast_idx);
+		RainPrefetch_Start(prefetch,last_file,last_file + (unsigned int) asynch->forcings[forecast_idx]->file_time * 60 * num_rainsteps,(unsigned int) asynch->forcings[forecast_idx]->file_time * 60);	//Forcing for the next forecast
 		Asynch_Advance(asynch,1);
 		Asynch_Activate_Forcing(asynch,forecast_idx);
 		MPI_Barrier(MPI_COMM_WORLD);
@@ -462,19 +467,20 @@ printf("first: %u last: %u\n",first_file,last_file);
 		//Upload the hydrographs to the database ********************************************************************************************
 		MPI_Barrier(MPI_COMM_WORLD);
 		start = time(NULL);
+		WaitForDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],Forecaster->upload_slots);
 
 		//Adjust the table hydrographs
 		if(my_rank == 0)
 		{
 			//Make sure database connection is still good
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 			sprintf(query,"TRUNCATE %s;",asynch->GlobalVars->hydro_table);
 			res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
 			CheckResError(res,"deleting hydrographs");
 			PQclear(res);
 
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		}
 		MPI_Barrier(MPI_COMM_WORLD);
 
@@ -490,7 +496,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 		if(my_rank == 0)
 		{
 			//Connect to database
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 			//Functions for displaying data on IFIS
 			if(Forecaster->ifis_display)
@@ -501,7 +507,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 				{
 					repeat_for_errors = 0;
 					sprintf(query,"SELECT get_stages_ifc01();");
-					res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+					res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 					repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage function");
 					PQclear(res);
 					if(repeat_for_errors)
@@ -518,7 +524,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 				{
 					repeat_for_errors = 0;
 					sprintf(query,"SELECT update_warnings_%s();",Forecaster->model_name);
-					res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+					res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 					repeat_for_errors = repeat_for_errors || CheckResError(res,"calling warnings function");
 					PQclear(res);
 					if(repeat_for_errors)
@@ -553,7 +559,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 				PQclear(res);
 
 				sprintf(query,"SELECT copy_to_archive_hydroforecast_%s();",Forecaster->model_name);
-				res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+				res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 				repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage archive function");
 				PQclear(res);
 
@@ -571,9 +577,10 @@ printf("first: %u last: %u\n",first_file,last_file);
 			}
 
 			//Disconnect
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		}
 
+		FreeDBLock(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		if(my_rank == 0)
 		{
 			time(&stop);
@@ -582,6 +589,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 		fflush(stdout);
 		MPI_Barrier(MPI_COMM_WORLD);
 
+	next_pass:
 		//Check if program has received a terminate signal **********************************************************************************
 		k++;
 		halt = CheckFinished(Forecaster->halt_filename);
@@ -589,12 +597,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 		//If stopping, make a .rec file
 		if(halt)
 		{
-			for(i=0;i<N;i++)
-			{
-				current = asynch->sys[i];
-				if(current->list != NULL)
-					v_copy(backup[i],current->list->tail->y_approx);
-			}
+			StateCheckpoint_Load(checkpoint,asynch->sys);
 
 			sprintf(filename,"%s%u.rec",dump_filename,first_file);
 			Asynch_Set_Snapshot_Output_Name(asynch,filename);
@@ -604,8 +607,10 @@ printf("first: %u last: %u\n",first_file,last_file);
 
 	//Clean up *************************************************************************
 	free(query);
-	for(i=0;i<N;i++)	v_free(backup[i]);
-	free(backup);
+	Free_StateCheckpoint(&checkpoint);
+	Free_RainPrefetch(&prefetch);
+	Free_RainCache(&rain_cache);
+	ClosePooledPGDB();
 	Free_ForecastData(&Forecaster);
 	Asynch_Delete_Temporary_Files(asynch);
 	Free_Output_PeakflowUser_Offset(asynch);
@@ -627,53 +632,61 @@ int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,voi
 int Output_Timestamp(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user)
 {
 	CustomParams* forecastparams = (CustomParams*) user;
-	return (int)(round(t * 60.0 + forecastparams->offset) + 0.1);
+	return (int)(round(t * 60.0 + forecastparams->cycle->offset) + 0.1);
 }
 
 
 //Custom parameters for forecasting ***********************************************************
+//Each link points to its entry in one array of CustomParams, which all point to the same OutputCycle.
+//The array starts at the output_user of the first link of this process.
 void Init_Output_User_forecastparams(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
+	OutputCycle* cycle;
+
+	if(!my_N)	return;
+	cycle = (OutputCycle*) calloc(1,sizeof(OutputCycle));
+	forecastparams = (CustomParams*) malloc(my_N*sizeof(CustomParams));
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->output_user = malloc(sizeof(CustomParams));
+	{
+		forecastparams[i].ID = sys[my_sys[i]]->ID;
+		forecastparams[i].cycle = cycle;
+		sys[my_sys[i]]->output_user = &(forecastparams[i]);
+	}
 }
 
 void Free_Output_User_forecastparams(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
 
+	if(!my_N)	return;
+	forecastparams = (CustomParams*) sys[my_sys[0]]->output_user;
+	free(forecastparams->cycle);
+	free(forecastparams);
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->output_user);
 		sys[my_sys[i]]->output_user = NULL;
-	}
 }
 
 void Set_Output_User_forecastparams(asynchsolver* asynch,unsigned int offset)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-	CustomParams* forecastparams;
-
-	for(i=0;i<my_N;i++)
-	{
-		forecastparams = (CustomParams*) sys[my_sys[i]]->output_user;
-		forecastparams->ID = sys[my_sys[i]]->ID;
-		forecastparams->offset = offset;
-	}
+	if(asynch->my_N)
+		((CustomParams*) asynch->sys[asynch->my_sys[0]]->output_user)->cycle->offset = offset;
 }
 
+//The peakflow output routine reads the offset through an unsigned int*, which is the first field of the shared cycle.
+//This must be called after Init_Output_User_forecastparams.
 void Init_Output_PeakflowUser_Offset(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->peakoutput_user = malloc(sizeof(unsigned int));
+		sys[my_sys[i]]->peakoutput_user = &(((CustomParams*) sys[my_sys[i]]->output_user)->cycle->offset);
 }
 
 void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
@@ -682,19 +695,12 @@ void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->peakoutput_user);
 		sys[my_sys[i]]->peakoutput_user = NULL;
-	}
 }
 
 void Set_Output_PeakflowUser_Offset(asynchsolver* asynch,unsigned int offset)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-
-	for(i=0;i<my_N;i++)
-		*(unsigned int*)(sys[my_sys[i]]->peakoutput_user) = offset;
+	if(asynch->my_N)
+		*(unsigned int*)(asynch->sys[asynch->my_sys[0]]->peakoutput_user) = offset;
 }
 
-
@@ -9,10 +9,16 @@
 int my_rank;
 int np;
 
+//Output settings for the current forecast, shared by every link
+typedef struct OutputCycle
+{
+	unsigned int offset;
+} OutputCycle;
+
 typedef struct CustomParams
 {
 	unsigned int ID;
-	int offset;
+	OutputCycle* cycle;
 } CustomParams;
 
 int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user);
@@ -52,7 +58,6 @@ int main(int argc,char* argv[])
 	PGresult *res;
 	MPI_Status status;
 	char* query = (char*) malloc(1024*sizeof(char));
-	Link* current;
 
 	if(my_rank == 0)
 		printf("\nBeginning initialization...\n*****************************\n");
@@ -71,15 +76,16 @@ int main(int argc,char* argv[])
 		MPI_Abort(MPI_COMM_WORLD,1);
 
 	//Check if there is work to do
-	ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]); //!!!! Assumes forecaster_idx is 0 !!!!
+	ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]); //!!!! Assumes forecaster_idx is 0 !!!!
 	sprintf(query,"SELECT min(unix_time) FROM rain_maps5_index WHERE unix_time >= %u AND link_count > -1;",atoi(argv[3])+ 60 * (unsigned int) rint(asynch->forcings[0]->file_time) * (Forecaster->num_rainsteps-1));
 	res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]->conn,query);
 	CheckResError(res,"checking for new rainfall data");
 	isnull = PQgetisnull(res,0,0);
-	DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]);
+	DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]);
 	if(isnull)
 	{
 		if(my_rank == 0)	printf("No new forcing. Exiting...\n");
+		ClosePooledPGDB();
 		//Asynch_Free(asynch);	!!!! This needs to be fixed !!!!
 		MPI_Finalize();
 		return 0;
@@ -91,6 +97,7 @@ int main(int argc,char* argv[])
 	double holder = Asynch_Get_Total_Simulation_Time(asynch);
 	double longest = (holder < forecast_time) ? forecast_time : holder;
 	Asynch_Set_Total_Simulation_Time(asynch,longest);
+	UseNetworkCache(asynch->GlobalVars,asynch->db_connections[ASYNCH_DB_LOC_TOPO],asynch->db_connections[ASYNCH_DB_LOC_PARAMS],Forecaster,argv[1]);
 	if(my_rank == 0)	printf("Loading network...\n");
 	Asynch_Load_Network(asynch);
 	if(my_rank == 0)	printf("Partitioning network...\n");
@@ -104,6 +111,7 @@ int main(int argc,char* argv[])
 	if(my_rank == 0)	printf("Initializing model...\n");
 	Asynch_Initialize_Model(asynch);
 	if(my_rank == 0)	printf("Loading initial conditions...\n");
+	UseWarmStart(asynch->GlobalVars,Forecaster,atoi(argv[6]));
 	Asynch_Load_Initial_Conditions(asynch);
 	if(my_rank == 0)	printf("Loading forcings...\n");
 	Asynch_Load_Forcings(asynch);
@@ -153,14 +161,9 @@ int main(int argc,char* argv[])
 	Asynch_Set_Last_Rainfall_Timestamp(asynch,override_endtime,forecast_idx);
 
 	//Reserve space for backups
-	VEC** backup = (VEC**) malloc(N*sizeof(VEC*));
-	for(i=0;i<N;i++)
-	{
-		if(asynch->assignments[i] == my_rank || asynch->getting[i] == 1)
-			backup[i] = v_get(asynch->sys[i]->dim);
-		else
-			backup[i] = NULL;
-	}
+	StateCheckpoint* checkpoint = Init_StateCheckpoint(asynch->sys,N,asynch->assignments,asynch->getting);
+	RainCache* rain_cache = Init_RainCache(Forecaster,asynch->db_connections[ASYNCH_DB_LOC_FORCING_START + forecast_idx],asynch->GlobalVars);
+	RainPrefetch* prefetch = Init_RainPrefetch(Forecaster,rain_cache);
 
 	if(my_rank == 0)
 	{
@@ -236,12 +239,12 @@ int main(int argc,char* argv[])
 
 	unsigned int nextraintime,nextforcingtime;
 	short int halt = 0;
+	unsigned int checkpoint_time = 0;	//Snapshot time of the states in checkpoint
 	int repeat_for_errors;
 	unsigned int last_file = asynch->forcings[forecast_idx]->last_file;
 	unsigned int first_file = asynch->forcings[forecast_idx]->first_file;
 	k = 0;
-	for(i=0;i<N;i++)
-		if(backup[i] != NULL)	v_copy(asynch->sys[i]->list->tail->y_approx,backup[i]);
+	StateCheckpoint_Save(checkpoint,asynch->sys);
 
 	double simulation_time_with_data = 0.0;
 	simulation_time_with_data = max(simulation_time_with_data,asynch->forcings[forecast_idx]->file_time * Forecaster->num_rainsteps);
@@ -262,7 +265,7 @@ int main(int argc,char* argv[])
 		start = time(NULL);
 
 		//Connect to hydrograph database
-		ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 		//Make sure the hydrographs table exists
 		sprintf(query,"SELECT 1 FROM pg_class WHERE relname='%s';",asynch->GlobalVars->hydro_table);
@@ -290,10 +293,10 @@ int main(int argc,char* argv[])
 		DeleteFutureValues(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],num_tables,asynch->GlobalVars,"archive_hydroforecast",Forecaster->model_name,first_file,1,schema);
 
 		//Disconnect from hydrograph database, connect to peakflow database
-		DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		if(asynch->GlobalVars->peaksave_flag)
 		{
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
+			ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
 
 			//Make sure the peakforecast tables are set correctly
 			//CheckPeakforecastTable(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,num_peakflow_tables);
@@ -305,7 +308,7 @@ int main(int argc,char* argv[])
 			PQclear(res);
 
 			//Disconnect
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
+			DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
 		}
 
 		stop = time(NULL);
@@ -336,7 +339,7 @@ int main(int argc,char* argv[])
 		//nextforcingtime = first_file + 60 * (unsigned int) rint(asynch->forcings[forecast_idx]->file_time) * num_rainsteps;
 
 		//Reset each link
-		Asynch_Set_System_State(asynch,0.0,backup);
+		Asynch_Set_System_State(asynch,0.0,checkpoint->backup);
 		Set_Output_User_forecastparams(asynch,first_file);
 		Set_Output_PeakflowUser_Offset(asynch,first_file);
 		Asynch_Write_Current_Step(asynch);
@@ -366,19 +369,18 @@ int main(int argc,char* argv[])
 		//Find the next time where rainfall occurs
 		if(my_rank == 0)
 		{
-			ConnectPGDB(Forecaster->rainmaps_db);
+			ConnectPooledPGDB(Forecaster->rainmaps_db);
 
 			//Find the next rainfall time
 			time(&start);
-			sprintf(query,Forecaster->rainmaps_db->queries[0],nextforcingtime);
-			res = PQexec(Forecaster->rainmaps_db->conn,query);
+			res = ExecPreparedPGDB(Forecaster->rainmaps_db,Forecaster->rainmaps_probe,1,(int[]) { (int) nextforcingtime });
 			CheckResError(res,"checking for new rainfall data");
 			time(&stop);
 			printf("Total time to check for new rainfall data: %f.\n",difftime(stop,start));
 			isnull = PQgetisnull(res,0,0);
 
 			PQclear(res);
-			DisconnectPGDB(Forecaster->rainmaps_db);
+			DisconnectPooledPGDB(Forecaster->rainmaps_db);
 		}
 		MPI_Bcast(&isnull,1,MPI_INT,0,MPI_COMM_WORLD);
 
@@ -406,6 +408,7 @@ int main(int argc,char* argv[])
 		if(halt || isnull)	break;
 
 		//Read in next set of rainfall data
+		RainCache_Fill(rain_cache,first_file,last_file);
 
 		//Initialize some data for the first phase of calculations
 		//GlobalVars->maxtime = GlobalVars->file_time * num_rainsteps;
@@ -433,31 +436,15 @@ printf("first: %u last: %u\n",first_file,last_file);
 		Flush_TransData(asynch->my_data);
 
 		//Reset the links (mostly) and make a backup for the second phase
-		for(i=0;i<N;i++)	//Set time to 0.0
-		{
-			current = asynch->sys[i];
-			if(current->list != NULL)
-			{
-				while(current->current_iterations > 1)
-				{
-					Remove_Head_Node(current->list);
-					(current->current_iterations)--;
-				}
-
-				current->steps_on_diff_proc = 1;
-				current->iters_removed = 0;
-				current->rejected = 0;
-				if(current->numparents == 0)	current->ready = 1;
-				else				current->ready = 0;
-				v_copy(current->list->head->y_approx,backup[i]);
-			}
-		}
+		StateCheckpoint_ResetLinks(checkpoint,asynch->sys);
+		checkpoint_time = first_file;
 
 		//Make second phase calculations
 		MPI_Barrier(MPI_COMM_WORLD);
 		time(&start);
 		Asynch_Set_Total_Simulation_Time(asynch,forecast_time);
 		Asynch_Deactivate_Forcing(asynch,forecast_idx);
+		RainPrefetch_Start(prefetch,last_file,last_file + (unsigned int) asynch->forcings[forecast_idx]->file_time * 60 * num_rainsteps,(unsigned int) asynch->forcings[forecast_idx]->file_time * 60);	//Forcing for the next forecast
 		Asynch_Advance(asynch,1);
 		Asynch_Activate_Forcing(asynch,forecast_idx);
 		MPI_Barrier(MPI_COMM_WORLD);
@@ -501,19 +488,20 @@ printf("first: %u last: %u\n",first_file,last_file);
 		//Upload the hydrographs to the database ********************************************************************************************
 		MPI_Barrier(MPI_COMM_WORLD);
 		start = time(NULL);
+		WaitForDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],Forecaster->upload_slots);
 
 		//Adjust the table hydrographs
 		if(my_rank == 0)
 		{
 			//Make sure database connection is still good
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 			sprintf(query,"TRUNCATE %s;",asynch->GlobalVars->hydro_table);
 			res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
 			CheckResError(res,"deleting hydrographs");
 			PQclear(res);
 
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		}
 		MPI_Barrier(MPI_COMM_WORLD);
 
@@ -529,7 +517,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 		if(my_rank == 0)
 		{
 			//Connect to database
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 			//Functions for displaying data on IFIS
 			if(Forecaster->ifis_display)
@@ -541,7 +529,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 					repeat_for_errors = 0;
 					//sprintf(query,"SELECT get_stages_%s();",Forecaster->model_name);
 					sprintf(query,"SELECT get_stages_ifc01();");
-					res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+					res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 					repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage function");
 					PQclear(res);
 					if(repeat_for_errors)
@@ -558,7 +546,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 				{
 					repeat_for_errors = 0;
 					sprintf(query,"SELECT update_warnings_%s();",Forecaster->model_name);
-					res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+					res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 					repeat_for_errors = repeat_for_errors || CheckResError(res,"calling warnings function");
 					PQclear(res);
 					if(repeat_for_errors)
@@ -593,7 +581,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 				PQclear(res);
 
 				sprintf(query,"SELECT copy_to_archive_hydroforecast_%s();",Forecaster->model_name);
-				res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+				res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 				repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage archive function");
 				PQclear(res);
 
@@ -611,9 +599,10 @@ printf("first: %u last: %u\n",first_file,last_file);
 			}
 
 			//Disconnect
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		}
 
+		FreeDBLock(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		if(my_rank == 0)
 		{
 			time(&stop);
@@ -630,18 +619,16 @@ printf("first: %u last: %u\n",first_file,last_file);
 		if(halt)
 		{
 			first_file = last_file;	//This is to put the correct time in the exit file
-			for(i=0;i<N;i++)
-			{
-				current = asynch->sys[i];
-				if(current->list != NULL)
-					v_copy(backup[i],current->list->tail->y_approx);
-			}
+			StateCheckpoint_Load(checkpoint,asynch->sys);
 
 			sprintf(dump_filename,"_%u",last_file);
 			Asynch_Take_System_Snapshot(asynch,dump_filename);
 		}
 	}
 
+	//Leave the states of the last first phase for the next run
+	if(checkpoint_time)	SaveWarmStart(asynch,checkpoint,Forecaster,checkpoint_time);
+
 	//Save the last timestep
 	if(my_rank == 0)
 	{
@@ -659,8 +646,10 @@ printf("first: %u last: %u\n",first_file,last_file);
 	//Clean up **********************************************************************************************************************************
 	if(my_rank == 0)	printf("[%i]: All done!\n",my_rank);
 	free(query);
-	for(i=0;i<N;i++)	v_free(backup[i]);
-	free(backup);
+	Free_StateCheckpoint(&checkpoint);
+	Free_RainPrefetch(&prefetch);
+	Free_RainCache(&rain_cache);
+	ClosePooledPGDB();
 	Free_ForecastData(&Forecaster);
 	Asynch_Delete_Temporary_Files(asynch);
 	Free_Output_PeakflowUser_Offset(asynch);
@@ -682,54 +671,61 @@ int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,voi
 int Output_Timestamp(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user)
 {
 	CustomParams* forecastparams = (CustomParams*) user;
-	return (int)(round(t * 60.0 + forecastparams->offset) + 0.1);
+	return (int)(round(t * 60.0 + forecastparams->cycle->offset) + 0.1);
 }
 
 
 //Custom parameters for forecasting ***********************************************************
+//Each link points to its entry in one array of CustomParams, which all point to the same OutputCycle.
+//The array starts at the output_user of the first link of this process.
 void Init_Output_User_forecastparams(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
+	OutputCycle* cycle;
+
+	if(!my_N)	return;
+	cycle = (OutputCycle*) calloc(1,sizeof(OutputCycle));
+	forecastparams = (CustomParams*) malloc(my_N*sizeof(CustomParams));
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->output_user = malloc(sizeof(CustomParams));
+	{
+		forecastparams[i].ID = sys[my_sys[i]]->ID;
+		forecastparams[i].cycle = cycle;
+		sys[my_sys[i]]->output_user = &(forecastparams[i]);
+	}
 }
 
 void Free_Output_User_forecastparams(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
 
+	if(!my_N)	return;
+	forecastparams = (CustomParams*) sys[my_sys[0]]->output_user;
+	free(forecastparams->cycle);
+	free(forecastparams);
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->output_user);
 		sys[my_sys[i]]->output_user = NULL;
-	}
 }
 
 void Set_Output_User_forecastparams(asynchsolver* asynch,unsigned int offset)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-	CustomParams* forecastparams;
-
-	for(i=0;i<my_N;i++)
-	{
-		forecastparams = (CustomParams*) sys[my_sys[i]]->output_user;
-		forecastparams->ID = sys[my_sys[i]]->ID;
-		forecastparams->offset = offset;
-		//forecastparams->Q_TM = sys[my_sys[i]]->list->tail->y_approx->ve[0];
-	}
+	if(asynch->my_N)
+		((CustomParams*) asynch->sys[asynch->my_sys[0]]->output_user)->cycle->offset = offset;
 }
 
+//The peakflow output routine reads the offset through an unsigned int*, which is the first field of the shared cycle.
+//This must be called after Init_Output_User_forecastparams.
 void Init_Output_PeakflowUser_Offset(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->peakoutput_user = malloc(sizeof(unsigned int));
+		sys[my_sys[i]]->peakoutput_user = &(((CustomParams*) sys[my_sys[i]]->output_user)->cycle->offset);
 }
 
 void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
@@ -738,19 +734,12 @@ void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->peakoutput_user);
 		sys[my_sys[i]]->peakoutput_user = NULL;
-	}
 }
 
 void Set_Output_PeakflowUser_Offset(asynchsolver* asynch,unsigned int offset)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-
-	for(i=0;i<my_N;i++)
-		*(unsigned int*)(sys[my_sys[i]]->peakoutput_user) = offset;
+	if(asynch->my_N)
+		*(unsigned int*)(asynch->sys[asynch->my_sys[0]]->peakoutput_user) = offset;
 }
 
-
@@ -7,10 +7,12 @@
 
 int CheckSQLError(PGresult* res);
 void CheckConnConnection(PGconn* conn);
+void CreateDayPartitions(PGconn* conn,char* query,char* tablename,char* M,int numtables,unsigned int today);
 
 int main(int argc,char* argv[])
 {
-	int i,j,numtables,program,new_version;
+	int i,j,numtables,program,new_version,partitioned = 0;
+	unsigned int today = 0;
 	char query[16384];
 	char M[32];
 	PGresult *res;
@@ -18,7 +20,7 @@ int main(int argc,char* argv[])
 
 	if(argc < 3)
 	{
-		printf("Need model name, program type (forecast, maps).\n");
+		printf("Need model name, program type (forecast, maps), and optionally partitioned.\n");
 		return 1;
 	}
 
@@ -30,6 +32,16 @@ int main(int argc,char* argv[])
 		return 1;
 	}
 
+	if(argc > 3)
+	{
+		if(strcmp(argv[3],"partitioned") == 0)	partitioned = 1;
+		else
+		{
+			printf("Bad archive type %s.\n",argv[3]);
+			return 1;
+		}
+	}
+
 	//Connect to database
 	conn = PQconnectdb("dbname=blah host=blah port=blah user=blah password=blah"); new_version = 1;
 	CheckConnConnection(conn);
@@ -39,16 +51,28 @@ int main(int argc,char* argv[])
 	numtables = 10;
 	printf("Using model name %s.\nAssuming %i archive tables.\n\n",M,numtables);
 
+	//Partition bounds start at the current day (UTC)
+	if(partitioned)
+	{
+		res = PQexec(conn,"SELECT EXTRACT('epoch' FROM current_date AT time zone 'UTC');");
+		if(CheckSQLError(res))	return 1;
+		today = (unsigned int) atoi(PQgetvalue(res,0,0));
+		PQclear(res);
+		printf("Using declarative partitions starting at %u.\n\n",today);
+	}
+
 	//Create archive tables
 	printf("Creating tables...\n");
 
-	if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_hydroforecast_%s (link_id integer,time_utc timestamp with time zone,discharge double precision,forecast_time integer,baseflow double precision);",M);
+	if(partitioned)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_hydroforecast_%s (link_id integer,time_utc timestamp with time zone,discharge double precision,forecast_time integer,baseflow double precision) PARTITION BY RANGE (forecast_time);",M);
+	else if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_hydroforecast_%s (link_id integer,time_utc timestamp with time zone,discharge double precision,forecast_time integer,baseflow double precision);",M);
 	else		sprintf(query,"CREATE TABLE master_archive_hydroforecast_%s (link_id integer,time_utc timestamp with time zone,discharge double precision,forecast_time integer,baseflow double precision);",M);
 	res = PQexec(conn,query);
 	CheckSQLError(res);
 	PQclear(res);
 
-	for(i=0;i<numtables;i++)
+	if(partitioned)	CreateDayPartitions(conn,query,"archive_hydroforecast",M,numtables,today);
+	else for(i=0;i<numtables;i++)
 	{
 		if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS archive_hydroforecast_%s_%i() INHERITS (master_archive_hydroforecast_%s);",M,i,M,M,i);
 		else		sprintf(query,"CREATE TABLE archive_hydroforecast_%s_%i() INHERITS (master_archive_hydroforecast_%s);",M,i,M,M,i);
@@ -64,13 +88,15 @@ int main(int argc,char* argv[])
 
 	if(program == 1)
 	{
-		if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_peakflows_%s (link_id integer,peak_time integer,peak_discharge double precision,forecast_time integer,period integer);",M);
+		if(partitioned)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_peakflows_%s (link_id integer,peak_time integer,peak_discharge double precision,forecast_time integer,period integer) PARTITION BY RANGE (forecast_time);",M);
+		else if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_peakflows_%s (link_id integer,peak_time integer,peak_discharge double precision,forecast_time integer,period integer);",M);
 		else		sprintf(query,"CREATE TABLE master_archive_peakflows_%s (link_id integer,peak_time integer,peak_discharge double precision,forecast_time integer,period integer);",M);
 		res = PQexec(conn,query);
 		CheckSQLError(res);
 		PQclear(res);
 
-		for(i=0;i<numtables;i++)
+		if(partitioned)	CreateDayPartitions(conn,query,"archive_peakflows",M,numtables,today);
+		else for(i=0;i<numtables;i++)
 		{
 			if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS archive_peakflows_%s_%i() INHERITS (master_archive_peakflows_%s);",M,i,M,M,i);
 			else		sprintf(query,"CREATE TABLE archive_peakflows_%s_%i() INHERITS (master_archive_peakflows_%s);",M,i,M,M,i);
@@ -84,13 +110,15 @@ int main(int argc,char* argv[])
 			PQclear(res);
 		}
 
-		if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_maps_%s (forecast_time integer,link_id integer,q double precision,S double precision,s_p double precision,s_l double precision,s_s double precision,v_p double precision,v_r double precision,q_b double precision);",M);
+		if(partitioned)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_maps_%s (forecast_time integer,link_id integer,q double precision,S double precision,s_p double precision,s_l double precision,s_s double precision,v_p double precision,v_r double precision,q_b double precision) PARTITION BY RANGE (forecast_time);",M);
+		else if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS master_archive_maps_%s (forecast_time integer,link_id integer,q double precision,S double precision,s_p double precision,s_l double precision,s_s double precision,v_p double precision,v_r double precision,q_b double precision);",M);
 		else		sprintf(query,"CREATE TABLE master_archive_maps_%s (forecast_time integer,link_id integer,q double precision,s_p double precision,s_l double precision,s_s double precision,v_p double precision,v_r double precision,q_b double precision);",M);
 		res = PQexec(conn,query);
 		CheckSQLError(res);
 		PQclear(res);
 
-		for(i=0;i<numtables;i++)
+		if(partitioned)	CreateDayPartitions(conn,query,"archive_maps",M,numtables,today);
+		else for(i=0;i<numtables;i++)
 		{
 			if(new_version)	sprintf(query,"CREATE TABLE IF NOT EXISTS archive_maps_%s_%i() INHERITS (master_archive_maps_%s);",M,i,M,M,i);
 			else		sprintf(query,"CREATE TABLE archive_maps_%s_%i() INHERITS (master_archive_maps_%s);",M,i,M,M,i);
@@ -135,6 +163,7 @@ int main(int argc,char* argv[])
 	PQclear(res);
 
 	//Create triggers
+	if(partitioned)	goto create_functions;	//Rows are routed by the partition bounds
 	printf("Creating triggers...\n");
 
 	sprintf(query,"CREATE OR REPLACE FUNCTION function_on_insert_to_master_archive_hydroforecast_%s() RETURNS trigger AS $BODY$ BEGIN\
@@ -207,6 +236,7 @@ int main(int argc,char* argv[])
 	}
 
 	//Create functions
+	create_functions:
 	printf("Creating functions...\n");
 
 	sprintf(query,"CREATE OR REPLACE FUNCTION copy_to_archive_hydroforecast_%s() RETURNS void AS $BODY$ INSERT INTO master_archive_hydroforecast_%s (link_id,time_utc,discharge,baseflow)\
@@ -310,3 +340,40 @@ void CheckConnConnection(PGconn* conn)
 	if(in)	printf("Connection reestablished.\n");
 }
 
+
+
+//Creates the day partitions 0 to numtables-1 of master_tablename_M, with partition 0 holding today.
+//A partition for tomorrow (next) is made ahead of time, and a default partition catches everything else.
+void CreateDayPartitions(PGconn* conn,char* query,char* tablename,char* M,int numtables,unsigned int today)
+{
+	int i;
+	PGresult *res;
+
+	for(i=0;i<numtables;i++)
+	{
+		sprintf(query,"CREATE TABLE IF NOT EXISTS %s_%s_%i PARTITION OF master_%s_%s FOR VALUES FROM (%u) TO (%u);",tablename,M,i,tablename,M,today - 86400*i,today - 86400*(i-1));
+		res = PQexec(conn,query);
+		CheckSQLError(res);
+		PQclear(res);
+
+		sprintf(query,"CREATE INDEX idx_%s_%s_%i_forecast_time_link_id ON %s_%s_%i USING btree (forecast_time, link_id);",tablename,M,i,tablename,M,i);
+		res = PQexec(conn,query);
+		CheckSQLError(res);
+		PQclear(res);
+	}
+
+	sprintf(query,"CREATE TABLE IF NOT EXISTS %s_%s_next PARTITION OF master_%s_%s FOR VALUES FROM (%u) TO (%u);",tablename,M,tablename,M,today + 86400,today + 2*86400);
+	res = PQexec(conn,query);
+	CheckSQLError(res);
+	PQclear(res);
+
+	sprintf(query,"CREATE INDEX idx_%s_%s_next_forecast_time_link_id ON %s_%s_next USING btree (forecast_time, link_id);",tablename,M,tablename,M);
+	res = PQexec(conn,query);
+	CheckSQLError(res);
+	PQclear(res);
+
+	sprintf(query,"CREATE TABLE IF NOT EXISTS %s_%s_default PARTITION OF master_%s_%s DEFAULT;",tablename,M,tablename,M);
+	res = PQexec(conn,query);
+	CheckSQLError(res);
+	PQclear(res);
+}
@@ -25,6 +25,9 @@
 #Start an individual forecaster
 #mpirun -np 8 ./FORECASTER_MAPS examples/GlobalForecast262_ifc1c.gbl examples/fcast_file.fcst
 
+#Start several models in one forecaster
+#mpirun -np 8 ./FORECASTER_MAPS examples/GlobalForecast262_ifc1c.gbl examples/fcast_file.fcst examples/GlobalForecast254_ifc1c.gbl examples/fcast_file_254.fcst
+
 #Start a forecaster group
 python forecaster_group_example.py 8
 
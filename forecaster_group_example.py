@@ -1,4 +1,7 @@
+import os
+import errno
 import time
+import select
 import subprocess
 import sys
 
@@ -8,6 +11,42 @@ def CheckHaltFile(haltfilename):
 		halt = int(haltfile.readline())
 	return halt
 
+#Writes a line to the request fifo of a forecaster. A plain open would block forever if the forecaster has
+#already exited (for example, through its halt file), so the fifo is opened without blocking.
+#Returns False if the forecaster is not running.
+def SendRequest(daemon,fifoname,line):
+	while daemon.poll() is None:
+		try:
+			fd = os.open(fifoname,os.O_WRONLY | os.O_NONBLOCK)
+		except OSError as e:
+			if e.errno != errno.ENXIO:
+				raise
+			time.sleep(1)	#The forecaster has not opened the fifo yet
+			continue
+		with os.fdopen(fd,'w') as request:
+			request.write(line)
+		return True
+	return False
+
+#Reads the answer of a forecaster from its reply fifo. The fifo is opened without blocking and polled, so the driver
+#notices if the forecaster exits before it answers. Returns None if the forecaster is not running.
+def ReadReply(daemon,fifoname):
+	fd = os.open(fifoname,os.O_RDONLY | os.O_NONBLOCK)
+	line = ''
+	try:
+		while '\n' not in line:
+			ready = select.select([fd],[],[],5)[0]
+			data = os.read(fd,1024) if ready else ''
+			if data:
+				line += data
+			elif daemon.poll() is not None:
+				return None
+			elif ready:
+				time.sleep(1)	#The forecaster has not opened the fifo yet
+	finally:
+		os.close(fd)
+	return line.split('\n')[0]
+
 np = sys.argv[1]
 
 #Number of forecasters in the group
@@ -18,6 +57,10 @@ haltfilename = 'examples/fgroup/halt'
 timesfilename = 'examples/fgroup/times'
 ptimesfilename = 'examples/fgroup/output_'
 
+#Fifos for forecasters running in daemon mode. These must match the control_fifo setting in each forecast file.
+requestfilename = 'examples/fgroup/request_'
+replyfilename = 'examples/fgroup/reply_'
+
 #Create halt file
 halt = 0
 with open(haltfilename,'w') as haltfile:
@@ -36,34 +79,43 @@ if N != num_forecasters:
 	print 'Error: expected',num_forecasters,'forecasters. Got data for ',N
 	sys.exit(1)
 
+#Start the forecasters. Each one loads its network once, then waits for windows on its request fifo.
+daemons = []
+for i in range(N):
+	for fifoname in [requestfilename+str(i),replyfilename+str(i)]:
+		if not os.path.exists(fifoname):
+			os.mkfifo(fifoname)
+
+#0: Toplayer - IFC (ifc1c)
+cmd = 'mpirun -np '+str(np)+' ./FORECASTER_MAPS_END examples/GlobalForecast262_ifc1c.gbl examples/fcast_file.fcst 0 0 '+ptimesfilename+'0 0 0 0'
+print '\nRunning command',cmd
+sys.stdout.flush()
+daemons.append(subprocess.Popen(cmd,shell=True))
+
 while(halt == 0):
 
-	#Call programs #######################
-	idx = -1
+	#Send each forecaster its next window #######################
+	new_times = []
+	for idx in range(N):
+		if not SendRequest(daemons[idx],requestfilename+str(idx),str(old_times[idx][0])+' '+str(old_times[idx][1])+' '+str(old_times[idx][0]-3600)+'\n'):
+			print 'Forecaster',idx,'has stopped'
+			halt = 1
+			break
+		reply = ReadReply(daemons[idx],replyfilename+str(idx))
+		if reply is None:
+			print 'Forecaster',idx,'has stopped'
+			halt = 1
+			break
+		x = int(reply)
+		new_times.append([x,x])
 
-	#0: Toplayer - IFC (ifc1c)
-	idx += 1
-	cmd = 'mpirun -np '+str(np)+' ./FORECASTER_MAPS_END examples/GlobalForecast262_ifc1c.gbl examples/fcast_file.fcst '+str(old_times[idx][0])+' '+str(old_times[idx][1])+' '+ptimesfilename+str(idx)+' '+str(old_times[idx][0]-3600)+' 0 0'
-	print '\nRunning command',cmd
-	sys.stdout.flush()
-	time.sleep(1)
-	subprocess.call(cmd,shell=True)
+	if halt != 0:
+		break
 
 	#Create new times files
-	new_times = []
-	outfile = open(timesfilename,'w')
-	for i in range(N):
-		with open(ptimesfilename+str(i),'r') as infile:
-			for line in infile:
-				towrite = ''
-				holder = []
-				for x in line.split():
-					holder.append(int(x))
-					holder.append(int(x))
-					towrite = towrite + x + ' '
-				new_times.append([x for x in holder])
-				outfile.write(towrite+towrite+'\n')
-	outfile.close()
+	with open(timesfilename,'w') as outfile:
+		for holder in new_times:
+			outfile.write(str(holder[0])+' '+str(holder[1])+' \n')
 	print 'Got',new_times
 	sys.stdout.flush()
 
@@ -82,5 +134,11 @@ while(halt == 0):
 			sys.stdout.flush()
 			old_times = new_times
 
+#Stop the forecasters
+for idx in range(N):
+	SendRequest(daemons[idx],requestfilename+str(idx),'quit\n')
+for daemon in daemons:
+	daemon.wait()
+
 print 'Halt signal received'
 
@@ -11,18 +11,63 @@ int np;
 
 //!!!! The routines and structs here should probably go into a separate file !!!!
 
+//Output settings for the current forecast, shared by every link of a model
+typedef struct OutputCycle
+{
+	int offset;
+	unsigned int forecast_time;
+	unsigned int period;
+	HydroArchive* archive;
+	EnsembleStats* ensemble;
+	PeakflowHorizons* peaks;
+} OutputCycle;
+
 typedef struct CustomParams
 {
 	unsigned int ID;
-	int offset;
+	unsigned int slot;	//Index of the link in my_sys
+	OutputCycle* cycle;
 	//double Q_TM;
 } CustomParams;
 
-typedef struct CustomParamsMaps
+//A model forecast by this process. Each has its own solver, forecast file, states, and output tables.
+typedef struct MapsModel
 {
-	unsigned int forecast_time;
-	unsigned int period;
-} CustomParamsMaps;
+	asynchsolver* asynch;
+	ForecastData* Forecaster;
+	HydroArchive* archive;
+	StateCheckpoint* checkpoint;
+	RainCache* rain_cache;
+	RainPrefetch* prefetch;
+	CopyBinary* peakflows;
+	PeakflowHorizons* horizons;
+	BackgroundUpload* uploader;
+	EnsembleStats* ensemble;
+	char* dump_filename;
+	char schema[128];
+	unsigned int forecast_idx;
+	unsigned int first_file;
+	unsigned int last_file;
+	unsigned int num_rainsteps;
+	double forecast_time;
+	double simulation_time_with_data;
+	unsigned int dry_forecasts;
+	unsigned int num_passes;
+	short int vac_hydros,vac_maps,vac_peakflows;	//0 if no vacuum has occured, 1 if vacuum has occured (during a specific hour)
+} MapsModel;
+
+//Settings shared by every model
+static short unsigned int hr1 = 0;	//Hour of the day to perform maintainance on database
+static unsigned int wait_time = 120;	//Time to sleep if no rainfall data is available
+static unsigned int num_tables = 10;
+static unsigned int db_retry_time = 5;	//Time (secs) to wait if a database error occurs
+static double default_peakflow_times[] = {60.0, 180.0, 360.0, 720.0, 1440.0, 2880.0, 4320.0, 5760.0, 7200.0};
+
+MapsModel* Init_MapsModel(char* gbl_filename,char* fcst_filename,int* argc,char*** argv);
+short int MapsModel_HasRain(MapsModel* model);
+void MapsModel_Wait(MapsModel** models,unsigned int num_models);
+short int MapsModel_Pass(MapsModel* model);
+void Free_MapsModel(MapsModel** model);
 
 //void PerformTableMaintainance_Maps(ConnData* conninfo_hydros,ConnData* conninfo_peakflows,ConnData* conninfo_maps,UnivVars* GlobalVars,ForecastData* Forecaster,short int* vac,short unsigned int hr1,unsigned int num_tables);
 void UploadPeakflows(asynchsolver* asynch,unsigned int wait_time);
@@ -30,9 +75,10 @@ void UploadPeakflows(asynchsolver* asynch,unsigned int wait_time);
 int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user);
 int Output_Timestamp(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user);
 void OutputPeakflow_Forecast_Maps(unsigned int ID,double peak_time,VEC* peak_value,VEC* params,VEC* global_params,double conversion,unsigned int area_idx,void* user,char* buffer);
-void Init_Output_User_forecastparams(asynchsolver* asynch);
+void Init_Output_User_forecastparams(asynchsolver* asynch,HydroArchive* archive,EnsembleStats* ensemble);
 void Free_Output_User_forecastparams(asynchsolver* asynch);
 void Set_Output_User_forecastparams(asynchsolver* asynch,unsigned int offset);
+void Set_Output_User_Peakflows(asynchsolver* asynch,PeakflowHorizons* peaks);
 
 void Init_Output_PeakflowUser_Offset(asynchsolver* asynch);
 void Free_Output_PeakflowUser_Offset(asynchsolver* asynch);
@@ -47,22 +93,64 @@ int main(int argc,char* argv[])
 	MPI_Comm_size(MPI_COMM_WORLD,&np);
 
 	//Parse input
-	if(argc < 3)
+	if(argc < 3 || (argc - 1) % 2)
 	{
-		if(my_rank == 0)	printf("Command line parameter required:\nA universal variable file (.gbl),\nA forecast file (.fcst)\n");
+		if(my_rank == 0)	printf("Command line parameter required:\nA universal variable file (.gbl),\nA forecast file (.fcst)\nMore pairs of .gbl and .fcst files may follow, one for each model to run.\n");
 		MPI_Finalize();
 		return 1;
 	}
 
 	//Declare variables
-	unsigned int i,j,k,current_offset;
+	unsigned int i,num_models = (argc - 1) / 2;
+	short int halt = 0,ready;
+	MapsModel** models = (MapsModel**) malloc(num_models*sizeof(MapsModel*));
+
+	//Set up each model
+	for(i=0;i<num_models;i++)
+	{
+		if(my_rank == 0 && num_models > 1)	printf("\nSetting up model %u of %u (%s and %s)\n",i+1,num_models,argv[2*i+1],argv[2*i+2]);
+		models[i] = Init_MapsModel(argv[2*i+1],argv[2*i+2],&argc,&argv);
+	}
+
+	//Start the main loop. Each round makes a pass of every model whose next block of rainfall is in,
+	//so a model still waiting for its rainfall does not hold up the others.
+	while(!halt)
+	{
+		ready = 0;
+		for(i=0;i<num_models && !halt;i++)
+		{
+			if(!MapsModel_HasRain(models[i]))	continue;
+			halt = MapsModel_Pass(models[i]);
+			ready = 1;
+		}
+
+		//No model has new rainfall
+		if(!ready)
+		{
+			for(i=0;i<num_models && !halt;i++)
+				halt = CheckFinished(models[i]->Forecaster->halt_filename);
+			if(!halt)	MapsModel_Wait(models,num_models);
+		}
+	}
+
+	//Clean up **********************************************************************************************************************************
+	ClosePooledPGDB();
+	for(i=0;i<num_models;i++)	Free_MapsModel(&models[i]);
+	free(models);
+	MPI_Finalize();
+	return 0;
+}
+
+//Loads the network and forecast data of one model, makes its initial solve, and prepares its tables.
+MapsModel* Init_MapsModel(char* gbl_filename,char* fcst_filename,int* argc,char*** argv)
+{
+	//Declare variables
 	double longest,holder,total_time = 0.0;
-	time_t start,start2,stop;
+	time_t start,stop;
 	asynchsolver* asynch;
 	PGresult *res;
-	MPI_Status status;
-	char* query = (char*) malloc(1024*sizeof(char));
-	Link* current;
+	char query[1024];
+	MapsModel* model = (MapsModel*) malloc(sizeof(MapsModel));
 
 	if(my_rank == 0)
 		printf("\nBeginning initialization...\n*****************************\n");
@@ -70,12 +158,12 @@ int main(int argc,char* argv[])
 	start = time(NULL);
 
 	//Init asynch object and the river network
-	asynch = Asynch_Init(MPI_COMM_WORLD,&argc,&argv);
+	asynch = Asynch_Init(MPI_COMM_WORLD,argc,argv);
 	if(my_rank == 0)	printf("Reading global file...\n");
-	Asynch_Parse_GBL(asynch,argv[1]);
+	Asynch_Parse_GBL(asynch,gbl_filename);
 
 	//Load Forecast related data
-	ForecastData* Forecaster = Init_ForecastData(argv[2],asynch->GlobalVars->string_size);
+	ForecastData* Forecaster = Init_ForecastData(fcst_filename,asynch->GlobalVars->string_size);
 	if(!Forecaster)
 		MPI_Abort(MPI_COMM_WORLD,1);
 	double forecast_time = Forecaster->forecast_window;
@@ -83,6 +171,7 @@ int main(int argc,char* argv[])
 	holder = Asynch_Get_Total_Simulation_Time(asynch);
 	longest = (holder < forecast_time) ? forecast_time : holder;
 	Asynch_Set_Total_Simulation_Time(asynch,longest);
+	UseNetworkCache(asynch->GlobalVars,asynch->db_connections[ASYNCH_DB_LOC_TOPO],asynch->db_connections[ASYNCH_DB_LOC_PARAMS],Forecaster,gbl_filename);
 	if(my_rank == 0)	printf("Loading network...\n");
 	Asynch_Load_Network(asynch);
 	if(my_rank == 0)	printf("Partitioning network...\n");
@@ -116,7 +205,13 @@ int main(int argc,char* argv[])
 		if(my_rank == 0)	printf("[%i]: Forecaster needs LinkID (%i), and Timestamp (%i).\n",my_rank,setup_id,setup_timestamp);
 		MPI_Abort(MPI_COMM_WORLD,1);
 	}
-	Init_Output_User_forecastparams(asynch);
+	HydroArchive* archive = (Forecaster->archive_copy) ? Init_HydroArchive(Forecaster,asynch->sys[asynch->my_sys[0]]->dim,0) : NULL;
+	if(Forecaster->archive_copy && !archive)
+		MPI_Abort(MPI_COMM_WORLD,1);
+	EnsembleStats* ensemble = Init_EnsembleStats(Forecaster,asynch);
+	if(Forecaster->ensemble_filename && !ensemble)
+		MPI_Abort(MPI_COMM_WORLD,1);
+	Init_Output_User_forecastparams(asynch,archive,ensemble);
 	Asynch_Set_Output(asynch,"LinkID",ASYNCH_INT,(void (*)(double,VEC*,VEC*,VEC*,int,void*)) &Output_Linkid,NULL,0);
 	Asynch_Set_Output(asynch,"Timestamp",ASYNCH_INT,(void (*)(double,VEC*,VEC*,VEC*,int,void*)) &Output_Timestamp,NULL,0);
 
@@ -133,7 +228,7 @@ int main(int argc,char* argv[])
 	//Get some values about the river system
 	unsigned int N = Asynch_Get_Number_Links(asynch);
 	unsigned int my_N = Asynch_Get_Local_Number_Links(asynch);
-	char dump_filename[asynch->GlobalVars->string_size];
+	char* dump_filename = (char*) malloc(asynch->GlobalVars->string_size*sizeof(char));
 
 	//Create halt file
 	CreateHaltFile(Forecaster->halt_filename);
@@ -147,14 +242,9 @@ int main(int argc,char* argv[])
 	}
 
 	//Reserve space for backups
-	VEC** backup = (VEC**) malloc(N*sizeof(VEC*));
-	for(i=0;i<N;i++)
-	{
-		if(asynch->assignments[i] == my_rank || asynch->getting[i] == 1)
-			backup[i] = v_get(asynch->sys[i]->dim);
-		else
-			backup[i] = NULL;
-	}
+	StateCheckpoint* checkpoint = Init_StateCheckpoint(asynch->sys,N,asynch->assignments,asynch->getting);
+	RainCache* rain_cache = Init_RainCache(Forecaster,asynch->db_connections[ASYNCH_DB_LOC_FORCING_START + forecast_idx],asynch->GlobalVars);
+	RainPrefetch* prefetch = Init_RainPrefetch(Forecaster,rain_cache);
 
 	if(my_rank == 0)
 	{
@@ -198,28 +288,24 @@ int main(int argc,char* argv[])
 	MPI_Barrier(MPI_COMM_WORLD);
 
 	//Make some initializations and checks
-	short unsigned int hr1 = 0;	//Hour of the day to perform maintainance on database
-	short unsigned int hr2 = 12;	//Hour of the day to perform maintainance on database
-	unsigned int wait_time = 120;	//Time to sleep if no rainfall data is available
-	unsigned int num_tables = 10;
-	unsigned int db_retry_time = 5;	//Time (secs) to wait if a database error occurs
-	unsigned int num_future_peakflow_times = 9;
-	double future_peakflow_times[] = {60.0, 180.0, 360.0, 720.0, 1440.0, 2880.0, 4320.0, 5760.0, 7200.0};
+	unsigned int num_future_peakflow_times = sizeof(default_peakflow_times)/sizeof(double);
+	double* future_peakflow_times = default_peakflow_times;
+	if(Forecaster->peakflow_horizons)
+	{
+		num_future_peakflow_times = Forecaster->num_peakflow_horizons;
+		future_peakflow_times = Forecaster->peakflow_horizons;
+	}
+	PeakflowHorizons* horizons = Init_PeakflowHorizons(my_N,future_peakflow_times,num_future_peakflow_times);
+	Set_Output_User_Peakflows(asynch,horizons);
+	CopyBinary* peakflows = (Forecaster->peakflow_text) ? NULL : CopyBinary_Create(1048576);	//Binary peakflow records. NULL if they go through the text output routine.
 	unsigned int num_rainsteps = Forecaster->num_rainsteps;	//Number of rainfall intensities to use for the next forecast
 	if(my_rank == 0 && asynch->forcings[forecast_idx]->increment < num_rainsteps + 3)
 		printf("Warning: Increment for rain should probably be %u.\n",num_rainsteps + 3);
 	asynch->forcings[forecast_idx]->increment = num_rainsteps;	//!!!! Not necessary, but makes me feel better. The solvers should really not do the last step where they download nothing. !!!!
-	double db_stepsize = asynch->forcings[forecast_idx]->file_time,t;
 
-	unsigned int nextraintime,repeat_for_errors,nextforcingtime;
-	short int halt = 0;
-	int isnull;
-	short int vac_hydros = 0,vac_maps = 0,vac_peakflows = 0;	//0 if no vacuum has occured, 1 if vacuum has occured (during a specific hour)
 	unsigned int last_file = asynch->forcings[forecast_idx]->last_file;
 	unsigned int first_file = asynch->forcings[forecast_idx]->first_file;
-	k = 0;
-	for(i=0;i<N;i++)
-		if(backup[i] != NULL)	v_copy(asynch->sys[i]->list->tail->y_approx,backup[i]);
+	StateCheckpoint_Save(checkpoint,asynch->sys);
 
 	double simulation_time_with_data = 0.0;
 	simulation_time_with_data = max(simulation_time_with_data,asynch->forcings[forecast_idx]->file_time * Forecaster->num_rainsteps);
@@ -231,7 +317,7 @@ int main(int argc,char* argv[])
 
 	//Check if there is a schema used for the hydrograph archive
 	int place,tablename_len = strlen(asynch->GlobalVars->hydro_table);
-	char schema[128]; schema[0] = '\0';
+	char* schema = model->schema; schema[0] = '\0';
 	for(place=tablename_len-1;place>-1;place--)
 	{
 		if(asynch->GlobalVars->hydro_table[place] == '.')
@@ -245,6 +331,9 @@ int main(int argc,char* argv[])
 		}
 	}
 
+	//Uploader thread for streaming hydrographs into the archive during the next forecast
+	BackgroundUpload* uploader = Init_BackgroundUpload(Forecaster,asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],num_tables,schema,db_retry_time);
+
 	//Make some initializations to the database
 	if(my_rank == 0)
 	{
@@ -252,7 +341,7 @@ int main(int argc,char* argv[])
 		start = time(NULL);
 
 		//Connect to hydrograph database
-		ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 		//Make sure the hydrographs table exists
 		sprintf(query,"SELECT 1 FROM pg_class WHERE relname='%s';",asynch->GlobalVars->hydro_table);
@@ -280,8 +369,8 @@ int main(int argc,char* argv[])
 		DeleteFutureValues(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],num_tables,asynch->GlobalVars,"archive_hydroforecast",Forecaster->model_name,first_file,1,schema);
 
 		//Disconnect from hydrograph database, connect to peakflow database
-		DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
-		ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
 
 		//Make sure the peakflow tables are set correctly
 		CheckPartitionedTable(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,num_tables,"archive_peakflows","forecast_time",schema);
@@ -290,8 +379,8 @@ int main(int argc,char* argv[])
 		DeleteFutureValues(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],num_tables,asynch->GlobalVars,"archive_peakflows",Forecaster->model_name,first_file,1,schema);
 
 		//Disconnect from peakflow database, connect to snapshot database
-		DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
-		ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT]);
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT]);
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT]);
 
 		//Make sure the map tables are set correctly
 		CheckPartitionedTable(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT],asynch->GlobalVars,Forecaster,num_tables,"archive_maps","forecast_time",schema);
@@ -300,7 +389,7 @@ int main(int argc,char* argv[])
 		DeleteFutureValues(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT],num_tables,asynch->GlobalVars,"archive_maps",Forecaster->model_name,first_file,0,schema);
 
 		//Disconnect from snapshot database
-		DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT]);
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT]);
 
 		stop = time(NULL);
 		printf("Total time to initialize tables: %.2f.\n",difftime(stop,start));
@@ -308,195 +397,280 @@ int main(int argc,char* argv[])
 
 	MPI_Barrier(MPI_COMM_WORLD);
 
-	//Start the main loop
-	while(!halt)
+	model->asynch = asynch;
+	model->Forecaster = Forecaster;
+	model->archive = archive;
+	model->checkpoint = checkpoint;
+	model->rain_cache = rain_cache;
+	model->prefetch = prefetch;
+	model->peakflows = peakflows;
+	model->horizons = horizons;
+	model->uploader = uploader;
+	model->ensemble = ensemble;
+	model->dump_filename = dump_filename;
+	model->forecast_idx = forecast_idx;
+	model->first_file = first_file;
+	model->last_file = last_file;
+	model->num_rainsteps = num_rainsteps;
+	model->forecast_time = forecast_time;
+	model->simulation_time_with_data = simulation_time_with_data;
+	model->dry_forecasts = 0;
+	model->num_passes = 0;
+	model->vac_hydros = model->vac_maps = model->vac_peakflows = 0;
+	return model;
+}
+
+//Checks once whether the rainfall for the next pass of a model is in. The tables are maintained while a model waits.
+//Returns 1 if the pass can be made, 0 otherwise. This must be called by all procs.
+short int MapsModel_HasRain(MapsModel* model)
+{
+	asynchsolver* asynch = model->asynch;
+	ForecastData* Forecaster = model->Forecaster;
+	unsigned int forecast_idx = model->forecast_idx;
+	unsigned int nextforcingtime = model->last_file + 60 * (unsigned int) rint(asynch->forcings[forecast_idx]->file_time) * (model->num_rainsteps-1);	//Timestamp of the last forcing needed by the next pass
+	int isnull = 1;
+	time_t start,stop;
+	PGresult *res;
+
+	if(my_rank == 0)
 	{
-		if(my_rank == 0)
+		ConnectPooledPGDB(Forecaster->rainmaps_db);
+		if(Forecaster->rain_channel)	ListenPGDB(Forecaster->rainmaps_db,Forecaster->rain_channel);
+
+		//Find the next rainfall time
+		time(&start);
+		res = ExecPreparedPGDB(Forecaster->rainmaps_db,Forecaster->rainmaps_probe,1,(int[]) { (int) nextforcingtime });
+		CheckResError(res,"checking for new rainfall data");
+		time(&stop);
+		printf("Total time to check for new rainfall data: %f.\n",difftime(stop,start));
+		isnull = PQgetisnull(res,0,0);
+
+		PQclear(res);
+		DisconnectPooledPGDB(Forecaster->rainmaps_db);
+
+		if(isnull)
 		{
-			time_t now = time(NULL);
-			struct tm* now_info = localtime(&now);
-			printf("\n\nPass %u\n",k);
-			printf("Current time is %s",asctime(now_info));
+			printf("No rainfall values returned from SQL database for forcing %u of %s. %u %u\n",forecast_idx,Forecaster->model_name,model->last_file,isnull);
+			PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],asynch->GlobalVars,Forecaster,&model->vac_hydros,hr1,num_tables,"archive_hydroforecast",model->schema);
+			PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,&model->vac_peakflows,hr1,num_tables,"archive_peakflows",model->schema);
+			PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT],asynch->GlobalVars,Forecaster,&model->vac_maps,hr1,num_tables,"archive_maps",model->schema);
 		}
+	}
+	MPI_Bcast(&isnull,1,MPI_INT,0,MPI_COMM_WORLD);
 
-		//Clear buffers
-		Flush_TransData(asynch->my_data);
+	return !isnull;
+}
 
-		//Make some initializations
-		first_file = last_file;
-		last_file = last_file + (unsigned int) asynch->forcings[forecast_idx]->file_time * 60 * num_rainsteps;
-		nextforcingtime = first_file + 60 * (unsigned int) rint(asynch->forcings[forecast_idx]->file_time) * (num_rainsteps-1);	//This is the actual timestamp of the last needed forcing data. This will be downloaded (unlike last_file)
+//Waits up to wait_time seconds for new rainfall for any of the models. Models with rain_notify share the wait,
+//and it ends as soon as one of them is notified. This must be called by all procs.
+void MapsModel_Wait(MapsModel** models,unsigned int num_models)
+{
+	unsigned int i,num_listening = 0,share;
+	int received = 0;
 
-		//Reset each link
-		Asynch_Set_System_State(asynch,0.0,backup);
-		Set_Output_User_forecastparams(asynch,first_file);
-		Set_Output_PeakflowUser_Offset(asynch,first_file,first_file);
-		Asynch_Write_Current_Step(asynch);
-		Asynch_Set_Forcing_State(asynch,forecast_idx,0.0,first_file,last_file);	//!!!! Seems redundant with next loop !!!!
+	fflush(stdout);
+	for(i=0;i<num_models;i++)
+		if(models[i]->Forecaster->rain_channel)	num_listening++;
+	if(!num_listening)
+	{
+		sleep(wait_time);
+		return;
+	}
 
-		for(i=0;i<asynch->GlobalVars->num_forcings;i++)	//Set any other database forcings to begin at first_file
+	//Wake up as soon as new rainfall is announced. Polling is the fallback.
+	share = (wait_time / num_listening) ? wait_time / num_listening : 1;
+	if(my_rank == 0)
+	{
+		for(i=0;i<num_models && received <= 0;i++)
 		{
-			if(asynch->forcings[i]->flag == 3)
-				Asynch_Set_Forcing_State(asynch,i,0.0,first_file,asynch->forcings[i]->last_file);
+			if(!models[i]->Forecaster->rain_channel)	continue;
+			received = WaitForNotify(models[i]->Forecaster->rainmaps_db,share);
+			if(received < 0)	sleep(share);
 		}
+	}
+	MPI_Barrier(MPI_COMM_WORLD);
+}
 
-		//Check if a vacuum should be done
-		//This will happen at hr1
-		if(my_rank == 0)
-		{
-			PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],asynch->GlobalVars,Forecaster,&vac_hydros,hr1,num_tables,"archive_hydroforecast",schema);
-			PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,&vac_peakflows,hr1,num_tables,"archive_peakflows",schema);
-			PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT],asynch->GlobalVars,Forecaster,&vac_maps,hr1,num_tables,"archive_maps",schema);
-		}
+//Makes one pass of a model: forecasts from the next block of rainfall and uploads the results.
+//MapsModel_HasRain must have found the rainfall first. Returns 1 if the forecaster should stop, 0 otherwise.
+short int MapsModel_Pass(MapsModel* model)
+{
+	asynchsolver* asynch = model->asynch;
+	ForecastData* Forecaster = model->Forecaster;
+	HydroArchive* archive = model->archive;
+	StateCheckpoint* checkpoint = model->checkpoint;
+	RainCache* rain_cache = model->rain_cache;
+	RainPrefetch* prefetch = model->prefetch;
+	CopyBinary* peakflows = model->peakflows;
+	PeakflowHorizons* horizons = model->horizons;
+	BackgroundUpload* uploader = model->uploader;
+	EnsembleStats* ensemble = model->ensemble;
+	char *schema = model->schema,*dump_filename = model->dump_filename;
+	unsigned int i,forecast_idx = model->forecast_idx,num_rainsteps = model->num_rainsteps;
+	unsigned int first_file = model->first_file,last_file = model->last_file;
+	unsigned int current_offset,period,repeat_for_errors,k = model->num_passes++;
+	double forecast_time = model->forecast_time,simulation_time_with_data = model->simulation_time_with_data;
+	double db_stepsize = asynch->forcings[forecast_idx]->file_time,t;
+	short int reuse_forecast;
+	time_t start,stop;
+	PGresult *res;
+	char query[1024];
 
-		//Make sure all buffer flushing is done
-		MPI_Barrier(MPI_COMM_WORLD);
+	if(my_rank == 0)
+	{
+		time_t now = time(NULL);
+		struct tm* now_info = localtime(&now);
+		printf("\n\nPass %u of %s\n",k,Forecaster->model_name);
+		printf("Current time is %s",asctime(now_info));
+	}
 
-		//Find the next time where rainfall occurs
-		do
-		{
-			if(my_rank == 0)
-			{
-				ConnectPGDB(Forecaster->rainmaps_db);
+	//Clear buffers
+	Flush_TransData(asynch->my_data);
 
-				//Find the next rainfall time
-				time(&start);
-				sprintf(query,Forecaster->rainmaps_db->queries[0],nextforcingtime);
-				res = PQexec(Forecaster->rainmaps_db->conn,query);
-				CheckResError(res,"checking for new rainfall data");
-				time(&stop);
-				printf("Total time to check for new rainfall data: %f.\n",difftime(stop,start));
-				isnull = PQgetisnull(res,0,0);
+	//Make some initializations
+	first_file = last_file;
+	last_file = last_file + (unsigned int) asynch->forcings[forecast_idx]->file_time * 60 * num_rainsteps;
+	model->first_file = first_file;
+	model->last_file = last_file;
 
-				PQclear(res);
-				DisconnectPGDB(Forecaster->rainmaps_db);
-			}
-			MPI_Bcast(&isnull,1,MPI_INT,0,MPI_COMM_WORLD);
+	//Reset each link
+	Asynch_Set_System_State(asynch,0.0,checkpoint->backup);
+	Set_Output_User_forecastparams(asynch,first_file);
+	Set_Output_PeakflowUser_Offset(asynch,first_file,first_file);
+	HydroArchive_Reset(archive);
+	Asynch_Write_Current_Step(asynch);
+	Asynch_Set_Forcing_State(asynch,forecast_idx,0.0,first_file,last_file);	//!!!! Seems redundant with next loop !!!!
 
-			if(isnull)
-			{
-				if(my_rank == 0)
-				{
-					printf("No rainfall values returned from SQL database for forcing %u. %u %u\n",forecast_idx,last_file,isnull);
-					PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],asynch->GlobalVars,Forecaster,&vac_hydros,hr1,num_tables,"archive_hydroforecast",schema);
-					PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,&vac_peakflows,hr1,num_tables,"archive_peakflows",schema);
-					PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT],asynch->GlobalVars,Forecaster,&vac_maps,hr1,num_tables,"archive_maps",schema);
-				}
+	for(i=0;i<asynch->GlobalVars->num_forcings;i++)	//Set any other database forcings to begin at first_file
+	{
+		if(asynch->forcings[i]->flag == 3)
+			Asynch_Set_Forcing_State(asynch,i,0.0,first_file,asynch->forcings[i]->last_file);
+	}
 
-				halt = CheckFinished(Forecaster->halt_filename);
-				if(!halt)
-				{
-					fflush(stdout);
-					sleep(wait_time);
-				}
-			}
-		} while(isnull && !halt);
+	//Check if a vacuum should be done
+	//This will happen at hr1
+	if(my_rank == 0)
+	{
+		PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],asynch->GlobalVars,Forecaster,&model->vac_hydros,hr1,num_tables,"archive_hydroforecast",schema);
+		PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,&model->vac_peakflows,hr1,num_tables,"archive_peakflows",schema);
+		PerformTableMaintainance(asynch->db_connections[ASYNCH_DB_LOC_SNAPSHOT_OUTPUT],asynch->GlobalVars,Forecaster,&model->vac_maps,hr1,num_tables,"archive_maps",schema);
+	}
 
-		if(halt)	break;
+	//Make sure all buffer flushing is done
+	MPI_Barrier(MPI_COMM_WORLD);
 
-		//Read in next set of rainfall data
+	//Read in next set of rainfall data
+	RainCache_Fill(rain_cache,first_file,last_file);
 
-		//Initialize some data for the first phase of calculations
-		Asynch_Set_Total_Simulation_Time(asynch,simulation_time_with_data);		// !!!! This may not work for multiple forcings for forecasting. How do you handle different time resolutions? !!!!
-		current_offset = first_file;
-		Set_Output_User_forecastparams(asynch,current_offset);
-		Set_Output_PeakflowUser_Offset(asynch,current_offset,current_offset);
+	//Without rain anywhere in this block, the states follow the last forecast, so it still holds.
+	//Rain at any link means a full forecast. There is no partial solve of the subbasins that got rain.
+	reuse_forecast = (k > 0 && model->dry_forecasts < Forecaster->reuse_dry_forecasts
+		&& !ForcingHasRain(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START + forecast_idx],asynch->GlobalVars,first_file,last_file));
+	model->dry_forecasts = (reuse_forecast) ? model->dry_forecasts + 1 : 0;
 
-		MPI_Barrier(MPI_COMM_WORLD);
-		time(&start);
+	//Initialize some data for the first phase of calculations
+	Asynch_Set_Total_Simulation_Time(asynch,simulation_time_with_data);		// !!!! This may not work for multiple forcings for forecasting. How do you handle different time resolutions? !!!!
+	current_offset = first_file;
+	Set_Output_User_forecastparams(asynch,current_offset);
+	Set_Output_PeakflowUser_Offset(asynch,current_offset,current_offset);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	time(&start);
 if(my_rank == 0)
 printf("first: %u last: %u\n",first_file,last_file);
 
-		Asynch_Advance(asynch,1);
+	Asynch_Advance(asynch,1);
 
-		MPI_Barrier(MPI_COMM_WORLD);
-		if(my_rank == 0)
-		{
-			time(&stop);
-			printf("Time for first phase calculations: %.2f\n",difftime(stop,start));
-		}
+	MPI_Barrier(MPI_COMM_WORLD);
+	if(my_rank == 0)
+	{
+		time(&stop);
+		printf("Time for first phase calculations: %.2f\n",difftime(stop,start));
+	}
 
-		//Flush communication buffers
-		Flush_TransData(asynch->my_data);
+	//Flush communication buffers
+	Flush_TransData(asynch->my_data);
 
-		//Reset the links (mostly) and make a backup for the second phase
-		//!!!! Need routine for this !!!!
-		for(i=0;i<N;i++)	//Set time to 0.0
-		{
-			current = asynch->sys[i];
-			if(current->list != NULL)
-			{
-				while(current->current_iterations > 1)
-				{
-					Remove_Head_Node(current->list);
-					(current->current_iterations)--;
-				}
+	//Reset the links (mostly) and make a backup for the second phase
+	StateCheckpoint_ResetLinks(checkpoint,asynch->sys);
 
-				current->steps_on_diff_proc = 1;
-				current->iters_removed = 0;
-				current->rejected = 0;
-				if(current->numparents == 0)	current->ready = 1;
-				else				current->ready = 0;
-				v_copy(current->list->head->y_approx,backup[i]);
-			}
-		}
+	//Upload a snapshot to the database
+	sprintf(dump_filename,"%u",first_file);
+	Asynch_Take_System_Snapshot(asynch,dump_filename);
 
-		//Upload a snapshot to the database
-		sprintf(dump_filename,"%u",first_file);
-		Asynch_Take_System_Snapshot(asynch,dump_filename);
+	//Skip the second phase and the uploads
+	if(reuse_forecast)
+	{
+		if(my_rank == 0)	printf("No rainfall from %u to %u. Keeping the last forecast (%u in a row).\n",first_file,last_file,model->dry_forecasts);
+		Asynch_Reset_Temp_Files(asynch,0.0);	//Drop the first phase samples
+		HydroArchive_Reset(archive);
+		goto next_pass;
+	}
 
-		//Make second phase calculations. Peakflow data will be uploaded several times.
-		MPI_Barrier(MPI_COMM_WORLD);
-		time(&start);
+	//Make second phase calculations. The peakflows of every horizon are taken from the hydrograph samples in one advance.
+	MPI_Barrier(MPI_COMM_WORLD);
+	time(&start);
+
+	Asynch_Deactivate_Forcing(asynch,forecast_idx);
+	RainPrefetch_Start(prefetch,last_file,last_file + (unsigned int) asynch->forcings[forecast_idx]->file_time * 60 * num_rainsteps,(unsigned int) asynch->forcings[forecast_idx]->file_time * 60);	//Forcing for the next forecast
+	if(peakflows)	CopyBinary_Reset(peakflows);
 
-		Asynch_Deactivate_Forcing(asynch,forecast_idx);
+	t = asynch->sys[asynch->my_sys[0]]->last_t;
+	Asynch_Set_Total_Simulation_Time(asynch,max(forecast_time,PeakflowHorizons_Start(horizons,asynch->sys,asynch->my_sys,t,db_stepsize*num_rainsteps)));
+	Asynch_Advance(asynch,1);
 
-		for(i=0;i<num_future_peakflow_times;i++)
+	for(i=0;i<horizons->num_horizons;i++)
+	{
+		period = current_offset + (unsigned int) (60.0*horizons->starts[i]+0.1);
+		PeakflowHorizons_Set(horizons,asynch->sys,asynch->my_sys,i);
+		Set_Output_PeakflowUser_Offset(asynch,current_offset,period);
+		if(peakflows)
 		{
-			t = asynch->sys[asynch->my_sys[0]]->last_t;
-			Asynch_Set_Total_Simulation_Time(asynch,future_peakflow_times[i] + db_stepsize*num_rainsteps);
-			Asynch_Reset_Peakflow_Data(asynch);
-			Set_Output_PeakflowUser_Offset(asynch,current_offset,current_offset + (unsigned int) (60.0*t+0.1));
-			Asynch_Advance(asynch,1);
-			UploadPeakflows(asynch,db_retry_time);
+			PeakflowBatch_Add(peakflows,asynch->sys,asynch->my_sys,asynch->my_N,current_offset,period);
+			if(!Forecaster->peakflow_batch)	PeakflowBatch_Flush(peakflows,asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars->peak_table,Forecaster->upload_ranks,db_retry_time);
 		}
+		else	UploadPeakflows(asynch,db_retry_time);
+	}
+	PeakflowHorizons_Finish(horizons,asynch->sys,asynch->my_sys);
 
-		Asynch_Reset_Peakflow_Data(asynch);
-		Asynch_Set_Total_Simulation_Time(asynch,forecast_time);
-		Asynch_Advance(asynch,1);
+	//Send the peakflows of every horizon at once
+	if(peakflows && Forecaster->peakflow_batch)	PeakflowBatch_Flush(peakflows,asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars->peak_table,Forecaster->upload_ranks,db_retry_time);
 
-		Asynch_Activate_Forcing(asynch,forecast_idx);
+	Asynch_Activate_Forcing(asynch,forecast_idx);
 
-		MPI_Barrier(MPI_COMM_WORLD);
-		if(my_rank == 0)
-		{
-			time(&stop);
-			printf("Time for second phase calculations: %.2f\n",difftime(stop,start));
-		}
+	MPI_Barrier(MPI_COMM_WORLD);
+	if(my_rank == 0)
+	{
+		time(&stop);
+		printf("Time for second phase calculations: %.2f\n",difftime(stop,start));
+	}
 
-		//Output some data
-		if(my_rank == 0)
-		{
-			printf("[%i]: The answer at ID %i at time %.12f is\n",my_rank,asynch->sys[asynch->my_sys[0]]->ID,asynch->sys[asynch->my_sys[0]]->last_t);
-			Print_Vector(asynch->sys[asynch->my_sys[0]]->list->tail->y_approx);
-		}
+	//Output some data
+	if(my_rank == 0)
+	{
+		printf("[%i]: The answer at ID %i at time %.12f is\n",my_rank,asynch->sys[asynch->my_sys[0]]->ID,asynch->sys[asynch->my_sys[0]]->last_t);
+		Print_Vector(asynch->sys[asynch->my_sys[0]]->list->tail->y_approx);
+	}
 
-		//Upload the hydrographs to the database ********************************************************************************************
-		MPI_Barrier(MPI_COMM_WORLD);
-		start = time(NULL);
+	//Upload the hydrographs to the database ********************************************************************************************
+	MPI_Barrier(MPI_COMM_WORLD);
+	start = time(NULL);
+	WaitForDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],(uploader) ? 0 : Forecaster->upload_slots);	//The uploader takes its own slot
 
-		//Adjust the table hydrographs
+	//Adjust the table hydrographs. When streaming into the archive, this table is only needed for IFIS.
+	if(!archive || Forecaster->ifis_display)
+	{
 		if(my_rank == 0)
 		{
 			//Make sure database connection is still good
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 			sprintf(query,"TRUNCATE %s;",asynch->GlobalVars->hydro_table);
 			res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
 			CheckResError(res,"deleting hydrographs");
 			PQclear(res);
 
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		}
 		MPI_Barrier(MPI_COMM_WORLD);
 
@@ -507,110 +681,145 @@ printf("first: %u last: %u\n",first_file,last_file);
 			sleep(5);
 			repeat_for_errors = Asynch_Create_Output(asynch,NULL);
 		}
+	}
+	else
+		Asynch_Reset_Temp_Files(asynch,0.0);
 
-		//Call functions *********************************************************************************************************************
-		if(my_rank == 0)
-		{
-			//Connect to database
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+	//Call functions *********************************************************************************************************************
+	if(my_rank == 0)
+	{
+		//Connect to database
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
-			//Functions for displaying data on IFIS
-			if(Forecaster->ifis_display)
+		//Functions for displaying data on IFIS
+		if(Forecaster->ifis_display)
+		{
+			//Stage
+			repeat_for_errors = 1;
+			while(repeat_for_errors)
 			{
-				//Stage
-				repeat_for_errors = 1;
-				while(repeat_for_errors)
-				{
-					repeat_for_errors = 0;
-					sprintf(query,"SELECT get_stages_%s();",Forecaster->model_name);
-					res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
-					repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage function");
-					PQclear(res);
-					if(repeat_for_errors)
-					{
-						printf("[%i]: Attempting to call stage function again...\n",my_rank);
-						sleep(5);
-						CheckConnConnection(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
-					}
-				}
-
-				//Warnings
-				repeat_for_errors = 1;
-				while(repeat_for_errors)
+				repeat_for_errors = 0;
+				sprintf(query,"SELECT get_stages_%s();",Forecaster->model_name);
+				res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
+				repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage function");
+				PQclear(res);
+				if(repeat_for_errors)
 				{
-					repeat_for_errors = 0;
-					sprintf(query,"SELECT update_warnings_%s();",Forecaster->model_name);
-					res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
-					repeat_for_errors = repeat_for_errors || CheckResError(res,"calling warnings function");
-					PQclear(res);
-					if(repeat_for_errors)
-					{
-						printf("[%i]: Attempting to call warning function again...\n",my_rank);
-						sleep(5);
-						CheckConnConnection(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
-					}
+					printf("[%i]: Attempting to call stage function again...\n",my_rank);
+					sleep(5);
+					CheckConnConnection(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 				}
 			}
 
-			//Stage archive
+			//Warnings
 			repeat_for_errors = 1;
 			while(repeat_for_errors)
 			{
 				repeat_for_errors = 0;
-				sprintf(query,"ALTER TABLE master_archive_hydroforecast_%s ALTER COLUMN forecast_time SET DEFAULT %u;",Forecaster->model_name,current_offset);
-				res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
-				repeat_for_errors = repeat_for_errors || CheckResError(res,"setting default value");
+				sprintf(query,"SELECT update_warnings_%s();",Forecaster->model_name);
+				res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
+				repeat_for_errors = repeat_for_errors || CheckResError(res,"calling warnings function");
 				PQclear(res);
-
-				sprintf(query,"SELECT copy_to_archive_hydroforecast_%s();",Forecaster->model_name);
-				res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
-				repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage archive function");
-				PQclear(res);
-
-				sprintf(query,"ALTER TABLE master_archive_hydroforecast_%s ALTER COLUMN forecast_time DROP DEFAULT;",Forecaster->model_name);
-				res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
-				repeat_for_errors = repeat_for_errors || CheckResError(res,"dropping default value");
-				PQclear(res);
-
 				if(repeat_for_errors)
 				{
-					printf("[%i]: Attempting to call stage archive function again...\n",my_rank);
+					printf("[%i]: Attempting to call warning function again...\n",my_rank);
 					sleep(5);
 					CheckConnConnection(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 				}
 			}
-
-			//Disconnect
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		}
 
-		if(my_rank == 0)
+		//Stage archive. This is skipped when the hydrographs are streamed into the archive.
+		repeat_for_errors = (archive == NULL);
+		while(repeat_for_errors)
 		{
-			time(&stop);
-			printf("[%i]: Total time to transfer hydrograph data: %.2f\n",my_rank,difftime(stop,start));
+			repeat_for_errors = 0;
+			sprintf(query,"ALTER TABLE master_archive_hydroforecast_%s ALTER COLUMN forecast_time SET DEFAULT %u;",Forecaster->model_name,current_offset);
+			res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+			repeat_for_errors = repeat_for_errors || CheckResError(res,"setting default value");
+			PQclear(res);
+
+			sprintf(query,"SELECT copy_to_archive_hydroforecast_%s();",Forecaster->model_name);
+			res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
+			repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage archive function");
+			PQclear(res);
+
+			sprintf(query,"ALTER TABLE master_archive_hydroforecast_%s ALTER COLUMN forecast_time DROP DEFAULT;",Forecaster->model_name);
+			res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+			repeat_for_errors = repeat_for_errors || CheckResError(res,"dropping default value");
+			PQclear(res);
+
+			if(repeat_for_errors)
+			{
+				printf("[%i]: Attempting to call stage archive function again...\n",my_rank);
+				sleep(5);
+				CheckConnConnection(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			}
 		}
-		fflush(stdout);
-		MPI_Barrier(MPI_COMM_WORLD);
 
-		//Check if program has received a terminate signal **********************************************************************************
-		k++;
-		halt = CheckFinished(Forecaster->halt_filename);
+		//Disconnect
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 	}
 
-	//Clean up **********************************************************************************************************************************
-	free(query);
-	for(i=0;i<N;i++)	v_free(backup[i]);
-	free(backup);
-	Free_ForecastData(&Forecaster);
+	//Stream the hydrographs directly into the archive
+	if(uploader)	BackgroundUpload_Start(uploader,archive,current_offset);
+	else while(HydroArchive_Upload(archive,asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],Forecaster,num_tables,current_offset,schema))
+	{
+		if(my_rank == 0)	printf("[%i]: Attempting resend of hydrographs to the archive.\n",my_rank);
+		sleep(db_retry_time);
+	}
+
+	FreeDBLock(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+	if(my_rank == 0)
+	{
+		time(&stop);
+		printf("[%i]: Total time to transfer hydrograph data: %.2f\n",my_rank,difftime(stop,start));
+	}
+	fflush(stdout);
+	MPI_Barrier(MPI_COMM_WORLD);
+
+next_pass:
+	//Run the ensemble from the same states and upload its statistics
+	if(ensemble)
+	{
+		RainPrefetch_Wait(prefetch);	//The members borrow the forcing's connection settings
+		EnsembleStats_Run(ensemble,asynch,checkpoint,forecast_idx,simulation_time_with_data,last_file,forecast_time);
+		while(EnsembleStats_Upload(ensemble,asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],Forecaster,schema,current_offset))
+		{
+			if(my_rank == 0)	printf("[%i]: Attempting resend of ensemble statistics.\n",my_rank);
+			sleep(db_retry_time);
+		}
+	}
+
+	//Check if program has received a terminate signal **********************************************************************************
+	return CheckFinished(Forecaster->halt_filename);
+}
+
+//Frees a model and its solver. The pooled connections must be closed first.
+void Free_MapsModel(MapsModel** model)
+{
+	asynchsolver* asynch = (*model)->asynch;
+
+	Free_StateCheckpoint(&(*model)->checkpoint);
+	Free_RainPrefetch(&(*model)->prefetch);
+	Free_RainCache(&(*model)->rain_cache);
+	Free_BackgroundUpload(&(*model)->uploader);
+	Free_EnsembleStats(&(*model)->ensemble);
+	Free_HydroArchive(&(*model)->archive);
+	if((*model)->peakflows)	CopyBinary_Free(&(*model)->peakflows);
+	Free_PeakflowHorizons(&(*model)->horizons);
+	Free_ForecastData(&(*model)->Forecaster);
 	Asynch_Delete_Temporary_Files(asynch);
 	Free_Output_PeakflowUser_Offset(asynch);
 	Free_Output_User_forecastparams(asynch);
 	Asynch_Free(asynch);
-	MPI_Finalize();
-	return 0;
+	free((*model)->dump_filename);
+	free(*model);
+	*model = NULL;
 }
 
 
+
 //Calls the function to create peakflows. The function is called repeatedly until the data is sent.
 void UploadPeakflows(asynchsolver* asynch,unsigned int wait_time)
 {
@@ -636,59 +845,81 @@ int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,voi
 int Output_Timestamp(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user)
 {
 	CustomParams* forecastparams = (CustomParams*) user;
-	return (int)(round(t * 60.0 + forecastparams->offset) + 0.1);
+	OutputCycle* cycle = forecastparams->cycle;
+	int timestamp = (int)(round(t * 60.0 + cycle->offset) + 0.1);
+	if(cycle->peaks)	PeakflowHorizons_AddSample(cycle->peaks,forecastparams->slot,t,y_i);
+	if(cycle->ensemble && cycle->ensemble->member >= 0)	EnsembleStats_AddSample(cycle->ensemble,forecastparams->slot,forecastparams->ID,timestamp,y_i);
+	else if(cycle->archive)	HydroArchive_AddSample(cycle->archive,forecastparams->ID,t,(unsigned int) timestamp,y_i,cycle->offset);
+	return timestamp;
 }
 
 void OutputPeakflow_Forecast_Maps(unsigned int ID,double peak_time,VEC* peak_value,VEC* params,VEC* global_params,double conversion,unsigned int area_idx,void* user,char* buffer)
 {
-	CustomParamsMaps* forecastparams = (CustomParamsMaps*) user;
+	OutputCycle* forecastparams = (OutputCycle*) user;
 	sprintf(buffer,"%u %u %.6e %u %u\n",ID,forecastparams->forecast_time + (unsigned int)(peak_time*60 + .1),peak_value->ve[0],forecastparams->forecast_time,forecastparams->period);
 }
 
 
 //Custom parameters for forecasting ***********************************************************
-void Init_Output_User_forecastparams(asynchsolver* asynch)
+//Each link points to its entry in one array of CustomParams, which all point to the same OutputCycle.
+//The array starts at the output_user of the first link of this process.
+void Init_Output_User_forecastparams(asynchsolver* asynch,HydroArchive* archive,EnsembleStats* ensemble)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
+	OutputCycle* cycle;
+
+	if(!my_N)	return;
+	cycle = (OutputCycle*) calloc(1,sizeof(OutputCycle));
+	cycle->archive = archive;
+	cycle->ensemble = ensemble;
+	forecastparams = (CustomParams*) malloc(my_N*sizeof(CustomParams));
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->output_user = malloc(sizeof(CustomParams));
+	{
+		forecastparams[i].ID = sys[my_sys[i]]->ID;
+		forecastparams[i].slot = i;
+		forecastparams[i].cycle = cycle;
+		sys[my_sys[i]]->output_user = &(forecastparams[i]);
+	}
 }
 
 void Free_Output_User_forecastparams(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
 
+	if(!my_N)	return;
+	forecastparams = (CustomParams*) sys[my_sys[0]]->output_user;
+	free(forecastparams->cycle);
+	free(forecastparams);
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->output_user);
 		sys[my_sys[i]]->output_user = NULL;
-	}
 }
 
 void Set_Output_User_forecastparams(asynchsolver* asynch,unsigned int offset)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-	CustomParams* forecastparams;
+	if(asynch->my_N)
+		((CustomParams*) asynch->sys[asynch->my_sys[0]]->output_user)->cycle->offset = offset;
+}
 
-	for(i=0;i<my_N;i++)
-	{
-		forecastparams = (CustomParams*) sys[my_sys[i]]->output_user;
-		forecastparams->ID = sys[my_sys[i]]->ID;
-		forecastparams->offset = offset;
-	}
+//Points the sample output routine at the running peakflows of the horizons.
+void Set_Output_User_Peakflows(asynchsolver* asynch,PeakflowHorizons* peaks)
+{
+	if(asynch->my_N)
+		((CustomParams*) asynch->sys[asynch->my_sys[0]]->output_user)->cycle->peaks = peaks;
 }
 
+//The peakflow output routine only needs the cycle, so every link shares it. This must be called after Init_Output_User_forecastparams.
 void Init_Output_PeakflowUser_Offset(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->peakoutput_user = malloc(sizeof(CustomParamsMaps));
+		sys[my_sys[i]]->peakoutput_user = ((CustomParams*) sys[my_sys[i]]->output_user)->cycle;
 }
 
 void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
@@ -697,24 +928,16 @@ void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->peakoutput_user);
 		sys[my_sys[i]]->peakoutput_user = NULL;
-	}
 }
 
 void Set_Output_PeakflowUser_Offset(asynchsolver* asynch,unsigned int forecast_time,unsigned int period)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-	CustomParamsMaps* peak_params;
+	OutputCycle* cycle;
 
-	for(i=0;i<my_N;i++)
-	{
-		peak_params = (CustomParamsMaps*) (sys[my_sys[i]]->peakoutput_user);
-		peak_params->forecast_time = forecast_time;
-		peak_params->period = period;
-	}
+	if(!asynch->my_N)	return;
+	cycle = (OutputCycle*) asynch->sys[asynch->my_sys[0]]->peakoutput_user;
+	cycle->forecast_time = forecast_time;
+	cycle->period = period;
 }
 
-
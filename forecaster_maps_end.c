@@ -9,26 +9,34 @@
 int my_rank;
 int np;
 
-typedef struct CustomParams
+//Output settings for the current forecast, shared by every link
+typedef struct OutputCycle
 {
-	unsigned int ID;
 	int offset;
-} CustomParams;
-
-typedef struct CustomParamsMaps
-{
 	unsigned int forecast_time;
 	unsigned int period;
-} CustomParamsMaps;
+	HydroArchive* archive;
+	PeakflowHorizons* peaks;
+} OutputCycle;
+
+typedef struct CustomParams
+{
+	unsigned int ID;
+	unsigned int slot;	//Index of the link in my_sys
+	OutputCycle* cycle;
+} CustomParams;
 
 void UploadPeakflows(asynchsolver* asynch,unsigned int wait_time);
+int HaveNewForcing(asynchsolver* asynch,ForecastData* Forecaster,unsigned int start_time);
+int NextWindow(asynchsolver* asynch,ForecastData* Forecaster,unsigned int* window);
 
 int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user);
 int Output_Timestamp(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user);
 void OutputPeakflow_Forecast_Maps(unsigned int ID,double peak_time,VEC* peak_value,VEC* params,VEC* global_params,double conversion,unsigned int area_idx,void* user,char* buffer);
-void Init_Output_User_forecastparams(asynchsolver* asynch);
+void Init_Output_User_forecastparams(asynchsolver* asynch,HydroArchive* archive);
 void Free_Output_User_forecastparams(asynchsolver* asynch);
 void Set_Output_User_forecastparams(asynchsolver* asynch,unsigned int offset);
+void Set_Output_User_Peakflows(asynchsolver* asynch,PeakflowHorizons* peaks);
 
 void Init_Output_PeakflowUser_Offset(asynchsolver* asynch);
 void Free_Output_PeakflowUser_Offset(asynchsolver* asynch);
@@ -78,7 +86,7 @@ int main(int argc,char* argv[])
 	}
 
 	//Declare variables
-	unsigned int i,j,k,current_offset;
+	unsigned int i,j,k,current_offset,period;
 	int isnull;
 	double total_time = 0.0;
 	time_t start,start2,stop;
@@ -86,7 +94,6 @@ int main(int argc,char* argv[])
 	PGresult *res;
 	MPI_Status status;
 	char* query = (char*) malloc(1024*sizeof(char));
-	Link* current;
 
 	if(my_rank == 0)
 		printf("\nBeginning initialization...\n*****************************\n");
@@ -97,40 +104,37 @@ int main(int argc,char* argv[])
 	asynch = Asynch_Init(MPI_COMM_WORLD,&argc,&argv);
 	if(my_rank == 0)	printf("Reading global file...\n");
 	Asynch_Parse_GBL(asynch,argv[1]);
-	Asynch_Set_Total_Simulation_Time(asynch,(atoi(argv[4]) - atoi(argv[3]))/60.0);
-	Asynch_Set_Init_Timestamp(asynch,atoi(argv[6]));
 
 	//Load Forecast related data
 	ForecastData* Forecaster = Init_ForecastData(argv[2],asynch->GlobalVars->string_size);
 	if(!Forecaster)
 		MPI_Abort(MPI_COMM_WORLD,1);
 
+	//Get the first window (start, end, and init timestamps). In daemon mode, every window comes from the control fifo.
+	unsigned int window[3] = { atoi(argv[3]), atoi(argv[4]), atoi(argv[6]) };
+	unsigned int num_windows = 0;
+
 	//Check if there is work to do
-	if(my_rank == 0)
-	{
-		isnull = 1;
-		ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]); //!!!! Assumes forecaster_idx is 0 !!!!
-		sprintf(query,Forecaster->rainmaps_db->queries[0],atoi(argv[3])+ 60 * (unsigned int) rint(asynch->forcings[0]->file_time) * (Forecaster->num_rainsteps-1));
-		res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]->conn,query);
-		CheckResError(res,"checking for new rainfall data");
-		isnull = PQgetisnull(res,0,0);
-		PQclear(res);
-		DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]);
-	}
-	MPI_Bcast(&isnull,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(Forecaster->control_request)	isnull = NextWindow(asynch,Forecaster,window);
+	else				isnull = !HaveNewForcing(asynch,Forecaster,window[0]);
 
 	if(isnull)
 	{
 		if(my_rank == 0)	printf("No new forcing. Exiting...\n");
+		ClosePooledPGDB();
+		Free_ForecastData(&Forecaster);
 		MPI_Finalize();
 		return 0;
 	}
+	Asynch_Set_Total_Simulation_Time(asynch,(window[1] - window[0])/60.0);
+	Asynch_Set_Init_Timestamp(asynch,window[2]);
 
 	//Load the system
 	double forecast_time = Forecaster->forecast_window;
 	double holder = Asynch_Get_Total_Simulation_Time(asynch);
 	double longest = (holder < forecast_time) ? forecast_time : holder;
 	Asynch_Set_Total_Simulation_Time(asynch,longest);
+	UseNetworkCache(asynch->GlobalVars,asynch->db_connections[ASYNCH_DB_LOC_TOPO],asynch->db_connections[ASYNCH_DB_LOC_PARAMS],Forecaster,argv[1]);
 	if(my_rank == 0)	printf("Loading network...\n");
 	Asynch_Load_Network(asynch);
 	if(my_rank == 0)	printf("Partitioning network...\n");
@@ -144,6 +148,7 @@ int main(int argc,char* argv[])
 	if(my_rank == 0)	printf("Initializing model...\n");
 	Asynch_Initialize_Model(asynch);
 	if(my_rank == 0)	printf("Loading initial conditions...\n");
+	UseWarmStart(asynch->GlobalVars,Forecaster,window[2]);
 	Asynch_Load_Initial_Conditions(asynch);
 	if(my_rank == 0)	printf("Loading forcings...\n");
 	Asynch_Load_Forcings(asynch);
@@ -166,12 +171,22 @@ int main(int argc,char* argv[])
 			MPI_Abort(MPI_COMM_WORLD,1);
 		}
 	}
-	Init_Output_User_forecastparams(asynch);
-	if(!hydro_files)
+	else if(Asynch_Check_Output(asynch,"Timestamp"))	//Peakflows are taken from the hydrograph samples
 	{
-		Asynch_Set_Output(asynch,"LinkID",ASYNCH_INT,(void (*)(double,VEC*,VEC*,VEC*,int,void*)) &Output_Linkid,NULL,0);
-		Asynch_Set_Output(asynch,"Timestamp",ASYNCH_INT,(void (*)(double,VEC*,VEC*,VEC*,int,void*)) &Output_Timestamp,NULL,0);
+		if(my_rank == 0)	printf("[%i]: Forecaster needs the Timestamp output for peakflows.\n",my_rank);
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+	HydroArchive* archive = NULL;
+	if(hydro_files ? Forecaster->hydro_columnar : Forecaster->archive_copy)	//Columnar hydrograph files are built from the archive samples
+	{
+		archive = Init_HydroArchive(Forecaster,asynch->sys[asynch->my_sys[0]]->dim,(short int) hydro_files);
+		if(!archive)
+			MPI_Abort(MPI_COMM_WORLD,1);
 	}
+	Init_Output_User_forecastparams(asynch,archive);
+	if(!hydro_files)
+		Asynch_Set_Output(asynch,"LinkID",ASYNCH_INT,(void (*)(double,VEC*,VEC*,VEC*,int,void*)) &Output_Linkid,NULL,0);
+	Asynch_Set_Output(asynch,"Timestamp",ASYNCH_INT,(void (*)(double,VEC*,VEC*,VEC*,int,void*)) &Output_Timestamp,NULL,0);
 
 	//Setup the peakflow information for maps
 	int setup_peakflow_maps = Asynch_Check_Peakflow_Output(asynch,"Forecast_Maps");
@@ -199,22 +214,10 @@ int main(int argc,char* argv[])
 		MPI_Abort(MPI_COMM_WORLD,1);
 	}
 
-	//Set new start and end times
-	unsigned int override_starttime = atoi(argv[3]);
-	unsigned int override_endtime = atoi(argv[4]);
-	for(i=0;i<asynch->GlobalVars->num_forcings;i++)
-		Asynch_Set_First_Rainfall_Timestamp(asynch,override_starttime,i);
-	Asynch_Set_Last_Rainfall_Timestamp(asynch,override_endtime,forecast_idx);
-
 	//Reserve space for backups
-	VEC** backup = (VEC**) malloc(N*sizeof(VEC*));
-	for(i=0;i<N;i++)
-	{
-		if(asynch->assignments[i] == my_rank || asynch->getting[i] == 1)
-			backup[i] = v_get(asynch->sys[i]->dim);
-		else
-			backup[i] = NULL;
-	}
+	StateCheckpoint* checkpoint = Init_StateCheckpoint(asynch->sys,N,asynch->assignments,asynch->getting);
+	RainCache* rain_cache = Init_RainCache(Forecaster,asynch->db_connections[ASYNCH_DB_LOC_FORCING_START + forecast_idx],asynch->GlobalVars);
+	RainPrefetch* prefetch = Init_RainPrefetch(Forecaster,rain_cache);
 
 	if(my_rank == 0)
 	{
@@ -230,27 +233,6 @@ int main(int argc,char* argv[])
 	MPI_Barrier(MPI_COMM_WORLD);
 	sleep(1);
 
-	//Make sure everyone is good before getting down to it...
-	printf("Process %i (%i total) is good to go with %i links.\n",my_rank,np,my_N);
-	MPI_Barrier(MPI_COMM_WORLD);
-	start = time(NULL);
-
-	//Make the initial solve
-	Asynch_Advance(asynch,0);
-
-	//Stop the clock
-	MPI_Barrier(MPI_COMM_WORLD);
-	stop = time(NULL);
-	total_time += difftime(stop,start);
-
-	//Output some data
-	if(my_rank == 0)
-	{
-		printf("%i: The answer at ID %i at time %.12f is\n",my_rank,asynch->sys[asynch->my_sys[0]]->ID,asynch->sys[asynch->my_sys[0]]->last_t);
-		Print_Vector(asynch->sys[asynch->my_sys[0]]->list->tail->y_approx);
-		printf("Total time for calculations: %f\n",difftime(stop,start));
-	}
-
 	//Check if there is a schema used for the hydrograph archive
 	int place,tablename_len = strlen(asynch->GlobalVars->hydro_table);
 	char schema[128]; schema[0] = '\0';
@@ -267,12 +249,6 @@ int main(int argc,char* argv[])
 		}
 	}
 
-	//Begin persistent calculations
-	if(my_rank == 0)
-		printf("\n\n===================================\nBeginning persistent calculations\n===================================\n");
-	fflush(stdout);
-	MPI_Barrier(MPI_COMM_WORLD);
-
 	//Make some initializations and checks
 	//unsigned int history_time = 5*24*60*60;	//Amount of history to store for hydrographs and peakflows
 	//short unsigned int hr1 = 0;	//Hour of the day to perform maintainance on database
@@ -282,33 +258,105 @@ int main(int argc,char* argv[])
 	unsigned int num_tables = 10;
 	unsigned int db_retry_time = 5;	//Time (secs) to wait if a database error occurs
 	unsigned int num_future_peakflow_times = 9;
-	double future_peakflow_times[] = {60.0, 180.0, 360.0, 720.0, 1440.0, 2880.0, 4320.0, 5760.0, 7200.0};
+	double default_peakflow_times[] = {60.0, 180.0, 360.0, 720.0, 1440.0, 2880.0, 4320.0, 5760.0, 7200.0};
+	double* future_peakflow_times = default_peakflow_times;
+	if(Forecaster->peakflow_horizons)
+	{
+		num_future_peakflow_times = Forecaster->num_peakflow_horizons;
+		future_peakflow_times = Forecaster->peakflow_horizons;
+	}
+	PeakflowHorizons* horizons = Init_PeakflowHorizons(asynch->my_N,future_peakflow_times,num_future_peakflow_times);
+	Set_Output_User_Peakflows(asynch,horizons);
+	CopyBinary* peakflows = (Forecaster->peakflow_text) ? NULL : CopyBinary_Create(1048576);	//Binary peakflow records. NULL if they go through the text output routine.
 	//unsigned int num_rainsteps = 3;	//Number of rainfall intensities to use for the next forecast
 	unsigned int num_rainsteps = Forecaster->num_rainsteps;	//Number of rainfall intensities to use for the next forecast
-	//if(my_rank == 0 && asynch->GlobalVars->increment < num_rainsteps + 3)
-	if(my_rank == 0 && asynch->forcings[forecast_idx]->increment < num_rainsteps + 3)
-		printf("Warning: Increment for rain should probably be %u.\n",num_rainsteps + 3);
-	asynch->forcings[forecast_idx]->increment = num_rainsteps;	//!!!! Not necessary, but makes me feel better. The solvers should really not do the last step where they download nothing. !!!!
+	unsigned int init_increment = asynch->forcings[forecast_idx]->increment;	//Increment for the initial solve of each window
 	double db_stepsize = asynch->forcings[forecast_idx]->file_time,t;
 
 	unsigned int nextraintime,repeat_for_errors,nextforcingtime;
 	short int halt = 0;
-	unsigned int last_file = asynch->forcings[forecast_idx]->last_file;
-	unsigned int first_file = asynch->forcings[forecast_idx]->first_file;
-	k = 0;
-	for(i=0;i<N;i++)
-		if(backup[i] != NULL)	v_copy(asynch->sys[i]->list->tail->y_approx,backup[i]);
+	unsigned int last_file,first_file;
+	unsigned int checkpoint_time = 0;	//Snapshot time of the states in checkpoint
 
 	double simulation_time_with_data = 0.0;
 	simulation_time_with_data = max(simulation_time_with_data,asynch->forcings[forecast_idx]->file_time * Forecaster->num_rainsteps);
 
+	//Forecast each window. In daemon mode, this repeats for every window sent on the control fifo.
+	next_window:
+	//Set new start and end times
+	for(i=0;i<asynch->GlobalVars->num_forcings;i++)
+		Asynch_Set_First_Rainfall_Timestamp(asynch,window[0],i);
+	Asynch_Set_Last_Rainfall_Timestamp(asynch,window[1],forecast_idx);
+	asynch->forcings[forecast_idx]->increment = init_increment;
+
+	//Go back to the initial conditions of this window. The network is already loaded from the first window.
+	//If the window starts from the last snapshot of the previous window, its states are still in checkpoint.
+	if(num_windows)
+	{
+		Flush_TransData(asynch->my_data);
+		Asynch_Set_Init_Timestamp(asynch,window[2]);
+		Asynch_Set_Total_Simulation_Time(asynch,(window[1] - window[0])/60.0);
+		Asynch_Set_System_State(asynch,0.0,checkpoint->backup);
+		if(window[2] != checkpoint_time)
+		{
+			UseWarmStart(asynch->GlobalVars,Forecaster,window[2]);
+			Asynch_Load_Initial_Conditions(asynch);
+			StateCheckpoint_Save(checkpoint,asynch->sys);
+			Asynch_Set_System_State(asynch,0.0,checkpoint->backup);
+		}
+		else if(my_rank == 0)	printf("Warm starting from the states at %u in memory.\n",checkpoint_time);
+		for(i=0;i<asynch->GlobalVars->num_forcings;i++)
+		{
+			if(asynch->forcings[i]->flag == 3)
+				Asynch_Set_Forcing_State(asynch,i,0.0,window[0],asynch->forcings[i]->last_file);
+		}
+	}
+
+	//Make sure everyone is good before getting down to it...
+	printf("Process %i (%i total) is good to go with %i links.\n",my_rank,np,my_N);
+	MPI_Barrier(MPI_COMM_WORLD);
+	start = time(NULL);
+
+	//Make the initial solve
+	Asynch_Advance(asynch,0);
+
+	//Stop the clock
+	MPI_Barrier(MPI_COMM_WORLD);
+	stop = time(NULL);
+	total_time += difftime(stop,start);
+
+	//Output some data
+	if(my_rank == 0)
+	{
+		printf("%i: The answer at ID %i at time %.12f is\n",my_rank,asynch->sys[asynch->my_sys[0]]->ID,asynch->sys[asynch->my_sys[0]]->last_t);
+		Print_Vector(asynch->sys[asynch->my_sys[0]]->list->tail->y_approx);
+		printf("Total time for calculations: %f\n",difftime(stop,start));
+	}
+
+	//Begin persistent calculations
+	if(my_rank == 0)
+		printf("\n\n===================================\nBeginning persistent calculations\n===================================\n");
+	fflush(stdout);
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	//if(my_rank == 0 && asynch->GlobalVars->increment < num_rainsteps + 3)
+	if(my_rank == 0 && asynch->forcings[forecast_idx]->increment < num_rainsteps + 3)
+		printf("Warning: Increment for rain should probably be %u.\n",num_rainsteps + 3);
+	asynch->forcings[forecast_idx]->increment = num_rainsteps;	//!!!! Not necessary, but makes me feel better. The solvers should really not do the last step where they download nothing. !!!!
+
+	halt = 0;
+	last_file = asynch->forcings[forecast_idx]->last_file;
+	first_file = asynch->forcings[forecast_idx]->first_file;
+	k = 0;
+	StateCheckpoint_Save(checkpoint,asynch->sys);
+
 	//Set peakflow output
-	Asynch_Prepare_Peakflow_Output(asynch);
+	if(!num_windows)	Asynch_Prepare_Peakflow_Output(asynch);
 
 	//Setup temp files
 	Set_Output_User_forecastparams(asynch,first_file);
 	Asynch_Set_Total_Simulation_Time(asynch,forecast_time);
-	Asynch_Prepare_Temp_Files(asynch);
+	if(!num_windows)	Asynch_Prepare_Temp_Files(asynch);
 
 	//Make some initializations to the database
 	if(my_rank == 0)
@@ -319,7 +367,7 @@ int main(int argc,char* argv[])
 		if(!hydro_files)
 		{
 			//Connect to hydrograph database
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 			//Make sure the hydrographs table exists
 			sprintf(query,"SELECT 1 FROM pg_class WHERE relname='%s';",asynch->GlobalVars->hydro_table);
@@ -339,7 +387,7 @@ int main(int argc,char* argv[])
 				CheckResError(res,"truncating hydrographs table");
 			}
 			PQclear(res);
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 			//Make sure the hydroforecast tables are set correctly
 			CheckPartitionedTable(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],asynch->GlobalVars,Forecaster,num_tables,"archive_hydroforecast","forecast_time",schema);
@@ -388,9 +436,10 @@ int main(int argc,char* argv[])
 		//nextforcingtime = first_file + 60 * (unsigned int) rint(asynch->forcings[forecast_idx]->file_time) * num_rainsteps;
 
 		//Reset each link
-		Asynch_Set_System_State(asynch,0.0,backup);
+		Asynch_Set_System_State(asynch,0.0,checkpoint->backup);
 		Set_Output_User_forecastparams(asynch,first_file);
 		Set_Output_PeakflowUser_Offset(asynch,first_file,first_file);
+		HydroArchive_Reset(archive);
 		Asynch_Write_Current_Step(asynch);
 		Asynch_Set_Forcing_State(asynch,forecast_idx,0.0,first_file,last_file);	//!!!! Seems redundant with next loop !!!!
 
@@ -415,19 +464,18 @@ int main(int argc,char* argv[])
 		//Find the next time where rainfall occurs
 		if(my_rank == 0)
 		{
-			ConnectPGDB(Forecaster->rainmaps_db);
+			ConnectPooledPGDB(Forecaster->rainmaps_db);
 
 			//Find the next rainfall time
 			time(&start);
-			sprintf(query,Forecaster->rainmaps_db->queries[0],nextforcingtime);
-			res = PQexec(Forecaster->rainmaps_db->conn,query);
+			res = ExecPreparedPGDB(Forecaster->rainmaps_db,Forecaster->rainmaps_probe,1,(int[]) { (int) nextforcingtime });
 			CheckResError(res,"checking for new rainfall data");
 			time(&stop);
 			printf("Total time to check for new rainfall data: %f.\n",difftime(stop,start));
 			isnull = PQgetisnull(res,0,0);
 
 			PQclear(res);
-			DisconnectPGDB(Forecaster->rainmaps_db);
+			DisconnectPooledPGDB(Forecaster->rainmaps_db);
 		}
 		MPI_Bcast(&isnull,1,MPI_INT,0,MPI_COMM_WORLD);
 
@@ -448,6 +496,7 @@ int main(int argc,char* argv[])
 		if(halt || isnull)	break;
 
 		//Read in next set of rainfall data
+		RainCache_Fill(rain_cache,first_file,last_file);
 
 		//Initialize some data for the first phase of calculations
 		Asynch_Set_Total_Simulation_Time(asynch,simulation_time_with_data);		// !!!! This may not work for multiple forcings for forecasting. How do you handle different time resolutions? !!!!
@@ -473,26 +522,8 @@ printf("first: %u last: %u\n",first_file,last_file);
 		Flush_TransData(asynch->my_data);
 
 		//Reset the links (mostly) and make a backup for the second phase
-		//!!!! Need routine for this !!!!
-		for(i=0;i<N;i++)	//Set time to 0.0
-		{
-			current = asynch->sys[i];
-			if(current->list != NULL)
-			{
-				while(current->current_iterations > 1)
-				{
-					Remove_Head_Node(current->list);
-					(current->current_iterations)--;
-				}
-
-				current->steps_on_diff_proc = 1;
-				current->iters_removed = 0;
-				current->rejected = 0;
-				if(current->numparents == 0)	current->ready = 1;
-				else				current->ready = 0;
-				v_copy(current->list->head->y_approx,backup[i]);
-			}
-		}
+		StateCheckpoint_ResetLinks(checkpoint,asynch->sys);
+		checkpoint_time = first_file;
 
 		//Upload a snapshot to the database
 		if(my_rank == 0)
@@ -518,30 +549,42 @@ printf("first: %u last: %u\n",first_file,last_file);
 		}
 
 
-		//Make second phase calculations. Peakflow data will be uploaded several times.
+		//Make second phase calculations. The peakflows of every horizon are taken from the hydrograph samples in one advance.
 		MPI_Barrier(MPI_COMM_WORLD);
 		time(&start);
 
 		Asynch_Deactivate_Forcing(asynch,forecast_idx);
+		RainPrefetch_Start(prefetch,last_file,last_file + (unsigned int) asynch->forcings[forecast_idx]->file_time * 60 * num_rainsteps,(unsigned int) asynch->forcings[forecast_idx]->file_time * 60);	//Forcing for the next forecast
+		if(peakflows)	CopyBinary_Reset(peakflows);
 
-		for(i=0;i<num_future_peakflow_times;i++)
+		t = asynch->sys[asynch->my_sys[0]]->last_t;
+		Asynch_Set_Total_Simulation_Time(asynch,max(forecast_time,PeakflowHorizons_Start(horizons,asynch->sys,asynch->my_sys,t,db_stepsize*num_rainsteps)));
+		Asynch_Advance(asynch,1);
+
+		for(i=0;i<horizons->num_horizons;i++)
 		{
-			//t = future_peakflow_times[i] + db_stepsize*num_rainsteps;
-			t = asynch->sys[asynch->my_sys[0]]->last_t;
-			//Asynch_Set_Total_Simulation_Time(asynch,t);
-			Asynch_Set_Total_Simulation_Time(asynch,future_peakflow_times[i] + db_stepsize*num_rainsteps);
-			Asynch_Reset_Peakflow_Data(asynch);
-			Set_Output_PeakflowUser_Offset(asynch,current_offset,current_offset + (unsigned int) (60.0*t+0.1));
-			Asynch_Advance(asynch,1);
+			period = current_offset + (unsigned int) (60.0*horizons->starts[i]+0.1);
+			PeakflowHorizons_Set(horizons,asynch->sys,asynch->my_sys,i);
+			Set_Output_PeakflowUser_Offset(asynch,current_offset,period);
+			if(peakflows)	PeakflowBatch_Add(peakflows,asynch->sys,asynch->my_sys,asynch->my_N,current_offset,period);
+			if(peakflows && Forecaster->peakflow_batch)	continue;
+
 			if(my_rank == 0)
 				CheckPartitionedTable(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,num_tables,"archive_peakflows","forecast_time",schema);
 			MPI_Barrier(MPI_COMM_WORLD);
-			UploadPeakflows(asynch,db_retry_time);
+			if(peakflows)	PeakflowBatch_Flush(peakflows,asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars->peak_table,Forecaster->upload_ranks,db_retry_time);
+			else	UploadPeakflows(asynch,db_retry_time);
+		}
+		PeakflowHorizons_Finish(horizons,asynch->sys,asynch->my_sys);
+
+		//Send the peakflows of every horizon at once
+		if(peakflows && Forecaster->peakflow_batch)
+		{
+			if(my_rank == 0)
+				CheckPartitionedTable(asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars,Forecaster,num_tables,"archive_peakflows","forecast_time",schema);
+			PeakflowBatch_Flush(peakflows,asynch->db_connections[ASYNCH_DB_LOC_PEAK_OUTPUT],asynch->GlobalVars->peak_table,Forecaster->upload_ranks,db_retry_time);
 		}
 
-		Asynch_Reset_Peakflow_Data(asynch);
-		Asynch_Set_Total_Simulation_Time(asynch,forecast_time);
-		Asynch_Advance(asynch,1);
 		Asynch_Activate_Forcing(asynch,forecast_idx);
 
 		//Flush communication buffers	!!!! This keeps biting me in the ass. Put in Asynch_Advance. !!!!
@@ -564,29 +607,38 @@ printf("first: %u last: %u\n",first_file,last_file);
 		//Upload the hydrographs to the database ********************************************************************************************
 		MPI_Barrier(MPI_COMM_WORLD);
 		start = time(NULL);
+		WaitForDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],Forecaster->upload_slots);
 
-		//Adjust the table hydrographs
+		//Adjust the table hydrographs. When streaming into the archive, this table is only needed for IFIS.
 		if(my_rank == 0 && !hydro_files)
 		{
 			CheckPartitionedTable(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],asynch->GlobalVars,Forecaster,num_tables,"archive_hydroforecast","forecast_time",schema);
-			ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
-			sprintf(query,"TRUNCATE %s;",asynch->GlobalVars->hydro_table);
-			res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
-			CheckResError(res,"deleting hydrographs");
-			PQclear(res);
-			DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			if(!archive || Forecaster->ifis_display)
+			{
+				ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+				sprintf(query,"TRUNCATE %s;",asynch->GlobalVars->hydro_table);
+				res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+				CheckResError(res,"deleting hydrographs");
+				PQclear(res);
+				DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			}
 		}
 		MPI_Barrier(MPI_COMM_WORLD);
 
 		if(hydro_files)
 			sprintf(hydro_additional,"%u",first_file);
 
-		repeat_for_errors = Asynch_Create_Output(asynch,hydro_additional);
-		while(repeat_for_errors > 0)
+		if(archive && (hydro_files || !Forecaster->ifis_display))
+			Asynch_Reset_Temp_Files(asynch,0.0);
+		else
 		{
-			if(my_rank == 0)	printf("[%i]: Attempting resend of hydrographs data (%i).\n",my_rank,repeat_for_errors);
-			sleep(5);
 			repeat_for_errors = Asynch_Create_Output(asynch,hydro_additional);
+			while(repeat_for_errors > 0)
+			{
+				if(my_rank == 0)	printf("[%i]: Attempting resend of hydrographs data (%i).\n",my_rank,repeat_for_errors);
+				sleep(5);
+				repeat_for_errors = Asynch_Create_Output(asynch,hydro_additional);
+			}
 		}
 
 		//Call functions *********************************************************************************************************************
@@ -596,7 +648,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 			if(my_rank == 0)
 			{
 				//Connect to database
-				ConnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+				ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 
 				//Functions for displaying data on IFIS
 				if(Forecaster->ifis_display)
@@ -607,7 +659,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 					{
 						repeat_for_errors = 0;
 						sprintf(query,"SELECT get_stages_%s();",Forecaster->model_name);
-						res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+						res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 						repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage function");
 						PQclear(res);
 						if(repeat_for_errors)
@@ -624,7 +676,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 					{
 						repeat_for_errors = 0;
 						sprintf(query,"SELECT update_warnings_%s();",Forecaster->model_name);
-						res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+						res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 						repeat_for_errors = repeat_for_errors || CheckResError(res,"calling warnings function");
 						PQclear(res);
 						if(repeat_for_errors)
@@ -637,8 +689,8 @@ printf("first: %u last: %u\n",first_file,last_file);
 */
 				}
 
-				//Stage archive
-				repeat_for_errors = 1;
+				//Stage archive. This is skipped when the hydrographs are streamed into the archive.
+				repeat_for_errors = (archive == NULL);
 				while(repeat_for_errors)
 				{
 					repeat_for_errors = 0;
@@ -648,7 +700,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 					PQclear(res);
 
 					sprintf(query,"SELECT copy_to_archive_hydroforecast_%s();",Forecaster->model_name);
-					res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]->conn,query);
+					res = ExecPreparedPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],query,0,NULL);
 					repeat_for_errors = repeat_for_errors || CheckResError(res,"calling stage archive function");
 					PQclear(res);
 
@@ -666,7 +718,29 @@ printf("first: %u last: %u\n",first_file,last_file);
 				}
 
 				//Disconnect
-				DisconnectPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+				DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
+			}
+
+			//Stream the hydrographs directly into the archive
+			while(HydroArchive_Upload(archive,asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT],Forecaster,num_tables,current_offset,schema))
+			{
+				if(my_rank == 0)	printf("[%i]: Attempting resend of hydrographs to the archive.\n",my_rank);
+				sleep(db_retry_time);
+			}
+		}
+		else if(archive)
+		{
+			sprintf(query,"%s_%s.hcol",asynch->GlobalVars->hydros_loc_filename,hydro_additional);
+			while(HydroArchive_WriteColumnar(archive,query,current_offset))
+			{
+				if(my_rank == 0)	printf("[%i]: Attempting to write hydrograph file again.\n",my_rank);
+				sleep(5);
+			}
+
+			while(my_rank == 0 && SendFilesTo51(query,snapshot_file_location))
+			{
+				printf("[%i]: Error scp'ing hydrograph file. Retrying...\n",my_rank);
+				sleep(5);
 			}
 		}
 		else
@@ -687,6 +761,7 @@ printf("first: %u last: %u\n",first_file,last_file);
 		}
 
 		MPI_Barrier(MPI_COMM_WORLD);
+		FreeDBLock(asynch->db_connections[ASYNCH_DB_LOC_HYDRO_OUTPUT]);
 		if(my_rank == 0)
 		{
 			time(&stop);
@@ -703,7 +778,9 @@ printf("first: %u last: %u\n",first_file,last_file);
 	}
 
 	//Save the last timestep
-	if(my_rank == 0)
+	if(Forecaster->control_request)
+		WriteControlReply(Forecaster,first_file);
+	else if(my_rank == 0)
 	{
 		FILE* exitfile = fopen(argv[5],"w");
 		if(!exitfile)	printf("Error opening exit file %s\n",argv[5]);
@@ -713,14 +790,27 @@ printf("first: %u last: %u\n",first_file,last_file);
 			fclose(exitfile);
 		}
 	}
+
+	//Wait for the next window
+	if(!halt && Forecaster->control_request && !NextWindow(asynch,Forecaster,window))
+	{
+		num_windows++;
+		goto next_window;
+	}
+	if(checkpoint_time)	SaveWarmStart(asynch,checkpoint,Forecaster,checkpoint_time);
 	MPI_Barrier(MPI_COMM_WORLD);
 
 	//Clean up **********************************************************************************************************************************
 	if(hydro_additional)	free(hydro_additional);
 	if(snapshot_additional)	free(snapshot_additional);
 	free(query);
-	for(i=0;i<N;i++)	v_free(backup[i]);
-	free(backup);
+	Free_StateCheckpoint(&checkpoint);
+	Free_RainPrefetch(&prefetch);
+	Free_RainCache(&rain_cache);
+	Free_HydroArchive(&archive);
+	Free_PeakflowHorizons(&horizons);
+	if(peakflows)	CopyBinary_Free(&peakflows);
+	ClosePooledPGDB();
 	Free_ForecastData(&Forecaster);
 	Asynch_Delete_Temporary_Files(asynch);
 	Free_Output_PeakflowUser_Offset(asynch);
@@ -746,6 +836,44 @@ void UploadPeakflows(asynchsolver* asynch,unsigned int wait_time)
 	}
 }
 
+//Checks if the forcing needed to forecast from start_time is in the database.
+//Returns 1 if it is, 0 if not. This must be called by all procs.
+int HaveNewForcing(asynchsolver* asynch,ForecastData* Forecaster,unsigned int start_time)
+{
+	int isnull = 1;
+	char query[1024];
+	PGresult *res;
+
+	if(my_rank == 0)
+	{
+		ConnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]); //!!!! Assumes forecaster_idx is 0 !!!!
+		sprintf(query,Forecaster->rainmaps_db->queries[0],start_time + 60 * (unsigned int) rint(asynch->forcings[0]->file_time) * (Forecaster->num_rainsteps-1));
+		res = PQexec(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]->conn,query);
+		CheckResError(res,"checking for new rainfall data");
+		isnull = PQgetisnull(res,0,0);
+		PQclear(res);
+		DisconnectPooledPGDB(asynch->db_connections[ASYNCH_DB_LOC_FORCING_START]);
+	}
+	MPI_Bcast(&isnull,1,MPI_INT,0,MPI_COMM_WORLD);
+
+	return !isnull;
+}
+
+//Reads windows from the control fifo until one has new forcing. Windows without new forcing are answered
+//with their start timestamp, so the driver sees no progress. This must be called by all procs.
+//Returns 0 if window holds the next window to forecast, 1 if the driver is finished.
+int NextWindow(asynchsolver* asynch,ForecastData* Forecaster,unsigned int* window)
+{
+	while(!ReadControlWindow(Forecaster,window))
+	{
+		if(HaveNewForcing(asynch,Forecaster,window[0]))	return 0;
+		if(my_rank == 0)	printf("No new forcing for the window starting at %u.\n",window[0]);
+		WriteControlReply(Forecaster,window[0]);
+	}
+
+	return 1;
+}
+
 //Output functions ****************************************************************************
 int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user)
 {
@@ -756,59 +884,79 @@ int Output_Linkid(double t,VEC* y_i,VEC* global_params,VEC* params,int state,voi
 int Output_Timestamp(double t,VEC* y_i,VEC* global_params,VEC* params,int state,void* user)
 {
 	CustomParams* forecastparams = (CustomParams*) user;
-	return (int)(round(t * 60.0 + forecastparams->offset) + 0.1);
+	OutputCycle* cycle = forecastparams->cycle;
+	int timestamp = (int)(round(t * 60.0 + cycle->offset) + 0.1);
+	if(cycle->peaks)	PeakflowHorizons_AddSample(cycle->peaks,forecastparams->slot,t,y_i);
+	if(cycle->archive)	HydroArchive_AddSample(cycle->archive,forecastparams->ID,t,(unsigned int) timestamp,y_i,cycle->offset);
+	return timestamp;
 }
 
 void OutputPeakflow_Forecast_Maps(unsigned int ID,double peak_time,VEC* peak_value,VEC* params,VEC* global_params,double conversion,unsigned int area_idx,void* user,char* buffer)
 {
-	CustomParamsMaps* forecastparams = (CustomParamsMaps*) user;
+	OutputCycle* forecastparams = (OutputCycle*) user;
 	sprintf(buffer,"%u %u %.6e %u %u\n",ID,forecastparams->forecast_time + (unsigned int)(peak_time*60 + .1),peak_value->ve[0],forecastparams->forecast_time,forecastparams->period);
 }
 
 
 //Custom parameters for forecasting ***********************************************************
-void Init_Output_User_forecastparams(asynchsolver* asynch)
+//Each link points to its entry in one array of CustomParams, which all point to the same OutputCycle.
+//The array starts at the output_user of the first link of this process.
+void Init_Output_User_forecastparams(asynchsolver* asynch,HydroArchive* archive)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
+	OutputCycle* cycle;
+
+	if(!my_N)	return;
+	cycle = (OutputCycle*) calloc(1,sizeof(OutputCycle));
+	cycle->archive = archive;
+	forecastparams = (CustomParams*) malloc(my_N*sizeof(CustomParams));
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->output_user = malloc(sizeof(CustomParams));
+	{
+		forecastparams[i].ID = sys[my_sys[i]]->ID;
+		forecastparams[i].slot = i;
+		forecastparams[i].cycle = cycle;
+		sys[my_sys[i]]->output_user = &(forecastparams[i]);
+	}
 }
 
 void Free_Output_User_forecastparams(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
+	CustomParams* forecastparams;
 
+	if(!my_N)	return;
+	forecastparams = (CustomParams*) sys[my_sys[0]]->output_user;
+	free(forecastparams->cycle);
+	free(forecastparams);
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->output_user);
 		sys[my_sys[i]]->output_user = NULL;
-	}
 }
 
 void Set_Output_User_forecastparams(asynchsolver* asynch,unsigned int offset)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-	CustomParams* forecastparams;
+	if(asynch->my_N)
+		((CustomParams*) asynch->sys[asynch->my_sys[0]]->output_user)->cycle->offset = offset;
+}
 
-	for(i=0;i<my_N;i++)
-	{
-		forecastparams = (CustomParams*) sys[my_sys[i]]->output_user;
-		forecastparams->ID = sys[my_sys[i]]->ID;
-		forecastparams->offset = offset;
-	}
+//Points the sample output routine at the running peakflows of the horizons.
+void Set_Output_User_Peakflows(asynchsolver* asynch,PeakflowHorizons* peaks)
+{
+	if(asynch->my_N)
+		((CustomParams*) asynch->sys[asynch->my_sys[0]]->output_user)->cycle->peaks = peaks;
 }
 
+//The peakflow output routine only needs the cycle, so every link shares it. This must be called after Init_Output_User_forecastparams.
 void Init_Output_PeakflowUser_Offset(asynchsolver* asynch)
 {
 	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-		sys[my_sys[i]]->peakoutput_user = malloc(sizeof(CustomParamsMaps));
+		sys[my_sys[i]]->peakoutput_user = ((CustomParams*) sys[my_sys[i]]->output_user)->cycle;
 }
 
 void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
@@ -817,24 +965,16 @@ void Free_Output_PeakflowUser_Offset(asynchsolver* asynch)
 	Link** sys = asynch->sys;
 
 	for(i=0;i<my_N;i++)
-	{
-		free(sys[my_sys[i]]->peakoutput_user);
 		sys[my_sys[i]]->peakoutput_user = NULL;
-	}
 }
 
 void Set_Output_PeakflowUser_Offset(asynchsolver* asynch,unsigned int forecast_time,unsigned int period)
 {
-	unsigned int i,my_N = asynch->my_N,*my_sys = asynch->my_sys;
-	Link** sys = asynch->sys;
-	CustomParamsMaps* peak_params;
+	OutputCycle* cycle;
 
-	for(i=0;i<my_N;i++)
-	{
-		peak_params = (CustomParamsMaps*) (sys[my_sys[i]]->peakoutput_user);
-		peak_params->forecast_time = forecast_time;
-		peak_params->period = period;
-	}
+	if(!asynch->my_N)	return;
+	cycle = (OutputCycle*) asynch->sys[asynch->my_sys[0]]->peakoutput_user;
+	cycle->forecast_time = forecast_time;
+	cycle->period = period;
 }
 
-
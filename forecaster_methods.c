@@ -1,5 +1,78 @@
 #include "forecaster_methods.h"
 
+//Sessions kept open by the connection pool
+typedef struct PooledConn
+{
+	ConnData* conninfo;
+	PGconn* conn;
+	time_t last_used;
+} PooledConn;
+
+static PooledConn* conn_pool = NULL;
+static unsigned int conn_pool_size = 0;
+
+//Days (from the database) on which each archive table was last found to be aligned
+typedef struct PartitionCheck
+{
+	char name[256];
+	unsigned int day;
+} PartitionCheck;
+
+static PartitionCheck* partition_checks = NULL;
+static unsigned int num_partition_checks = 0;
+
+//Upload slot held on each connection (see WaitForDB)
+typedef struct UploadSlot
+{
+	ConnData* conninfo;
+	int slot;
+} UploadSlot;
+
+static UploadSlot* upload_slots = NULL;
+static unsigned int num_upload_slots = 0;
+
+//Statements prepared on each session (see ExecPreparedPGDB). The registry is shared by every thread of the process.
+typedef struct PreparedStatement
+{
+	PGconn* conn;
+	char* sql;
+	char name[32];
+} PreparedStatement;
+
+static PreparedStatement* prepared = NULL;
+static unsigned int num_prepared = 0;
+static unsigned int next_prepared_id = 0;
+static pthread_mutex_t prepared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Returns the upload slot entry of conninfo. A new entry holds no slot (-1).
+static UploadSlot* GetUploadSlot(ConnData* conninfo)
+{
+	unsigned int i;
+
+	for(i=0;i<num_upload_slots;i++)
+		if(upload_slots[i].conninfo == conninfo)	return &(upload_slots[i]);
+
+	upload_slots = (UploadSlot*) realloc(upload_slots,(num_upload_slots+1)*sizeof(UploadSlot));
+	upload_slots[num_upload_slots].conninfo = conninfo;
+	upload_slots[num_upload_slots].slot = -1;
+	return &(upload_slots[num_upload_slots++]);
+}
+
+//Returns the entry of the alignment cache for schema.tablename_model. A new entry has day 0.
+static PartitionCheck* GetPartitionCheck(ForecastData* Forecaster,char* tablename,char* schema)
+{
+	unsigned int i;
+	char name[256];
+
+	snprintf(name,256,"%s%s_%s",schema,tablename,Forecaster->model_name);
+	for(i=0;i<num_partition_checks;i++)
+		if(strcmp(partition_checks[i].name,name) == 0)	return &(partition_checks[i]);
+
+	partition_checks = (PartitionCheck*) realloc(partition_checks,(num_partition_checks+1)*sizeof(PartitionCheck));
+	strcpy(partition_checks[num_partition_checks].name,name);
+	partition_checks[num_partition_checks].day = 0;
+	return &(partition_checks[num_partition_checks++]);
+}
 
 //Deletes all future values from a set of partitioned tables.
 int DeleteFutureValues(ConnData* conninfo,unsigned int num_tables,UnivVars* GlobalVars,char* table_name,char* model_name,unsigned int clear_after,unsigned int equal,char* schema)
@@ -13,7 +86,7 @@ int DeleteFutureValues(ConnData* conninfo,unsigned int num_tables,UnivVars* Glob
 	char operation[3];
 	if(equal)	sprintf(operation,">=");
 	else		sprintf(operation,">");
-	ConnectPGDB(conninfo);
+	ConnectPooledPGDB(conninfo);
 
 	//Find the last table with values to destroy
 	time(&current_time);
@@ -23,36 +96,37 @@ int DeleteFutureValues(ConnData* conninfo,unsigned int num_tables,UnivVars* Glob
 	last_table = (num_tables < del_table) ? num_tables : del_table;
 	for(i=0;i<last_table;i++)
 	{
-		sprintf(query,"TRUNCATE %s%s_%s_%i;",schema,table_name,model_name,i);
+		snprintf(query,GlobalVars->query_size,"TRUNCATE %s%s_%s_%i;",schema,table_name,model_name,i);
 		res = PQexec(conninfo->conn,query);
 		error = CheckResError(res,"truncating table");
 		PQclear(res);
-		if(error)	return error;
+		if(error)	break;
 	}
 
 	//Delete del_table
-	if(del_table < num_tables)
+	if(!error && del_table < num_tables)
 	{
-		sprintf(query,"DELETE FROM %s%s_%s_%i WHERE forecast_time %s %u;",schema,table_name,model_name,i,operation,clear_after);
-		res = PQexec(conninfo->conn,query);
+		snprintf(query,GlobalVars->query_size,"DELETE FROM %s%s_%s_%i WHERE forecast_time %s $1;",schema,table_name,model_name,i,operation);
+		res = ExecPreparedPGDB(conninfo,query,1,(int[]) { (int) clear_after });
 		error = CheckResError(res,"deleting from table");
 		PQclear(res);
-		if(error)	return error;
 	}
 
 	//Clean up
-	DisconnectPGDB(conninfo);
+	DisconnectPooledPGDB(conninfo);
 	free(query);
 	return error;
 }
 
 
 //Checks if the time is right to perform maintainance on the database.
+//The archive tables are rotated in a single transaction, so readers never see a half renamed set. If a
+//lock cannot be taken quickly or any step fails, nothing is changed and maintainance is tried again later.
 void PerformTableMaintainance(ConnData* conninfo_hydros,UnivVars* GlobalVars,ForecastData* Forecaster,short int* vac,short unsigned int hr1,unsigned int num_tables,char* tablename,char* schema)
 {
 	if(!conninfo_hydros)	return;
 
-	int j;
+	int j,error;
 	time_t start,stop;
 	PGresult* res;
 	char query[GlobalVars->query_size];
@@ -65,36 +139,57 @@ void PerformTableMaintainance(ConnData* conninfo_hydros,UnivVars* GlobalVars,For
 		printf("[%i]: Performing maintainance. Current time is %s",my_rank,asctime(timeinfo));
 
 		//Adjust partitioned hydroforecast tables
-		ConnectPGDB(conninfo_hydros);
-		sprintf(query,"DROP TABLE %s%s_%s_%u;",schema,tablename,Forecaster->model_name,num_tables-1);
-		res = PQexec(conninfo_hydros->conn,query);
-		CheckResError(res,"dropping end archive table");
-		PQclear(res);
-
-		for(j=num_tables-2;j>=0;j--)
+		if(ConnectPooledPGDB(conninfo_hydros))	return;
+		if(IsDeclarativePartitioned(conninfo_hydros,Forecaster,tablename,schema))
+			error = RotateDeclarativePartitions(conninfo_hydros,Forecaster,num_tables,tablename,schema);
+		else
 		{
-			sprintf(query,"ALTER TABLE %s%s_%s_%i RENAME TO %s_%s_%i;",schema,tablename,Forecaster->model_name,j,tablename,Forecaster->model_name,j+1);
-			res = PQexec(conninfo_hydros->conn,query);
-			CheckResError(res,"renaming table");
-			PQclear(res);
+			error = BeginPGTransaction(conninfo_hydros,ROTATION_LOCK_TIMEOUT);
 
-			sprintf(query,"ALTER INDEX idx_%s_%s_%i_forecast_time_link_id RENAME TO idx_%s_%s_%i_forecast_time_link_id;",tablename,Forecaster->model_name,j,tablename,Forecaster->model_name,j+1);
-			res = PQexec(conninfo_hydros->conn,query);
-			CheckResError(res,"renaming index on archive table");
-			PQclear(res);
-		}
+			if(!error)
+			{
+				sprintf(query,"DROP TABLE %s%s_%s_%u;",schema,tablename,Forecaster->model_name,num_tables-1);
+				res = PQexec(conninfo_hydros->conn,query);
+				error |= CheckResError(res,"dropping end archive table");
+				PQclear(res);
+			}
 
-		sprintf(query,"CREATE TABLE %s%s_%s_0 ( ) INHERITS (%smaster_%s_%s);",schema,tablename,Forecaster->model_name,schema,tablename,Forecaster->model_name);
-		res = PQexec(conninfo_hydros->conn,query);
-		CheckResError(res,"creating archive table 0");
-		PQclear(res);
+			for(j=num_tables-2;j>=0 && !error;j--)
+			{
+				sprintf(query,"ALTER TABLE %s%s_%s_%i RENAME TO %s_%s_%i;",schema,tablename,Forecaster->model_name,j,tablename,Forecaster->model_name,j+1);
+				res = PQexec(conninfo_hydros->conn,query);
+				error |= CheckResError(res,"renaming table");
+				PQclear(res);
 
-		sprintf(query,"CREATE INDEX idx_%s_%s_0_forecast_time_link_id ON %s%s_%s_0 USING btree (forecast_time,link_id);",tablename,Forecaster->model_name,schema,tablename,Forecaster->model_name);
-		res = PQexec(conninfo_hydros->conn,query);
-		CheckResError(res,"creating index on archive table 0");
-		PQclear(res);
+				sprintf(query,"ALTER INDEX idx_%s_%s_%i_forecast_time_link_id RENAME TO idx_%s_%s_%i_forecast_time_link_id;",tablename,Forecaster->model_name,j,tablename,Forecaster->model_name,j+1);
+				res = PQexec(conninfo_hydros->conn,query);
+				error |= CheckResError(res,"renaming index on archive table");
+				PQclear(res);
+			}
+
+			if(!error)
+			{
+				sprintf(query,"CREATE TABLE %s%s_%s_0 ( ) INHERITS (%smaster_%s_%s);",schema,tablename,Forecaster->model_name,schema,tablename,Forecaster->model_name);
+				res = PQexec(conninfo_hydros->conn,query);
+				error |= CheckResError(res,"creating archive table 0");
+				PQclear(res);
+
+				sprintf(query,"CREATE INDEX idx_%s_%s_0_forecast_time_link_id ON %s%s_%s_0 USING btree (forecast_time,link_id);",tablename,Forecaster->model_name,schema,tablename,Forecaster->model_name);
+				res = PQexec(conninfo_hydros->conn,query);
+				error |= CheckResError(res,"creating index on archive table 0");
+				PQclear(res);
+			}
+
+			error = EndPGTransaction(conninfo_hydros,error);
+		}
+		DisconnectPooledPGDB(conninfo_hydros);
+		GetPartitionCheck(Forecaster,tablename,schema)->day = 0;	//CheckPartitionedTable must look again
 
-		DisconnectPGDB(conninfo_hydros);
+		if(error)
+		{
+			printf("[%i]: Maintainance of %s_%s failed. The tables were not changed.\n\n",my_rank,tablename,Forecaster->model_name);
+			return;
+		}
 
 		//Set flag and print the total time
 		*vac = 1;
@@ -104,47 +199,109 @@ void PerformTableMaintainance(ConnData* conninfo_hydros,UnivVars* GlobalVars,For
 	else	if(timeinfo->tm_hour != hr1)	*vac = 0;
 }
 
-//Checks that the timestamps of the archive tables match up correctly with the trigger.
-//If not, the tables are adjusted.
-//Note: The total number of tables is hard coded below.
+//Starts a transaction on conninfo. Any lock the transaction waits on for more than lock_timeout seconds causes an error.
+//Returns 0 on success, 1 on error.
+int BeginPGTransaction(ConnData* conninfo,unsigned int lock_timeout)
+{
+	PGresult* res;
+	char query[64];
+	int error;
+
+	sprintf(query,"BEGIN; SET LOCAL lock_timeout = '%us';",lock_timeout);
+	res = PQexec(conninfo->conn,query);
+	error = CheckResError(res,"starting transaction");
+	PQclear(res);
+	return error;
+}
+
+//Ends the transaction on conninfo. The transaction is committed if error is 0, and rolled back otherwise.
+//Returns 0 if the transaction was committed, 1 otherwise.
+int EndPGTransaction(ConnData* conninfo,int error)
+{
+	PGresult* res;
+
+	res = PQexec(conninfo->conn,error ? "ROLLBACK;" : "COMMIT;");
+	if(CheckResError(res,error ? "rolling back transaction" : "committing transaction"))	error = 1;
+	PQclear(res);
+	return error;
+}
+
+//Locks master_tablename_model until the end of the transaction on conninfo. Rotations of the child tables take
+//SHARE ROW EXCLUSIVE mode, so only one runs at a time. Writers that pick a child table by day take ROW EXCLUSIVE
+//mode, so the tables are not shifted between finding the child table and writing to it.
+//Returns 1 if an error occurred, 0 otherwise.
+static int LockArchiveMaster(ConnData* conninfo,char* schema,char* tablename,char* model_name,char* mode)
+{
+	PGresult* res;
+	char query[strlen(schema) + strlen(tablename) + strlen(model_name) + 128];
+	int error;
+
+	sprintf(query,"LOCK TABLE %smaster_%s_%s IN %s MODE;",schema,tablename,model_name,mode);
+	res = PQexec(conninfo->conn,query);
+	error = CheckResError(res,"locking archive tables");
+	PQclear(res);
+	return error;
+}
+
 //Checks that the timestamps of a partitioned table match up correctly with the trigger.
 //If not, the child tables are adjusted.
+//The result is cached until the UTC day changes, so repeated calls during a day do not touch the database.
 //void CheckPeakforecastTable(ConnData* conninfo,UnivVars* GlobalVars,ForecastData* Forecaster,unsigned int num_tables)
 void CheckPartitionedTable(ConnData* conninfo,UnivVars* GlobalVars,ForecastData* Forecaster,unsigned int num_tables,char* tablename,char* colname,char* schema)
 {
 	if(!conninfo)	return;
 
 	unsigned int i,current_time,table_time,table_index,correct_table_index,diff_table_index;
-	int diff_time,j,last_table_index;
+	int diff_time,j,last_table_index,error = 0;
 	PGresult *res;
 	char* query = conninfo->query;
+	char* probe;
+	time_t now = time(NULL);
+	PartitionCheck* checked = GetPartitionCheck(Forecaster,tablename,schema);
+
+	//Already checked today. The day from the database is used, so a lagging database clock only causes extra checks.
+	if(checked->day && checked->day == (unsigned int) (now - now % 86400))	return;
 
 	//Connect to db
-	ConnectPGDB(conninfo);
+	if(ConnectPooledPGDB(conninfo))	return;
 
 	//Grab the current time from the database
-	sprintf(query,"SELECT EXTRACT('epoch' FROM current_date AT time zone 'UTC');");
-	res = PQexec(conninfo->conn,query);
-	current_time = (unsigned int) rint(atof(PQgetvalue(res,0,0)));
-	PQclear(res);
+	current_time = GetCurrentDay(conninfo);
+	if(!current_time)
+	{
+		error = 1;
+		goto finish_up;
+	}
 
-	//Find the first table with something in it
-	table_index = num_tables;
+	//Declarative partitions are placed by their bounds, not their contents
+	if(IsDeclarativePartitioned(conninfo,Forecaster,tablename,schema))
+	{
+		error = RotateDeclarativePartitions(conninfo,Forecaster,num_tables,tablename,schema);
+		goto finish_up;
+	}
+
+	//Find the first table with something in it. The range of every table is read with one query.
+	probe = (char*) malloc(num_tables*(96 + 2*strlen(colname) + strlen(schema) + strlen(tablename) + strlen(Forecaster->model_name)) + 16);
+	probe[0] = '\0';
 	for(i=0;i<num_tables;i++)
+		sprintf(probe + strlen(probe),"%sSELECT %u,min(%s),max(%s) FROM %s%s_%s_%u",(i) ? " UNION ALL " : "",i,colname,colname,schema,tablename,Forecaster->model_name,i);
+	strcat(probe," ORDER BY 1;");
+	res = PQexec(conninfo->conn,probe);
+	free(probe);
+	error = CheckResError(res,"checking table contents");
+	table_index = num_tables;
+	for(i=0;i<(unsigned int)PQntuples(res) && !error;i++)
 	{
-		sprintf(query,"SELECT %s FROM %s%s_%s_%u LIMIT 1;",colname,schema,tablename,Forecaster->model_name,i);
-		res = PQexec(conninfo->conn,query);
-		CheckResError(res,"checking table contents");
-		if(PQntuples(res))
+		if(!PQgetisnull(res,i,1))
 		{
-			table_time = (unsigned int) atoi(PQgetvalue(res,0,0));
+			table_time = (unsigned int) atoi(PQgetvalue(res,i,1));
 			diff_time = table_time - current_time;
-			table_index = i;
-			PQclear(res);
+			table_index = (unsigned int) atoi(PQgetvalue(res,i,0));
 			break;
 		}
-		PQclear(res);
 	}
+	PQclear(res);
+	if(error)	goto finish_up;
 
 	//If no data exists in any table, then all is well
 	if(table_index == num_tables)
@@ -168,46 +325,214 @@ void CheckPartitionedTable(ConnData* conninfo,UnivVars* GlobalVars,ForecastData*
 	}
 	diff_table_index = correct_table_index - table_index;
 
+	//Shift the tables in one transaction
+	error = BeginPGTransaction(conninfo,ROTATION_LOCK_TIMEOUT);
+	if(!error)	error = LockArchiveMaster(conninfo,schema,tablename,Forecaster->model_name,"SHARE ROW EXCLUSIVE");
+
 	//Trash the tables at the end
 	last_table_index = num_tables-diff_table_index - 1;
-	for(j=num_tables-1;j>last_table_index;j--)
+	for(j=num_tables-1;j>last_table_index && !error;j--)
 	{
 		sprintf(query,"DROP TABLE %s%s_%s_%u;",schema,tablename,Forecaster->model_name,j);
 		res = PQexec(conninfo->conn,query);
-		CheckResError(res,"dropping table");
+		error |= CheckResError(res,"dropping table");
 		PQclear(res);
 	}
 
 	//Move all the tables
-	for(j=last_table_index;j>=0;j--)
+	for(j=last_table_index;j>=0 && !error;j--)
 	{
 		sprintf(query,"ALTER TABLE %s%s_%s_%i RENAME TO %s_%s_%i;",schema,tablename,Forecaster->model_name,j,tablename,Forecaster->model_name,j+diff_table_index);
 		res = PQexec(conninfo->conn,query);
-		CheckResError(res,"renaming table");
+		error |= CheckResError(res,"renaming table");
 		PQclear(res);
 
 		sprintf(query,"ALTER INDEX idx_%s_%s_%i_forecast_time_link_id RENAME TO idx_%s_%s_%i_forecast_time_link_id;",tablename,Forecaster->model_name,j,tablename,Forecaster->model_name,j+diff_table_index);
 		res = PQexec(conninfo->conn,query);
-		CheckResError(res,"renaming index on archive table");
+		error |= CheckResError(res,"renaming index on archive table");
 		PQclear(res);
 	}
 
 	//Create new tables
-	for(i=0;i<diff_table_index;i++)
+	for(i=0;i<diff_table_index && !error;i++)
 	{
 		sprintf(query,"CREATE TABLE %s%s_%s_%u ( ) INHERITS (%smaster_%s_%s);",schema,tablename,Forecaster->model_name,i,schema,tablename,Forecaster->model_name);
 		res = PQexec(conninfo->conn,query);
-		CheckResError(res,"creating table");
+		error |= CheckResError(res,"creating table");
 		PQclear(res);
 
 		sprintf(query,"CREATE INDEX idx_%s_%s_%u_forecast_time_link_id ON %s%s_%s_%u USING btree (forecast_time,link_id);",tablename,Forecaster->model_name,i,schema,tablename,Forecaster->model_name,i);
 		res = PQexec(conninfo->conn,query);
-		CheckResError(res,"creating index on archive table");
+		error |= CheckResError(res,"creating index on archive table");
 		PQclear(res);
 	}
 
+	error = EndPGTransaction(conninfo,error);
+	if(error)	printf("[%i]: Could not shift the tables of %s_%s. They will be checked again.\n",my_rank,tablename,Forecaster->model_name);
+
 	finish_up:
-	DisconnectPGDB(conninfo);
+	DisconnectPooledPGDB(conninfo);
+	if(!error)	checked->day = current_time;
+}
+
+//Returns 1 if master_tablename_model is a declaratively partitioned table (see CREATETABLES), 0 if it uses
+//inheritance and the insert trigger. conninfo must already be connected.
+short int IsDeclarativePartitioned(ConnData* conninfo,ForecastData* Forecaster,char* tablename,char* schema)
+{
+	PGresult *res;
+	short int partitioned = 0;
+
+	sprintf(conninfo->query,"SELECT relkind FROM pg_class WHERE oid = to_regclass('%smaster_%s_%s');",schema,tablename,Forecaster->model_name);
+	res = PQexec(conninfo->conn,conninfo->query);
+	if(!CheckResError(res,"checking archive partitioning") && PQntuples(res))
+		partitioned = (PQgetvalue(res,0,0)[0] == 'p');
+	PQclear(res);
+	return partitioned;
+}
+
+//Creates the partition tablename_model_suffix of master_tablename_model for forecast times in [day_start,day_start+86400).
+//Nothing is done if the partition exists. Rows for the day already in the default partition are moved into the new one,
+//as PostgreSQL will not create a partition for values the default partition holds. This must be called inside a
+//transaction, and conninfo must already be connected. Returns 1 if an error occurred, 0 otherwise.
+int CreateDayPartition(ConnData* conninfo,ForecastData* Forecaster,char* tablename,char* schema,char* suffix,unsigned int day_start)
+{
+	PGresult *res;
+	int error;
+	short int exists = 0;
+
+	sprintf(conninfo->query,"SELECT to_regclass('%s%s_%s_%s') IS NOT NULL;",schema,tablename,Forecaster->model_name,suffix);
+	res = PQexec(conninfo->conn,conninfo->query);
+	error = CheckResError(res,"checking archive partition");
+	if(!error)	exists = (PQgetvalue(res,0,0)[0] == 't');
+	PQclear(res);
+	if(error || exists)	return error;
+
+	//Take the day's rows out of the default partition
+	sprintf(conninfo->query,"CREATE TEMP TABLE fcst_default_rows AS WITH moved AS (DELETE FROM %s%s_%s_default WHERE forecast_time >= %u AND forecast_time < %u RETURNING *) SELECT * FROM moved;",schema,tablename,Forecaster->model_name,day_start,day_start+86400);
+	res = PQexec(conninfo->conn,conninfo->query);
+	error = CheckResError(res,"moving rows out of default archive partition");
+	PQclear(res);
+	if(error)	return error;
+
+	sprintf(conninfo->query,"CREATE TABLE %s%s_%s_%s PARTITION OF %smaster_%s_%s FOR VALUES FROM (%u) TO (%u);",schema,tablename,Forecaster->model_name,suffix,schema,tablename,Forecaster->model_name,day_start,day_start+86400);
+	res = PQexec(conninfo->conn,conninfo->query);
+	error = CheckResError(res,"creating archive partition");
+	PQclear(res);
+	if(error)	return error;
+
+	sprintf(conninfo->query,"INSERT INTO %s%s_%s_%s SELECT * FROM fcst_default_rows; DROP TABLE fcst_default_rows;",schema,tablename,Forecaster->model_name,suffix);
+	res = PQexec(conninfo->conn,conninfo->query);
+	error = CheckResError(res,"moving rows into archive partition");
+	PQclear(res);
+	if(error)	return error;
+
+	sprintf(conninfo->query,"CREATE INDEX idx_%s_%s_%s_forecast_time_link_id ON %s%s_%s_%s USING btree (forecast_time,link_id);",tablename,Forecaster->model_name,suffix,schema,tablename,Forecaster->model_name,suffix);
+	res = PQexec(conninfo->conn,conninfo->query);
+	error = CheckResError(res,"creating index on archive partition");
+	PQclear(res);
+	return error;
+}
+
+//Shifts the day partitions of master_tablename_model so that partition 0 holds the current day (UTC).
+//The day held by partition 0 is read from its bounds. Partitions that fall off the end are dropped, the
+//partition for tomorrow (suffix next) becomes the newest day partition, and any missing partitions
+//(including a new next) are created ahead of time. All changes are made in one transaction. conninfo must already be connected.
+//Returns 1 if an error occurred, 0 otherwise.
+int RotateDeclarativePartitions(ConnData* conninfo,ForecastData* Forecaster,unsigned int num_tables,char* tablename,char* schema)
+{
+	PGresult *res;
+	char* query = conninfo->query;
+	char suffix[16];
+	unsigned int current_day,table_day = 0,days,shift;
+	int i,error = 0;
+
+	current_day = GetCurrentDay(conninfo);
+	if(!current_day)	return 1;
+
+	//Find the day held by partition 0
+	sprintf(query,"SELECT pg_get_expr(relpartbound,oid) FROM pg_class WHERE oid = to_regclass('%s%s_%s_0');",schema,tablename,Forecaster->model_name);
+	res = PQexec(conninfo->conn,query);
+	if(CheckResError(res,"reading archive partition bounds"))	error = 1;
+	else if(PQntuples(res) && !PQgetisnull(res,0,0))	sscanf(PQgetvalue(res,0,0),"FOR VALUES FROM (%u)",&table_day);
+	PQclear(res);
+	if(error)	return error;
+
+	if(table_day > current_day)
+	{
+		printf("[%i]: Error: Partition 0 of %s_%s is ahead of the current day (%u > %u).\n",my_rank,tablename,Forecaster->model_name,table_day,current_day);
+		return 1;
+	}
+	days = (table_day) ? (current_day - table_day) / 86400 : num_tables + 1;
+	shift = (days < num_tables) ? days : num_tables;
+
+	//Everything below is one transaction
+	if(BeginPGTransaction(conninfo,ROTATION_LOCK_TIMEOUT))	return 1;
+	error = LockArchiveMaster(conninfo,schema,tablename,Forecaster->model_name,"SHARE ROW EXCLUSIVE");
+
+	if(shift)
+	{
+		printf("[%i]: Shifting partitions of %s_%s by %u day(s).\n",my_rank,tablename,Forecaster->model_name,days);
+
+		//Trash the partitions at the end
+		for(i=num_tables-1;i>=(int)(num_tables-shift);i--)
+		{
+			sprintf(query,"DROP TABLE IF EXISTS %s%s_%s_%i;",schema,tablename,Forecaster->model_name,i);
+			res = PQexec(conninfo->conn,query);
+			error |= CheckResError(res,"dropping archive partition");
+			PQclear(res);
+		}
+
+		//Move the rest
+		for(i=num_tables-shift-1;i>=0;i--)
+		{
+			sprintf(query,"ALTER TABLE IF EXISTS %s%s_%s_%i RENAME TO %s_%s_%i;",schema,tablename,Forecaster->model_name,i,tablename,Forecaster->model_name,i+shift);
+			res = PQexec(conninfo->conn,query);
+			error |= CheckResError(res,"renaming archive partition");
+			PQclear(res);
+
+			sprintf(query,"ALTER INDEX IF EXISTS %sidx_%s_%s_%i_forecast_time_link_id RENAME TO idx_%s_%s_%i_forecast_time_link_id;",schema,tablename,Forecaster->model_name,i,tablename,Forecaster->model_name,i+shift);
+			res = PQexec(conninfo->conn,query);
+			error |= CheckResError(res,"renaming index on archive partition");
+			PQclear(res);
+		}
+
+		//The partition created ahead of time holds the day after the old partition 0
+		if(days <= num_tables)
+		{
+			sprintf(query,"ALTER TABLE IF EXISTS %s%s_%s_next RENAME TO %s_%s_%u;",schema,tablename,Forecaster->model_name,tablename,Forecaster->model_name,shift-1);
+			res = PQexec(conninfo->conn,query);
+			error |= CheckResError(res,"renaming next archive partition");
+			PQclear(res);
+
+			sprintf(query,"ALTER INDEX IF EXISTS %sidx_%s_%s_next_forecast_time_link_id RENAME TO idx_%s_%s_%u_forecast_time_link_id;",schema,tablename,Forecaster->model_name,tablename,Forecaster->model_name,shift-1);
+			res = PQexec(conninfo->conn,query);
+			error |= CheckResError(res,"renaming index on next archive partition");
+			PQclear(res);
+		}
+		else
+		{
+			sprintf(query,"DROP TABLE IF EXISTS %s%s_%s_next;",schema,tablename,Forecaster->model_name);
+			res = PQexec(conninfo->conn,query);
+			error |= CheckResError(res,"dropping next archive partition");
+			PQclear(res);
+		}
+
+		//Rows outside every day are discarded, as with the insert trigger
+		sprintf(query,"TRUNCATE %s%s_%s_default;",schema,tablename,Forecaster->model_name);
+		res = PQexec(conninfo->conn,query);
+		error |= CheckResError(res,"truncating default archive partition");
+		PQclear(res);
+	}
+
+	//Create anything missing
+	for(i=0;i<(int)num_tables;i++)
+	{
+		sprintf(suffix,"%i",i);
+		error |= CreateDayPartition(conninfo,Forecaster,tablename,schema,suffix,current_day - 86400*i);
+	}
+	error |= CreateDayPartition(conninfo,Forecaster,tablename,schema,"next",current_day + 86400);
+
+	return EndPGTransaction(conninfo,error);
 }
 
 //Creates the halt file and sets the value to 0
@@ -258,109 +583,134 @@ short int CheckFinished(char* filename)
 	return halt;
 }
 
-//This function holds a proc until it's safe to upload data to a database.
-//This is used to prevent multiple forecasters from choking the database.
-//Returns 0 if the proc is safe to upload, 1 if an error occurred.
-int WaitForDB(ConnData* conninfo,unsigned int naptime,int stale_time,unsigned int query_size)
+//Reads the next forecast window from the request fifo of Forecaster. Blocks until a driver writes one.
+//A window is a line with the start, end, and init timestamps. window must have room for all three.
+//Returns 0 if a window was read, 1 if the driver is finished (the line is "quit" or the fifo is closed without data).
+int ReadControlWindow(ForecastData* Forecaster,unsigned int* window)
 {
-	char tablename[] = "forecaster_upload";
-	char query[query_size];
-	PGresult *res;
-	int error = 0;
-	int flag,time,now,wait;
-	short int status;
+	FILE* fifo;
+	int finished = 1;
 
 	if(my_rank == 0)
 	{
-		//Connect to db
-		ConnectPGDB(conninfo);
+		fifo = fopen(Forecaster->control_request,"r");
+		if(!fifo)	printf("[%i]: Error: Could not open control fifo %s.\n",my_rank,Forecaster->control_request);
+		else
+		{
+			if(fscanf(fifo,"%u %u %u",&(window[0]),&(window[1]),&(window[2])) == 3)	finished = 0;
+			fclose(fifo);
+		}
+	}
 
-		//Check that the table exists
-		sprintf(query,"CREATE TABLE IF NOT EXISTS %s(flag integer, set_time integer);",tablename);
-		res = PQexec(conninfo->conn,query);
-		if(CheckResError(res,"creating forecaster upload table"))	error = 1;
-		PQclear(res);
+	MPI_Bcast(&finished,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(!finished)	MPI_Bcast(window,3,MPI_UNSIGNED,0,MPI_COMM_WORLD);
+	return finished;
+}
 
-		do
+//Writes the timestamp reached in the last window to the reply fifo of Forecaster. Blocks until the driver opens it.
+void WriteControlReply(ForecastData* Forecaster,unsigned int timestamp)
+{
+	FILE* fifo;
+
+	if(my_rank == 0)
+	{
+		fifo = fopen(Forecaster->control_reply,"w");
+		if(!fifo)	printf("[%i]: Error: Could not open control fifo %s.\n",my_rank,Forecaster->control_reply);
+		else
 		{
-			wait = 0;
+			fprintf(fifo,"%u\n",timestamp);
+			fclose(fifo);
+		}
+	}
 
-			//See what's in the table
-			sprintf(query,"SELECT flag,set_time,EXTRACT('epoch' FROM current_timestamp)::integer FROM %s;",tablename);
-			res = PQexec(conninfo->conn,query);
-			if(CheckResError(res,"checking forecaster upload table"))	error = 1;
+	MPI_Barrier(MPI_COMM_WORLD);
+}
 
-			if(PQntuples(res) == 0)
-			{
-				PQclear(res);
-				sprintf(query,"INSERT INTO %s VALUES (0,EXTRACT('epoch' FROM current_timestamp)::integer); SELECT flag,set_time,EXTRACT('epoch' FROM current_timestamp)::integer FROM %s;",tablename,tablename);
-				res = PQexec(conninfo->conn,query);
-				if(CheckResError(res,"loading values into forecaster upload table"))	error = 1;
-			}
+//Takes one of num_slots upload slots on conn. If all are in use, every slot is tried again after a wait that
+//doubles up to UPLOAD_SLOT_MAX_WAIT seconds, so the first slot to come free is taken.
+//Returns the slot, or -1 if an error occurred.
+static int TakeUploadSlot(PGconn* conn,unsigned int num_slots)
+{
+	PGresult *res;
+	char query[256];
+	int slot = -1;
+	unsigned int wait = 1;
 
-			//Check if time is stale
-			flag = atoi(PQgetvalue(res,0,0));
-			time = atoi(PQgetvalue(res,0,1));
-			now = atoi(PQgetvalue(res,0,2));
+	sprintf(query,"SELECT s FROM generate_series(0,%u) s WHERE pg_try_advisory_lock(hashtext('%s'),s) LIMIT 1;",num_slots-1,UPLOAD_LOCK_NAME);
+	while(1)
+	{
+		//Take any free slot
+		res = PQexec(conn,query);
+		if(CheckResError(res,"checking upload slots"))
+		{
 			PQclear(res);
+			return -1;
+		}
+		if(PQntuples(res))	slot = atoi(PQgetvalue(res,0,0));
+		PQclear(res);
+		if(slot >= 0)	return slot;
 
-			if(now-time > stale_time || flag == 0)	//Timestamp is really old or no one is uploading. So try to go.
-			{
-				sprintf(query,"LOCK TABLE %s IN ACCESS EXCLUSIVE MODE NOWAIT; TRUNCATE TABLE %s; INSERT INTO %s VALUES (1,EXTRACT('epoch' FROM current_timestamp)::integer);",tablename,tablename,tablename);
-				res = PQexec(conninfo->conn,query);
+		//All slots are busy
+		if(wait == 1)	printf("[%i]: All %u upload slots are in use. Waiting...\n",my_rank,num_slots);
+		sleep(wait);
+		if(2*wait <= UPLOAD_SLOT_MAX_WAIT)	wait *= 2;
+	}
+}
 
-				status = PQresultStatus(res);
-				if( !(status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK) )	//Another forecaster beat you to the lock (or maybe an error occurred). Go back.
-				{
-					printf("[%i]: Someone else got the lock. Trying again...\n",my_rank);
-					wait = 1;
-					sleep(naptime);
-				}
-				PQclear(res);
-			}
-			else	//Another forecaster is actually uploading. Go back.
-			{
-				wait = 1;
-				sleep(naptime);
-			}
-		} while(wait && !error);
+//Releases an upload slot taken by TakeUploadSlot.
+static void GiveUploadSlot(PGconn* conn,int slot)
+{
+	PGresult *res;
+	char query[128];
+
+	sprintf(query,"SELECT pg_advisory_unlock(hashtext('%s'),%i);",UPLOAD_LOCK_NAME,slot);
+	res = PQexec(conn,query);
+	CheckResError(res,"releasing upload slot");
+	PQclear(res);
+}
+
+//This function holds a proc until it's safe to upload data to a database.
+//This is used to prevent multiple forecasters from choking the database. Up to num_slots forecasters may upload
+//at once. Each slot is a session level advisory lock on the pooled connection of conninfo, so the slot of a forecaster
+//that dies is released with its session. A forecaster waiting for a slot checks all of them again now and then.
+//If num_slots is 0, no coordination is done.
+//Returns 0 if the proc is safe to upload, 1 if an error occurred.
+int WaitForDB(ConnData* conninfo,unsigned int num_slots)
+{
+	int error = 0;
+	UploadSlot* held;
 
-		//Disconnect from db
-		DisconnectPGDB(conninfo);
+	if(my_rank == 0 && num_slots)
+	{
+		//Connect to db
+		if(ConnectPooledPGDB(conninfo))	error = 1;
+		else
+		{
+			held = GetUploadSlot(conninfo);
+			held->slot = TakeUploadSlot(conninfo->conn,num_slots);
+			if(held->slot < 0)	error = 1;
+			DisconnectPooledPGDB(conninfo);
+		}
 	}
 
 	MPI_Bcast(&error,1,MPI_INT,0,MPI_COMM_WORLD);
 	return error;
 }
 
-//Releases the lock set by the routine WaitForDB.
-void FreeDBLock(ConnData* conninfo,unsigned int query_size)
+//Releases the upload slot taken by the routine WaitForDB.
+void FreeDBLock(ConnData* conninfo)
 {
-	char tablename[] = "forecaster_upload";
-	char query[query_size];
-	PGresult *res;
-	int error;
+	UploadSlot* held = (my_rank == 0) ? GetUploadSlot(conninfo) : NULL;
 
-	if(my_rank == 0)
+	if(held && held->slot >= 0)
 	{
-		//Connect to db
-		ConnectPGDB(conninfo);
-
-		sprintf(query,"LOCK TABLE %s IN ACCESS EXCLUSIVE MODE NOWAIT; TRUNCATE TABLE %s; INSERT INTO %s VALUES (0,EXTRACT('epoch' FROM current_timestamp)::integer);",tablename,tablename,tablename);
-		do
+		//Connect to db. If the session was lost, so was the lock.
+		if(!ConnectPooledPGDB(conninfo))
 		{
-			res = PQexec(conninfo->conn,query);
-			error = CheckResError(res,"unlocking forecaster upload table");
-			PQclear(res);
-			if(error)
-			{
-				sleep(2*60);
-				CheckConnConnection(conninfo);
-			}
-		} while(error);
-
-		//Disconnect from db
-		DisconnectPGDB(conninfo);
+			GiveUploadSlot(conninfo->conn,held->slot);
+			DisconnectPooledPGDB(conninfo);
+		}
+		held->slot = -1;
 	}
 
 	MPI_Barrier(MPI_COMM_WORLD);
@@ -452,6 +802,7 @@ ForecastData* Init_ForecastData(char* fcst_filename,unsigned int string_size)
 
 		Forecaster->rainmaps_db = ReadDBC(Forecaster->rainmaps_filename,string_size);
 		if(!Forecaster->rainmaps_db)	return NULL;
+		Forecaster->rainmaps_probe = ParameterizeQuery(Forecaster->rainmaps_db->queries[0]);
 	}
 
 	//Read halt filename
@@ -466,14 +817,43 @@ ForecastData* Init_ForecastData(char* fcst_filename,unsigned int string_size)
 	//MPI_Bcast(&length,1,MPI_UNSIGNED,0,MPI_COMM_WORLD);
 	//MPI_Bcast(Forecaster->halt_filename,length+1,MPI_CHAR,0,MPI_COMM_WORLD);
 
-	//Read ending mark
-	//if(my_rank == 0)
+	//Set defaults for the optional settings
+	Forecaster->archive_copy = 0;
+	Forecaster->hydro_columnar = 0;
+	Forecaster->archive_discharge_idx = 0;
+	Forecaster->archive_baseflow_idx = 0;
+	Forecaster->rain_channel = NULL;
+	Forecaster->upload_slots = 0;
+	Forecaster->upload_ranks = 0;
+	Forecaster->background_upload = 0;
+	Forecaster->num_peakflow_horizons = 0;
+	Forecaster->peakflow_horizons = NULL;
+	Forecaster->peakflow_batch = 0;
+	Forecaster->peakflow_text = 0;
+	Forecaster->control_request = NULL;
+	Forecaster->control_reply = NULL;
+	Forecaster->network_cache = NULL;
+	Forecaster->warm_start = NULL;
+	Forecaster->gbl_init_filename = NULL;
+	Forecaster->warm_start_used[0] = '\0';
+	Forecaster->warm_start_saved[0] = '\0';
+	Forecaster->rain_prefetch = 0;
+	Forecaster->rain_cache_age = 0;
+	Forecaster->reuse_dry_forecasts = 0;
+	Forecaster->ensemble_filename = NULL;
+	Forecaster->ensemble_thresholds = NULL;
+	Forecaster->ensemble_horizon = 0;
+	Forecaster->ensemble_discharge_idx = 0;
+
+	//Read optional settings until the ending mark
+	do
 	{
+		linebuffer[0] = '\0';
 		ReadLineFromTextFile(inputfile,linebuffer,buff_size,string_size);
-		valsread = sscanf(linebuffer,"%c",&end_char);
+		valsread = sscanf(linebuffer," %c",&end_char);
 		if(ReadLineError(valsread,1,"ending mark"))	return NULL;
-	}
-	//MPI_Bcast(&end_char,1,MPI_CHAR,0,MPI_COMM_WORLD);
+		if(end_char != '#' && ReadForecastOption(Forecaster,linebuffer))	return NULL;
+	} while(end_char != '#');
 
 	//Clean up
 	free(linebuffer);
@@ -489,37 +869,182 @@ ForecastData* Init_ForecastData(char* fcst_filename,unsigned int string_size)
 	return Forecaster;
 }
 
-void Free_ForecastData(ForecastData** Forecaster)
+//Reads an optional setting from a line of a forecast file. Each setting is a keyword followed by its values.
+//A setting given more than once keeps its last values.
+//Returns 0 if the setting was read, 1 if an error occurred.
+int ReadForecastOption(ForecastData* Forecaster,char* linebuffer)
 {
-	if((*Forecaster)->rainmaps_filename)
-	{
-		free((*Forecaster)->rainmaps_filename);
-		ConnData_Free((*Forecaster)->rainmaps_db);
-	}
-	free((*Forecaster)->model_name);
-	free((*Forecaster)->halt_filename);
-	free(*Forecaster);
-	*Forecaster = NULL;
-}
+	char keyword[64];
+	int valsread;
 
+	sscanf(linebuffer,"%63s",keyword);
 
-//Uses ssh to transfer a data file.
-//I took most of this code from the example file scp_write.c in the libssh2 examples.
-//!!!! This could really be generalized... !!!!
-int SendFilesTo51(char* loclfile,char* serverlocation)
-{
-	char filename[1024];
-	int error_code = 0;
-	if(FindFilename(loclfile,filename))
+	if(strcmp(keyword,"archive_copy") == 0)	//Stream hydrographs into the archive with binary COPY
 	{
-		printf("Error: Bad filename for hydrograph file. (%s)\n",loclfile);
-		return 1;
+		valsread = sscanf(linebuffer,"%*s %u %u",&(Forecaster->archive_discharge_idx),&(Forecaster->archive_baseflow_idx));
+		if(ReadLineError(valsread,2,"archive_copy state indices"))	return 1;
+		Forecaster->archive_copy = 1;
 	}
-
-	char scppath[1024];
-	sprintf(scppath,"%s/%s",serverlocation,filename);
-	//sprintf(scppath,"/data/ifc_01_hydro/%s",filename);
-
+	else if(strcmp(keyword,"hydro_columnar") == 0)	//Write hydrograph files in the columnar format
+	{
+		valsread = sscanf(linebuffer,"%*s %u %u",&(Forecaster->archive_discharge_idx),&(Forecaster->archive_baseflow_idx));
+		if(ReadLineError(valsread,2,"hydro_columnar state indices"))	return 1;
+		Forecaster->hydro_columnar = 1;
+	}
+	else if(strcmp(keyword,"peakflow_horizons") == 0)	//Number of horizons, then each horizon in minutes
+	{
+		unsigned int i;
+		int offset,place;
+
+		valsread = sscanf(linebuffer,"%*s %u%n",&(Forecaster->num_peakflow_horizons),&place);
+		if(ReadLineError(valsread,1,"number of peakflow horizons"))	return 1;
+		if(Forecaster->peakflow_horizons)	free(Forecaster->peakflow_horizons);
+		Forecaster->peakflow_horizons = (double*) malloc(Forecaster->num_peakflow_horizons*sizeof(double));
+		for(i=0;i<Forecaster->num_peakflow_horizons;i++)
+		{
+			valsread = sscanf(linebuffer + place,"%lf%n",&(Forecaster->peakflow_horizons[i]),&offset);
+			if(ReadLineError(valsread,1,"peakflow horizon"))	return 1;
+			if(i && Forecaster->peakflow_horizons[i] <= Forecaster->peakflow_horizons[i-1])
+			{
+				if(my_rank == 0)	printf("[%i]: Error: Peakflow horizons must be increasing.\n",my_rank);
+				return 1;
+			}
+			place += offset;
+		}
+	}
+	else if(strcmp(keyword,"peakflow_text") == 0)	//Send peakflows through the text output routine, for debugging
+	{
+		Forecaster->peakflow_text = 1;
+	}
+	else if(strcmp(keyword,"peakflow_batch") == 0)	//Upload the peakflows of every horizon at once
+	{
+		Forecaster->peakflow_batch = 1;
+	}
+	else if(strcmp(keyword,"background_upload") == 0)	//Upload hydrographs while the next forecast runs
+	{
+		Forecaster->background_upload = 1;
+	}
+	else if(strcmp(keyword,"upload_slots") == 0)	//Number of forecasters that may upload at once
+	{
+		valsread = sscanf(linebuffer,"%*s %u",&(Forecaster->upload_slots));
+		if(ReadLineError(valsread,1,"upload_slots count"))	return 1;
+	}
+	else if(strcmp(keyword,"upload_ranks") == 0)	//Number of procs that copy rows to the database at once
+	{
+		valsread = sscanf(linebuffer,"%*s %u",&(Forecaster->upload_ranks));
+		if(ReadLineError(valsread,1,"upload_ranks count"))	return 1;
+	}
+	else if(strcmp(keyword,"rain_notify") == 0)	//Wake up on a notification when new rainfall arrives
+	{
+		if(Forecaster->rain_channel)	free(Forecaster->rain_channel);
+		Forecaster->rain_channel = (char*) malloc(64*sizeof(char));
+		valsread = sscanf(linebuffer,"%*s %63s",Forecaster->rain_channel);
+		if(ReadLineError(valsread,1,"rain_notify channel"))	return 1;
+	}
+	else if(strcmp(keyword,"network_cache") == 0)	//Directory for topology and parameter files made from the database
+	{
+		if(Forecaster->network_cache)	free(Forecaster->network_cache);
+		Forecaster->network_cache = (char*) malloc(256*sizeof(char));
+		valsread = sscanf(linebuffer,"%*s %255s",Forecaster->network_cache);
+		if(ReadLineError(valsread,1,"network_cache directory"))	return 1;
+	}
+	else if(strcmp(keyword,"rain_prefetch") == 0)	//Read the next block of rainfall while the second phase runs
+	{
+		Forecaster->rain_prefetch = 1;
+	}
+	else if(strcmp(keyword,"rain_cache") == 0)	//Share blocks of rainfall with other forecasters for this many seconds
+	{
+		valsread = sscanf(linebuffer,"%*s %u",&(Forecaster->rain_cache_age));
+		if(ReadLineError(valsread,1,"rain_cache age"))	return 1;
+	}
+	else if(strcmp(keyword,"reuse_dry_forecasts") == 0)	//Keep the last forecast for up to this many passes without rain
+	{
+		valsread = sscanf(linebuffer,"%*s %u",&(Forecaster->reuse_dry_forecasts));
+		if(ReadLineError(valsread,1,"reuse_dry_forecasts count"))	return 1;
+	}
+	else if(strcmp(keyword,"ensemble") == 0)	//Forcing of each member, minutes of member forcing, and the state with discharge
+	{
+		if(Forecaster->ensemble_filename)	free(Forecaster->ensemble_filename);
+		Forecaster->ensemble_filename = (char*) malloc(256*sizeof(char));
+		valsread = sscanf(linebuffer,"%*s %255s %u %u",Forecaster->ensemble_filename,&(Forecaster->ensemble_horizon),&(Forecaster->ensemble_discharge_idx));
+		if(ReadLineError(valsread,3,"ensemble members, horizon, and state index"))	return 1;
+	}
+	else if(strcmp(keyword,"ensemble_thresholds") == 0)	//Discharge at each link for the exceedance probability of the ensemble
+	{
+		if(Forecaster->ensemble_thresholds)	free(Forecaster->ensemble_thresholds);
+		Forecaster->ensemble_thresholds = (char*) malloc(256*sizeof(char));
+		valsread = sscanf(linebuffer,"%*s %255s",Forecaster->ensemble_thresholds);
+		if(ReadLineError(valsread,1,"ensemble_thresholds filename"))	return 1;
+	}
+	else if(strcmp(keyword,"warm_start") == 0)	//Directory for the states used to start the next run
+	{
+		if(Forecaster->warm_start)	free(Forecaster->warm_start);
+		Forecaster->warm_start = (char*) malloc(256*sizeof(char));
+		valsread = sscanf(linebuffer,"%*s %255s",Forecaster->warm_start);
+		if(ReadLineError(valsread,1,"warm_start directory"))	return 1;
+	}
+	else if(strcmp(keyword,"control_fifo") == 0)	//Take forecast windows from a fifo and answer on another
+	{
+		if(Forecaster->control_request)	free(Forecaster->control_request);
+		Forecaster->control_request = (char*) malloc(256*sizeof(char));
+		if(Forecaster->control_reply)	free(Forecaster->control_reply);
+		Forecaster->control_reply = (char*) malloc(256*sizeof(char));
+		valsread = sscanf(linebuffer,"%*s %255s %255s",Forecaster->control_request,Forecaster->control_reply);
+		if(ReadLineError(valsread,2,"control_fifo request and reply fifos"))	return 1;
+	}
+	else
+	{
+		if(my_rank == 0)	printf("[%i]: Error: Unknown forecast file setting %s.\n",my_rank,keyword);
+		return 1;
+	}
+
+	return 0;
+}
+
+void Free_ForecastData(ForecastData** Forecaster)
+{
+	if((*Forecaster)->rainmaps_filename)
+	{
+		free((*Forecaster)->rainmaps_filename);
+		free((*Forecaster)->rainmaps_probe);
+		ConnData_Free((*Forecaster)->rainmaps_db);
+	}
+	free((*Forecaster)->model_name);
+	free((*Forecaster)->halt_filename);
+	if((*Forecaster)->rain_channel)	free((*Forecaster)->rain_channel);
+	if((*Forecaster)->peakflow_horizons)	free((*Forecaster)->peakflow_horizons);
+	if((*Forecaster)->network_cache)	free((*Forecaster)->network_cache);
+	if((*Forecaster)->warm_start)	free((*Forecaster)->warm_start);
+	if((*Forecaster)->gbl_init_filename)	free((*Forecaster)->gbl_init_filename);
+	if((*Forecaster)->ensemble_filename)	free((*Forecaster)->ensemble_filename);
+	if((*Forecaster)->ensemble_thresholds)	free((*Forecaster)->ensemble_thresholds);
+	if((*Forecaster)->control_request)
+	{
+		free((*Forecaster)->control_request);
+		free((*Forecaster)->control_reply);
+	}
+	free(*Forecaster);
+	*Forecaster = NULL;
+}
+
+
+//Uses ssh to transfer a data file.
+//I took most of this code from the example file scp_write.c in the libssh2 examples.
+//!!!! This could really be generalized... !!!!
+int SendFilesTo51(char* loclfile,char* serverlocation)
+{
+	char filename[1024];
+	int error_code = 0;
+	if(FindFilename(loclfile,filename))
+	{
+		printf("Error: Bad filename for hydrograph file. (%s)\n",loclfile);
+		return 1;
+	}
+
+	char scppath[1024];
+	sprintf(scppath,"%s/%s",serverlocation,filename);
+	//sprintf(scppath,"/data/ifc_01_hydro/%s",filename);
+
 	//Uh, yeah, probably not very secure...
 	char *username = "my_user_name",*password = "my_password";
 
@@ -654,3 +1179,2450 @@ int SendFilesTo51(char* loclfile,char* serverlocation)
 }
 
 
+
+
+//Archive tables ******************************************************************************
+
+#define CURRENT_DAY_QUERY "SELECT EXTRACT('epoch' FROM current_date AT time zone 'UTC');"
+
+//Grabs the timestamp for the start of the current day (UTC) from the database.
+//The connection must already be open. Returns 0 if an error occurred.
+unsigned int GetCurrentDay(ConnData* conninfo)
+{
+	unsigned int current_day = 0;
+	PGresult* res;
+
+	res = ExecPreparedPGDB(conninfo,CURRENT_DAY_QUERY,0,NULL);
+	if(!CheckResError(res,"getting the current day"))
+		current_day = (unsigned int) rint(atof(PQgetvalue(res,0,0)));
+	PQclear(res);
+
+	return current_day;
+}
+
+//Returns the index of the child table of a partitioned archive holding data for forecast_time.
+//This matches the routing in the insert triggers created by CREATETABLES. Returns -1 if the time is beyond the current day.
+int ArchiveTableIndex(unsigned int forecast_time,unsigned int current_day)
+{
+	if(forecast_time >= current_day + 86400)	return -1;
+	return (int) ((current_day + 86399 - forecast_time) / 86400);
+}
+
+
+//Binary COPY *********************************************************************************
+
+//Appends the lowest num_bytes of value to the buffer in network byte order.
+static void CopyBinary_PutBytes(CopyBinary* copier,unsigned long long int value,unsigned int num_bytes)
+{
+	unsigned int i;
+
+	if(copier->size + num_bytes > copier->capacity)
+	{
+		while(copier->size + num_bytes > copier->capacity)	copier->capacity *= 2;
+		copier->buffer = (char*) realloc(copier->buffer,copier->capacity*sizeof(char));
+	}
+
+	for(i=num_bytes;i>0;i--)
+		copier->buffer[copier->size++] = (char) ((value >> (8*(i-1))) & 0xFF);
+}
+
+CopyBinary* CopyBinary_Create(unsigned int capacity)
+{
+	CopyBinary* copier = (CopyBinary*) malloc(sizeof(CopyBinary));
+	copier->capacity = (capacity > 64) ? capacity : 64;
+	copier->buffer = (char*) malloc(copier->capacity*sizeof(char));
+	copier->size = 0;
+	copier->num_rows = 0;
+	return copier;
+}
+
+void CopyBinary_Free(CopyBinary** copier)
+{
+	if(!(*copier))	return;
+	free((*copier)->buffer);
+	free(*copier);
+	*copier = NULL;
+}
+
+void CopyBinary_Reset(CopyBinary* copier)
+{
+	copier->size = 0;
+	copier->num_rows = 0;
+}
+
+void CopyBinary_StartRow(CopyBinary* copier,short int num_fields)
+{
+	CopyBinary_PutBytes(copier,(unsigned short int) num_fields,2);
+	(copier->num_rows)++;
+}
+
+void CopyBinary_PutInt(CopyBinary* copier,int value)
+{
+	CopyBinary_PutBytes(copier,4,4);
+	CopyBinary_PutBytes(copier,(unsigned int) value,4);
+}
+
+void CopyBinary_PutDouble(CopyBinary* copier,double value)
+{
+	unsigned long long int bits;
+	memcpy(&bits,&value,sizeof(double));
+	CopyBinary_PutBytes(copier,8,4);
+	CopyBinary_PutBytes(copier,bits,8);
+}
+
+void CopyBinary_PutNull(CopyBinary* copier)
+{
+	CopyBinary_PutBytes(copier,0xFFFFFFFF,4);
+}
+
+//Timestamps are sent as microseconds since 2000-01-01 UTC.
+void CopyBinary_PutTimestamp(CopyBinary* copier,unsigned int unix_time)
+{
+	long long int usecs = ((long long int) unix_time - 946684800LL) * 1000000LL;
+	CopyBinary_PutBytes(copier,8,4);
+	CopyBinary_PutBytes(copier,(unsigned long long int) usecs,8);
+}
+
+//Sends a block of binary rows to table with a single COPY. The connection must already be open.
+//columns is a list of the columns in each row, such as "(link_id,discharge)", or "" if each row has every column in order.
+//Returns 0 if the rows were copied, 1 if an error occurred.
+int CopyBinary_Send(PGconn* conn,char* table,char* columns,char* data,unsigned long long int size)
+{
+	unsigned long long int sent,piece;
+	static const char header[19] = { 'P','G','C','O','P','Y','\n','\377','\r','\n','\0', 0,0,0,0, 0,0,0,0 };
+	static const char trailer[2] = { '\377','\377' };
+	char query[strlen(table) + strlen(columns) + 64];
+	PGresult* res;
+	int error = 0;
+
+	sprintf(query,"COPY %s %s FROM STDIN (FORMAT binary);",table,columns);
+	res = PQexec(conn,query);
+	if(PQresultStatus(res) != PGRES_COPY_IN)
+	{
+		CheckResError(res,"starting binary copy");
+		PQclear(res);
+		return 1;
+	}
+	PQclear(res);
+
+	if(PQputCopyData(conn,header,sizeof(header)) != 1)	error = 1;
+	for(sent=0;!error && sent<size;sent+=piece)
+	{
+		piece = (size - sent < COPY_CHUNK_SIZE) ? size - sent : COPY_CHUNK_SIZE;
+		if(PQputCopyData(conn,data + sent,(int) piece) != 1)	error = 1;
+	}
+	if(!error && PQputCopyData(conn,trailer,sizeof(trailer)) != 1)	error = 1;
+	if(PQputCopyEnd(conn,error ? "error sending rows" : NULL) != 1)	error = 1;
+
+	while((res = PQgetResult(conn)) != NULL)
+	{
+		if(CheckResError(res,"copying binary rows"))	error = 1;
+		PQclear(res);
+	}
+
+	return error;
+}
+
+//Gathers the rows held by every process of comm into gathered on the first process of comm. gathered is only used there.
+//The rows may pass 2GB in total, so each process sends them in pieces of at most COPY_CHUNK_SIZE bytes.
+static void CopyBinary_GatherComm(CopyBinary* copier,CopyBinary* gathered,MPI_Comm comm)
+{
+	unsigned long long int size = copier->size,total = 0,pos,sent,piece,*sizes = NULL;
+	int i,rows = (int) copier->num_rows,total_rows = 0,comm_rank,comm_size;
+
+	MPI_Comm_rank(comm,&comm_rank);
+	MPI_Comm_size(comm,&comm_size);
+	if(comm_rank == 0)	sizes = (unsigned long long int*) malloc(comm_size*sizeof(unsigned long long int));
+	MPI_Gather(&size,1,MPI_UNSIGNED_LONG_LONG,sizes,1,MPI_UNSIGNED_LONG_LONG,0,comm);
+	MPI_Reduce(&rows,&total_rows,1,MPI_INT,MPI_SUM,0,comm);
+
+	if(comm_rank == 0)
+	{
+		for(i=0;i<comm_size;i++)	total += sizes[i];
+		if(total > gathered->capacity)
+		{
+			while(total > gathered->capacity)	gathered->capacity *= 2;
+			gathered->buffer = (char*) realloc(gathered->buffer,gathered->capacity*sizeof(char));
+		}
+		gathered->size = total;
+		gathered->num_rows = total_rows;
+
+		//The rows are placed in rank order
+		memcpy(gathered->buffer,copier->buffer,size);
+		for(i=1,pos=size;i<comm_size;i++)
+		{
+			for(sent=0;sent<sizes[i];sent+=piece)
+			{
+				piece = (sizes[i] - sent < COPY_CHUNK_SIZE) ? sizes[i] - sent : COPY_CHUNK_SIZE;
+				MPI_Recv(gathered->buffer + pos + sent,(int) piece,MPI_CHAR,i,0,comm,MPI_STATUS_IGNORE);
+			}
+			pos += sizes[i];
+		}
+		free(sizes);
+	}
+	else
+	{
+		for(sent=0;sent<size;sent+=piece)
+		{
+			piece = (size - sent < COPY_CHUNK_SIZE) ? size - sent : COPY_CHUNK_SIZE;
+			MPI_Send(copier->buffer + sent,(int) piece,MPI_CHAR,0,0,comm);
+		}
+	}
+}
+
+//Gathers the rows held by every process into gathered on proc 0. gathered is only used on proc 0.
+void CopyBinary_Gather(CopyBinary* copier,CopyBinary* gathered)
+{
+	CopyBinary_GatherComm(copier,gathered,MPI_COMM_WORLD);
+}
+
+//Gathers the rows held by every process and copies them into table through proc 0.
+//Returns 0 if the rows were copied, 1 if an error occurred. The rows are kept, so the call can be repeated.
+int CopyBinary_Upload(CopyBinary* copier,ConnData* conninfo,char* table,char* columns)
+{
+	int error = 0;
+	CopyBinary* gathered = NULL;
+
+	if(my_rank == 0)	gathered = CopyBinary_Create(1048576);
+	CopyBinary_Gather(copier,gathered);
+
+	if(my_rank == 0)
+	{
+		if(ConnectPooledPGDB(conninfo))	error = 1;
+		else
+		{
+			error = CopyBinary_Send(conninfo->conn,table,columns,gathered->buffer,gathered->size);
+			DisconnectPooledPGDB(conninfo);
+		}
+		CopyBinary_Free(&gathered);
+	}
+
+	MPI_Bcast(&error,1,MPI_INT,0,MPI_COMM_WORLD);
+	return error;
+}
+
+//Copies the rows held by every process into table through num_writers procs, each on its own connection.
+//The procs are split into num_writers groups of neighbouring ranks, and the rows of a group are gathered to its first proc.
+//Each writer copies straight into table in a prepared (two phase) transaction. Once every writer has prepared,
+//proc 0 commits them all, so the rows of the call are kept together. If any writer fails, the others roll back.
+//The database must allow num_writers prepared transactions (max_prepared_transactions). If it does not, or if
+//num_writers is 0 or 1, this is the same as CopyBinary_Upload.
+//Returns 0 if the rows were copied, 1 if an error occurred. The rows are kept, so the call can be repeated.
+int CopyBinary_UploadParallel(CopyBinary* copier,ConnData* conninfo,char* table,char* columns,unsigned int num_writers)
+{
+	static unsigned int num_uploads = 0;
+	int error = 0,prepared = 0,stride,num_groups,group_rank,i,ids[2] = { 0,0 };
+	char gid[64],query[128],*sqlstate;
+	CopyBinary* gathered = NULL;
+	MPI_Comm group;
+	PGresult* res;
+
+	if(num_writers <= 1 || np == 1)	return CopyBinary_Upload(copier,conninfo,table,columns);
+	if(num_writers > (unsigned int) np)	num_writers = np;
+	stride = (np + num_writers - 1) / num_writers;
+	num_groups = (np + stride - 1) / stride;
+
+	//Check that the writers can prepare their transactions. The ids name the transactions of this call.
+	if(my_rank == 0)
+	{
+		ids[0] = (int) getpid();
+		ids[1] = (int) num_uploads;
+		if(ConnectPooledPGDB(conninfo))	error = 1;
+		else
+		{
+			res = PQexec(conninfo->conn,"SHOW max_prepared_transactions;");
+			error = CheckResError(res,"checking prepared transactions");
+			if(!error && atoi(PQgetvalue(res,0,0)) < num_groups)
+			{
+				printf("[%i]: Warning: The database allows %s prepared transactions, but %i writers need one each. Copying through proc 0.\n",my_rank,PQgetvalue(res,0,0),num_groups);
+				ids[0] = -1;
+			}
+			PQclear(res);
+			DisconnectPooledPGDB(conninfo);
+		}
+	}
+	num_uploads++;
+	MPI_Bcast(&error,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(error)	return 1;
+	MPI_Bcast(ids,2,MPI_INT,0,MPI_COMM_WORLD);
+	if(ids[0] < 0)	return CopyBinary_Upload(copier,conninfo,table,columns);
+
+	//Each writer copies the rows of its group and prepares its transaction
+	MPI_Comm_split(MPI_COMM_WORLD,my_rank / stride,my_rank,&group);
+	MPI_Comm_rank(group,&group_rank);
+	if(group_rank == 0)	gathered = CopyBinary_Create(1048576);
+	CopyBinary_GatherComm(copier,gathered,group);
+	MPI_Comm_free(&group);
+
+	if(group_rank == 0)
+	{
+		sprintf(gid,"fcst_copy_%i_%i_%i",ids[0],ids[1],my_rank / stride);
+		if(ConnectPooledPGDB(conninfo))	error = 1;
+		else
+		{
+			res = PQexec(conninfo->conn,"BEGIN;");
+			error = CheckResError(res,"starting transaction");
+			PQclear(res);
+
+			if(!error)	error = CopyBinary_Send(conninfo->conn,table,columns,gathered->buffer,gathered->size);
+			if(!error)
+			{
+				sprintf(query,"PREPARE TRANSACTION '%s';",gid);
+				res = PQexec(conninfo->conn,query);
+				error = CheckResError(res,"preparing transaction");
+				PQclear(res);
+				prepared = !error;
+			}
+			else	PQclear(PQexec(conninfo->conn,"ROLLBACK;"));
+			DisconnectPooledPGDB(conninfo);
+		}
+		CopyBinary_Free(&gathered);
+	}
+	MPI_Allreduce(MPI_IN_PLACE,&error,1,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+
+	//Some writer failed. Nothing from this call is kept.
+	if(error)
+	{
+		if(prepared)
+		{
+			prepared = 0;
+			if(!ConnectPooledPGDB(conninfo))
+			{
+				sprintf(query,"ROLLBACK PREPARED '%s';",gid);
+				res = PQexec(conninfo->conn,query);
+				prepared = CheckResError(res,"rolling back prepared transaction");
+				PQclear(res);
+				DisconnectPooledPGDB(conninfo);
+			}
+			if(prepared)	printf("[%i]: Error: Prepared transaction %s is left in the database. It must be rolled back by hand.\n",my_rank,gid);
+		}
+		return 1;
+	}
+
+	//Every writer is prepared. A prepared transaction outlives its session, so proc 0 keeps trying until each
+	//one is committed. Otherwise only part of the rows would be kept, and a resend would duplicate the rest.
+	if(my_rank == 0)
+	{
+		for(i=0;i<num_groups;i++)
+		{
+			sprintf(query,"COMMIT PREPARED 'fcst_copy_%i_%i_%i';",ids[0],ids[1],i);
+			while(1)
+			{
+				if(!ConnectPooledPGDB(conninfo))
+				{
+					res = PQexec(conninfo->conn,query);
+					DisconnectPooledPGDB(conninfo);
+					sqlstate = PQresultErrorField(res,PG_DIAG_SQLSTATE);
+					if((sqlstate && strcmp(sqlstate,"42704") == 0) || !CheckResError(res,"committing prepared transaction"))	//Already committed, or done now
+					{
+						PQclear(res);
+						break;
+					}
+					PQclear(res);
+				}
+				printf("[%i]: Attempting to commit copied rows again.\n",my_rank);
+				sleep(5);
+			}
+		}
+	}
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	return 0;
+}
+
+
+//Hydrograph archive ****************************************************************************
+
+//Creates the buffers for streaming hydrographs into the archive. Returns NULL if the forecast file does not request it.
+//dim is the number of states at each link. If columnar is 1, the samples are kept for HydroArchive_WriteColumnar,
+//otherwise they are encoded as rows for HydroArchive_Upload and BackgroundUpload_Start.
+HydroArchive* Init_HydroArchive(ForecastData* Forecaster,unsigned int dim,short int columnar)
+{
+	HydroArchive* archive;
+
+	if(!Forecaster->archive_copy && !Forecaster->hydro_columnar)	return NULL;
+	if(Forecaster->archive_discharge_idx >= dim || Forecaster->archive_baseflow_idx >= dim)
+	{
+		if(my_rank == 0)	printf("[%i]: Error: hydrograph state indices (%u %u) must be less than %u.\n",my_rank,Forecaster->archive_discharge_idx,Forecaster->archive_baseflow_idx,dim);
+		return NULL;
+	}
+
+	archive = (HydroArchive*) malloc(sizeof(HydroArchive));
+	archive->rows = CopyBinary_Create(1048576);
+	archive->discharge_idx = Forecaster->archive_discharge_idx;
+	archive->baseflow_idx = Forecaster->archive_baseflow_idx;
+	archive->columnar = columnar;
+	archive->num_samples = 0;
+	archive->sample_capacity = columnar ? 1024 : 0;
+	archive->times = columnar ? (double*) malloc(archive->sample_capacity*sizeof(double)) : NULL;
+	archive->discharge = columnar ? (double*) malloc(archive->sample_capacity*sizeof(double)) : NULL;
+	archive->baseflow = columnar ? (double*) malloc(archive->sample_capacity*sizeof(double)) : NULL;
+	archive->timestamps = columnar ? (int*) malloc(archive->sample_capacity*sizeof(int)) : NULL;
+	archive->num_blocks = 0;
+	archive->block_capacity = columnar ? 256 : 0;
+	archive->block_ids = columnar ? (unsigned int*) malloc(archive->block_capacity*sizeof(unsigned int)) : NULL;
+	archive->block_starts = columnar ? (unsigned int*) malloc((archive->block_capacity + 1)*sizeof(unsigned int)) : NULL;
+	return archive;
+}
+
+void Free_HydroArchive(HydroArchive** archive)
+{
+	if(!(*archive))	return;
+	CopyBinary_Free(&((*archive)->rows));
+	free((*archive)->times);
+	free((*archive)->discharge);
+	free((*archive)->baseflow);
+	free((*archive)->timestamps);
+	free((*archive)->block_ids);
+	free((*archive)->block_starts);
+	free(*archive);
+	*archive = NULL;
+}
+
+//Clears the captured samples. This should be called before the first step of a forecast is written.
+void HydroArchive_Reset(HydroArchive* archive)
+{
+	if(!archive)	return;
+	CopyBinary_Reset(archive->rows);
+	archive->num_samples = 0;
+	archive->num_blocks = 0;
+}
+
+//Adds one sample of a hydrograph at time t (mins) of the simulation. timestamp is the time of the sample computed
+//by Output_Timestamp. Unless the archive is columnar, the sample is encoded as a row matching
+//master_archive_hydroforecast_modelname right here, so the rows are ready to upload without another pass.
+void HydroArchive_AddSample(HydroArchive* archive,unsigned int link_id,double t,unsigned int timestamp,VEC* y,unsigned int forecast_time)
+{
+	unsigned int j = archive->num_samples;
+	CopyBinary* rows = archive->rows;
+
+	if(!archive->columnar)
+	{
+		CopyBinary_StartRow(rows,5);
+		CopyBinary_PutInt(rows,(int) link_id);
+		CopyBinary_PutTimestamp(rows,timestamp);
+		CopyBinary_PutDouble(rows,y->ve[archive->discharge_idx]);
+		CopyBinary_PutDouble(rows,y->ve[archive->baseflow_idx]);
+		CopyBinary_PutInt(rows,(int) forecast_time);
+		archive->num_samples = j + 1;
+		return;
+	}
+
+	if(j == archive->sample_capacity)
+	{
+		archive->sample_capacity *= 2;
+		archive->times = (double*) realloc(archive->times,archive->sample_capacity*sizeof(double));
+		archive->discharge = (double*) realloc(archive->discharge,archive->sample_capacity*sizeof(double));
+		archive->baseflow = (double*) realloc(archive->baseflow,archive->sample_capacity*sizeof(double));
+		archive->timestamps = (int*) realloc(archive->timestamps,archive->sample_capacity*sizeof(int));
+	}
+
+	//Start a new block if the sample is from a different link than the last one
+	if(!archive->num_blocks || archive->block_ids[archive->num_blocks-1] != link_id)
+	{
+		if(archive->num_blocks == archive->block_capacity)
+		{
+			archive->block_capacity *= 2;
+			archive->block_ids = (unsigned int*) realloc(archive->block_ids,archive->block_capacity*sizeof(unsigned int));
+			archive->block_starts = (unsigned int*) realloc(archive->block_starts,(archive->block_capacity + 1)*sizeof(unsigned int));
+		}
+		archive->block_ids[archive->num_blocks] = link_id;
+		archive->block_starts[archive->num_blocks] = j;
+		(archive->num_blocks)++;
+	}
+
+	archive->times[j] = t;
+	archive->discharge[j] = y->ve[archive->discharge_idx];
+	archive->baseflow[j] = y->ve[archive->baseflow_idx];
+	archive->num_samples = j + 1;
+}
+
+//Copies the captured hydrographs of every process directly into the child archive table for forecast_time.
+//This replaces the trip through hydro_table and copy_to_archive_hydroforecast_modelname().
+//Returns 0 if the hydrographs were archived (or are too old for any table), 1 if an error occurred.
+int HydroArchive_Upload(HydroArchive* archive,ConnData* conninfo,ForecastData* Forecaster,unsigned int num_tables,unsigned int forecast_time,char* schema)
+{
+	int table_index = 0,error;
+	unsigned int current_day;
+	char table[strlen(schema) + strlen(Forecaster->model_name) + 64];
+
+	if(!archive)	return 0;
+
+	//Find the child table for this forecast. A failed lookup is retried like a failed upload.
+	if(my_rank == 0)
+	{
+		if(ConnectPooledPGDB(conninfo))	table_index = -2;
+		else
+		{
+			current_day = GetCurrentDay(conninfo);
+			table_index = (current_day) ? ArchiveTableIndex(forecast_time,current_day) : -2;
+			DisconnectPooledPGDB(conninfo);
+		}
+	}
+	MPI_Bcast(&table_index,1,MPI_INT,0,MPI_COMM_WORLD);
+
+	if(table_index == -2)	return 1;
+	if(table_index < 0 || table_index >= (int) num_tables)
+	{
+		if(my_rank == 0)	printf("[%i]: Warning: No archive table for hydrographs with forecast time %u.\n",my_rank,forecast_time);
+		return 0;
+	}
+
+	sprintf(table,"%sarchive_hydroforecast_%s_%i",schema,Forecaster->model_name,table_index);
+	error = CopyBinary_UploadParallel(archive->rows,conninfo,table,"(link_id,time_utc,discharge,baseflow,forecast_time)",Forecaster->upload_ranks);
+	if(!error && my_rank == 0)	printf("[%i]: Streamed hydrographs into %s.\n",my_rank,table);
+
+	return error;
+}
+
+
+//Columnar hydrograph files *********************************************************************
+
+//A run of samples of one link in the archive, for ordering the runs by link
+typedef struct HydroFileRun
+{
+	unsigned int link_id;
+	unsigned int start;
+	unsigned int end;
+} HydroFileRun;
+
+//Index entry of one link in a columnar hydrograph file
+typedef struct HydroFileEntry
+{
+	unsigned int link_id;
+	unsigned int num_samples;
+	unsigned long long int offset;
+	unsigned int size;
+} HydroFileEntry;
+
+static int CompareHydroFileRuns(const void* a,const void* b)
+{
+	const HydroFileRun *run_a = (const HydroFileRun*) a,*run_b = (const HydroFileRun*) b;
+	if(run_a->link_id != run_b->link_id)	return (run_a->link_id > run_b->link_id) - (run_a->link_id < run_b->link_id);
+	return (run_a->start > run_b->start) - (run_a->start < run_b->start);
+}
+
+static int CompareHydroFileEntries(const void* a,const void* b)
+{
+	unsigned int id_a = ((const HydroFileEntry*) a)->link_id,id_b = ((const HydroFileEntry*) b)->link_id;
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+//Overwrites 4 bytes at position pos of bytes
+static void HydroFile_SetUInt(CopyBinary* bytes,unsigned long long int pos,unsigned int value)
+{
+	unsigned long long int size = bytes->size;
+
+	bytes->size = pos;
+	CopyBinary_PutBytes(bytes,value,4);
+	bytes->size = size;
+}
+
+//Variable length integer, 7 bits per byte starting with the lowest. The high bit is set if more bytes follow.
+static void HydroFile_PutVarint(CopyBinary* bytes,unsigned long long int value)
+{
+	while(value >= 0x80)
+	{
+		CopyBinary_PutBytes(bytes,(value & 0x7F) | 0x80,1);
+		value >>= 7;
+	}
+	CopyBinary_PutBytes(bytes,value,1);
+}
+
+//Each value is stored as the XOR of its bits with the bits of the previous value (0 for the first).
+//A control byte holds the number of leading zero bytes (high nibble) and trailing zero bytes (low nibble)
+//of the XOR, followed by the bytes between them. A repeated value takes only the control byte 0x80.
+static void HydroFile_PutDoubles(CopyBinary* bytes,double* values,unsigned int n)
+{
+	unsigned int j,lead,trail;
+	unsigned long long int bits,prev = 0,x;
+
+	for(j=0;j<n;j++)
+	{
+		memcpy(&bits,&(values[j]),sizeof(double));
+		x = bits ^ prev;
+		prev = bits;
+		if(!x)
+		{
+			CopyBinary_PutBytes(bytes,0x80,1);
+			continue;
+		}
+
+		for(lead=0;!((x >> (56 - 8*lead)) & 0xFF);lead++);
+		for(trail=0;!((x >> (8*trail)) & 0xFF);trail++);
+		CopyBinary_PutBytes(bytes,(lead << 4) | trail,1);
+		CopyBinary_PutBytes(bytes,x >> (8*trail),8 - lead - trail);
+	}
+}
+
+//Writes the captured hydrographs of every process into one columnar file. Each process orders its samples by link,
+//encodes them, and writes them at its own offset in the file. Proc 0 writes the header and the index of every link.
+//The layout is described in the documentation. The samples are kept, so the call can be repeated.
+//Returns 0 if the file was written, 1 if an error occurred. This must be called by all procs.
+int HydroArchive_WriteColumnar(HydroArchive* archive,char* filename,unsigned int forecast_time)
+{
+	unsigned int b,j,k,n,num_runs = archive->num_blocks,num_entries = 0,total_entries = 0;
+	unsigned long long int pos,mark,size,offset = 0,total = 0,sent,piece;
+	long long int delta;
+	int i,error = 0,count,*counts = NULL,*displs = NULL;
+	int* timestamps = archive->timestamps;
+	double *discharge,*baseflow;
+	CopyBinary* bytes = archive->rows;
+	CopyBinary* index = NULL;
+	HydroFileRun* runs;
+	HydroFileEntry *entries,*all_entries = NULL;
+	MPI_File file;
+
+	//Order the runs by link. Runs of the same link stay in time order.
+	archive->block_starts[archive->num_blocks] = archive->num_samples;
+	runs = (HydroFileRun*) malloc((num_runs + 1)*sizeof(HydroFileRun));
+	for(b=0;b<num_runs;b++)
+	{
+		runs[b].link_id = archive->block_ids[b];
+		runs[b].start = archive->block_starts[b];
+		runs[b].end = archive->block_starts[b+1];
+	}
+	qsort(runs,num_runs,sizeof(HydroFileRun),CompareHydroFileRuns);
+
+	//Copy the columns in that order
+	discharge = (double*) malloc((archive->num_samples + 1)*sizeof(double));
+	baseflow = (double*) malloc((archive->num_samples + 1)*sizeof(double));
+	for(b=0,k=0;b<num_runs;b++)
+	{
+		for(j=runs[b].start;j<runs[b].end;j++,k++)
+		{
+			timestamps[k] = (int)(round(archive->times[j] * 60.0 + forecast_time) + 0.1);
+			discharge[k] = archive->discharge[j];
+			baseflow[k] = archive->baseflow[j];
+		}
+	}
+
+	//Encode each link. The block starts with the sizes of the three columns, so a reader can skip to any of them.
+	CopyBinary_Reset(bytes);
+	entries = (HydroFileEntry*) malloc((num_runs + 1)*sizeof(HydroFileEntry));
+	for(b=0,k=0;b<num_runs;b=j)
+	{
+		for(j=b,n=0;j<num_runs && runs[j].link_id == runs[b].link_id;j++)	n += runs[j].end - runs[j].start;
+
+		entries[num_entries].link_id = runs[b].link_id;
+		entries[num_entries].num_samples = n;
+		entries[num_entries].offset = bytes->size;
+		pos = bytes->size;
+		CopyBinary_PutBytes(bytes,0,12);
+
+		CopyBinary_PutBytes(bytes,(unsigned int) timestamps[k],4);
+		for(i=1;i<(int) n;i++)
+		{
+			delta = (long long int) timestamps[k+i] - (long long int) timestamps[k+i-1];
+			HydroFile_PutVarint(bytes,(unsigned long long int) ((delta << 1) ^ (delta >> 63)));
+		}
+		HydroFile_SetUInt(bytes,pos,bytes->size - pos - 12);
+
+		mark = bytes->size;
+		HydroFile_PutDoubles(bytes,discharge + k,n);
+		HydroFile_SetUInt(bytes,pos + 4,bytes->size - mark);
+
+		mark = bytes->size;
+		HydroFile_PutDoubles(bytes,baseflow + k,n);
+		HydroFile_SetUInt(bytes,pos + 8,bytes->size - mark);
+
+		entries[num_entries].size = bytes->size - pos;
+		num_entries++;
+		k += n;
+	}
+	free(runs);
+	free(discharge);
+	free(baseflow);
+
+	//Find where this process writes
+	size = bytes->size;
+	MPI_Exscan(&size,&offset,1,MPI_UNSIGNED_LONG_LONG,MPI_SUM,MPI_COMM_WORLD);
+	if(my_rank == 0)	offset = 0;
+	offset += HYDRO_FILE_HEADER_SIZE;
+	MPI_Allreduce(&size,&total,1,MPI_UNSIGNED_LONG_LONG,MPI_SUM,MPI_COMM_WORLD);
+	for(j=0;j<num_entries;j++)	entries[j].offset += offset;
+
+	//Gather the index on proc 0
+	count = num_entries * sizeof(HydroFileEntry);
+	if(my_rank == 0)
+	{
+		counts = (int*) malloc(np*sizeof(int));
+		displs = (int*) malloc(np*sizeof(int));
+	}
+	MPI_Gather(&count,1,MPI_INT,counts,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(my_rank == 0)
+	{
+		for(i=0,count=0;i<np;i++)
+		{
+			displs[i] = count;
+			count += counts[i];
+		}
+		total_entries = count / sizeof(HydroFileEntry);
+		all_entries = (HydroFileEntry*) malloc((total_entries + 1)*sizeof(HydroFileEntry));
+	}
+	MPI_Gatherv(entries,num_entries * sizeof(HydroFileEntry),MPI_BYTE,all_entries,counts,displs,MPI_BYTE,0,MPI_COMM_WORLD);
+	free(entries);
+
+	//Write the links of every process
+	if(MPI_File_open(MPI_COMM_WORLD,filename,MPI_MODE_CREATE | MPI_MODE_WRONLY,MPI_INFO_NULL,&file) != MPI_SUCCESS)
+	{
+		printf("[%i]: Error opening hydrograph file %s.\n",my_rank,filename);
+		error = 1;
+	}
+	MPI_Allreduce(MPI_IN_PLACE,&error,1,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+	if(!error)
+	{
+		if(MPI_File_set_size(file,0) != MPI_SUCCESS)	error = 1;
+		MPI_Barrier(MPI_COMM_WORLD);
+		for(sent=0;!error && sent<size;sent+=piece)
+		{
+			piece = (size - sent < COPY_CHUNK_SIZE) ? size - sent : COPY_CHUNK_SIZE;
+			if(MPI_File_write_at(file,(MPI_Offset) (offset + sent),bytes->buffer + sent,(int) piece,MPI_BYTE,MPI_STATUS_IGNORE) != MPI_SUCCESS)	error = 1;
+		}
+
+		//Header and index
+		if(my_rank == 0)
+		{
+			qsort(all_entries,total_entries,sizeof(HydroFileEntry),CompareHydroFileEntries);
+			index = CopyBinary_Create(HYDRO_FILE_HEADER_SIZE + 20*total_entries + HYDRO_FILE_TRAILER_SIZE);
+			CopyBinary_PutBytes(index,HYDRO_FILE_MAGIC,4);
+			CopyBinary_PutBytes(index,HYDRO_FILE_VERSION,4);
+			CopyBinary_PutBytes(index,forecast_time,4);
+			CopyBinary_PutBytes(index,total_entries,4);
+			if(MPI_File_write_at(file,0,index->buffer,index->size,MPI_BYTE,MPI_STATUS_IGNORE) != MPI_SUCCESS)	error = 1;
+
+			CopyBinary_Reset(index);
+			for(j=0;j<total_entries;j++)
+			{
+				CopyBinary_PutBytes(index,all_entries[j].link_id,4);
+				CopyBinary_PutBytes(index,all_entries[j].num_samples,4);
+				CopyBinary_PutBytes(index,all_entries[j].offset,8);
+				CopyBinary_PutBytes(index,all_entries[j].size,4);
+			}
+			CopyBinary_PutBytes(index,total_entries,4);
+			CopyBinary_PutBytes(index,HYDRO_FILE_HEADER_SIZE + total,8);
+			CopyBinary_PutBytes(index,HYDRO_FILE_MAGIC,4);
+			if(MPI_File_write_at(file,(MPI_Offset) (HYDRO_FILE_HEADER_SIZE + total),index->buffer,index->size,MPI_BYTE,MPI_STATUS_IGNORE) != MPI_SUCCESS)	error = 1;
+			CopyBinary_Free(&index);
+		}
+
+		if(MPI_File_close(&file) != MPI_SUCCESS)	error = 1;
+		if(error)	printf("[%i]: Error writing hydrograph file %s.\n",my_rank,filename);
+	}
+
+	if(my_rank == 0)
+	{
+		free(counts);
+		free(displs);
+		free(all_entries);
+	}
+
+	MPI_Allreduce(MPI_IN_PLACE,&error,1,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+	if(!error && my_rank == 0)	printf("[%i]: Wrote %u hydrographs (%llu bytes) to %s.\n",my_rank,total_entries,HYDRO_FILE_HEADER_SIZE + total + 20*total_entries + HYDRO_FILE_TRAILER_SIZE,filename);
+	return error;
+}
+
+
+//Peakflow horizons ****************************************************************************
+
+//Creates the running peakflows for num_links links and the given horizons (mins), which must be increasing.
+PeakflowHorizons* Init_PeakflowHorizons(unsigned int num_links,double* horizons,unsigned int num_horizons)
+{
+	PeakflowHorizons* peaks = (PeakflowHorizons*) malloc(sizeof(PeakflowHorizons));
+
+	peaks->num_horizons = num_horizons;
+	peaks->num_links = num_links;
+	peaks->horizons = (double*) malloc(num_horizons*sizeof(double));
+	memcpy(peaks->horizons,horizons,num_horizons*sizeof(double));
+	peaks->starts = (double*) malloc(num_horizons*sizeof(double));
+	peaks->ends = (double*) malloc(num_horizons*sizeof(double));
+	peaks->peak_values = (double*) malloc((num_links*num_horizons + 1)*sizeof(double));
+	peaks->peak_times = (double*) malloc((num_links*num_horizons + 1)*sizeof(double));
+	peaks->peak_flags = (short int*) malloc((num_links + 1)*sizeof(short int));
+	peaks->num_skipped = 0;
+	peaks->tracking = 0;
+	return peaks;
+}
+
+void Free_PeakflowHorizons(PeakflowHorizons** peaks)
+{
+	if(!(*peaks))	return;
+	free((*peaks)->horizons);
+	free((*peaks)->starts);
+	free((*peaks)->ends);
+	free((*peaks)->peak_values);
+	free((*peaks)->peak_times);
+	free((*peaks)->peak_flags);
+	free(*peaks);
+	*peaks = NULL;
+}
+
+//Starts tracking the peakflows at simulation time t (mins). Horizon i ends shift + horizons[i] mins into the simulation,
+//and starts where the previous horizon ends (or at t). The first horizon starts with the current discharge of each link.
+//Returns the end of the last horizon, which is how far the second phase must be advanced.
+double PeakflowHorizons_Start(PeakflowHorizons* peaks,Link** sys,unsigned int* my_sys,double t,double shift)
+{
+	unsigned int i,j,n = peaks->num_horizons;
+
+	for(i=0;i<n;i++)
+	{
+		peaks->starts[i] = (i) ? peaks->ends[i-1] : t;
+		peaks->ends[i] = shift + peaks->horizons[i];
+	}
+
+	for(j=0;j<peaks->num_links;j++)
+	{
+		for(i=0;i<n;i++)	peaks->peak_values[j*n+i] = NAN;
+		if(n)
+		{
+			peaks->peak_values[j*n] = sys[my_sys[j]]->list->tail->y_approx->ve[0];
+			peaks->peak_times[j*n] = t;
+		}
+	}
+
+	peaks->num_skipped = 0;
+	peaks->tracking = 1;
+	return (n) ? peaks->ends[n-1] : t;
+}
+
+//Adds the sample at time t (mins) of the link at slot in my_sys to the horizons holding t.
+//A sample at the end of one horizon also counts for the next one.
+void PeakflowHorizons_AddSample(PeakflowHorizons* peaks,unsigned int slot,double t,VEC* y)
+{
+	unsigned int i,n = peaks->num_horizons;
+	double* values = &(peaks->peak_values[slot*n]);
+	double* times = &(peaks->peak_times[slot*n]);
+
+	if(!peaks->tracking)	return;
+	for(i=0;i<n && peaks->starts[i] <= t;i++)
+	{
+		if(t > peaks->ends[i])	continue;
+		if(isnan(values[i]) || y->ve[0] > values[i])
+		{
+			values[i] = y->ve[0];
+			times[i] = t;
+		}
+	}
+}
+
+//Stops tracking and copies the peakflows of one horizon into the peakflow data of each link, so they can be written by
+//PeakflowBatch_Add or the peakflow output routine. A link without a sample in the horizon is left out by clearing its
+//peak_flag until PeakflowHorizons_Finish is called.
+void PeakflowHorizons_Set(PeakflowHorizons* peaks,Link** sys,unsigned int* my_sys,unsigned int horizon)
+{
+	unsigned int j,n = peaks->num_horizons;
+	Link* current;
+
+	if(peaks->tracking)
+	{
+		for(j=0;j<peaks->num_links;j++)	peaks->peak_flags[j] = sys[my_sys[j]]->peak_flag;
+		peaks->tracking = 0;
+	}
+
+	for(j=0;j<peaks->num_links;j++)
+	{
+		current = sys[my_sys[j]];
+		if(!peaks->peak_flags[j])	continue;
+		if(isnan(peaks->peak_values[j*n+horizon]))
+		{
+			current->peak_flag = 0;
+			(peaks->num_skipped)++;
+			continue;
+		}
+
+		current->peak_flag = 1;
+		current->peak_value->ve[0] = peaks->peak_values[j*n+horizon];
+		current->peak_time = peaks->peak_times[j*n+horizon];
+	}
+}
+
+//Puts back the peak_flag of each link after the horizons are written. This must be called by all procs.
+void PeakflowHorizons_Finish(PeakflowHorizons* peaks,Link** sys,unsigned int* my_sys)
+{
+	unsigned int j,num_skipped = peaks->num_skipped;
+
+	if(!peaks->tracking)
+	{
+		for(j=0;j<peaks->num_links;j++)	sys[my_sys[j]]->peak_flag = peaks->peak_flags[j];
+	}
+	peaks->tracking = 0;
+
+	MPI_Allreduce(MPI_IN_PLACE,&num_skipped,1,MPI_UNSIGNED,MPI_SUM,MPI_COMM_WORLD);
+	if(num_skipped && my_rank == 0)
+		printf("[%i]: Warning: %u peakflows were left out for lack of hydrograph samples. Peakflow links should have hydrographs saved more often than the horizons.\n",my_rank,num_skipped);
+}
+
+
+//Peakflow batches ******************************************************************************
+
+//Adds the current peakflow of every link of this process with a peakflow flag to rows.
+//This is called after each horizon is advanced, before the peakflow data is reset.
+//The columns match master_archive_peakflows_modelname, as written by OutputPeakflow_Forecast_Maps.
+void PeakflowBatch_Add(CopyBinary* rows,Link** sys,unsigned int* my_sys,unsigned int my_N,unsigned int forecast_time,unsigned int period)
+{
+	unsigned int i;
+	Link* current;
+
+	for(i=0;i<my_N;i++)
+	{
+		current = sys[my_sys[i]];
+		if(!current->peak_flag)	continue;
+
+		CopyBinary_StartRow(rows,5);
+		CopyBinary_PutInt(rows,(int) current->ID);
+		CopyBinary_PutInt(rows,(int) (forecast_time + (unsigned int)(current->peak_time*60 + .1)));
+		CopyBinary_PutDouble(rows,current->peak_value->ve[0]);
+		CopyBinary_PutInt(rows,(int) forecast_time);
+		CopyBinary_PutInt(rows,(int) period);
+	}
+}
+
+//Copies the peakflows held by every process into peak_table in one upload.
+//Returns 0 if the peakflows were copied, 1 if an error occurred. This must be called by all procs.
+//num_writers is the number of procs that copy rows, as in CopyBinary_UploadParallel.
+//The table is created with the query of the peakflow .dbc file, as ASYNCH does, and the rows are copied by position.
+//The columns may have other names (such as start_time for forecast_time), but must be in the same order.
+int PeakflowBatch_Upload(CopyBinary* rows,ConnData* conninfo,char* peak_table,unsigned int num_writers)
+{
+	int error = 0;
+	PGresult* res;
+
+	if(my_rank == 0 && conninfo->num_queries)
+	{
+		char query[strlen(conninfo->queries[0]) + strlen(peak_table) + 1];
+
+		if(ConnectPooledPGDB(conninfo))	error = 1;
+		else
+		{
+			sprintf(query,conninfo->queries[0],peak_table);
+			res = PQexec(conninfo->conn,query);
+			error = CheckResError(res,"creating peakflow table");
+			PQclear(res);
+			DisconnectPooledPGDB(conninfo);
+		}
+	}
+	MPI_Bcast(&error,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(error)	return 1;
+
+	error = CopyBinary_UploadParallel(rows,conninfo,peak_table,"",num_writers);
+	if(!error && my_rank == 0)	printf("[%i]: Uploaded peakflows to %s.\n",my_rank,peak_table);
+	return error;
+}
+
+//Uploads rows until they are sent, then clears them. This must be called by all procs.
+void PeakflowBatch_Flush(CopyBinary* rows,ConnData* conninfo,char* peak_table,unsigned int num_writers,unsigned int retry_time)
+{
+	while(PeakflowBatch_Upload(rows,conninfo,peak_table,num_writers))
+	{
+		if(my_rank == 0)	printf("[%i]: Attempting resend of peakflow data.\n",my_rank);
+		sleep(retry_time);
+	}
+	CopyBinary_Reset(rows);
+}
+
+
+//Background uploader ***************************************************************************
+
+//Creates the uploader thread data for streaming hydrographs into the archive while the next forecast runs.
+//Returns NULL unless the forecast file asks for background_upload (and archive_copy). conninfo is only used for
+//its connection string. The uploader keeps its own session, so it never shares a connection with the main loop.
+BackgroundUpload* Init_BackgroundUpload(ForecastData* Forecaster,ConnData* conninfo,unsigned int num_tables,char* schema,unsigned int retry_time)
+{
+	BackgroundUpload* uploader;
+
+	if(!Forecaster->background_upload || !Forecaster->archive_copy || !conninfo)	return NULL;
+
+	uploader = (BackgroundUpload*) malloc(sizeof(BackgroundUpload));
+	uploader->running = 0;
+	uploader->rows = (my_rank == 0) ? CopyBinary_Create(1048576) : NULL;
+	uploader->conninfo = conninfo;
+	uploader->conn = NULL;
+	uploader->model_name = Forecaster->model_name;
+	uploader->schema = schema;
+	uploader->num_tables = num_tables;
+	uploader->forecast_time = 0;
+	uploader->upload_slots = Forecaster->upload_slots;
+	uploader->retry_time = retry_time;
+	return uploader;
+}
+
+//Waits for the upload in progress (if any) and closes the uploader's session.
+void Free_BackgroundUpload(BackgroundUpload** uploader)
+{
+	if(!(*uploader))	return;
+	BackgroundUpload_Wait(*uploader);
+	if((*uploader)->conn)
+	{
+		ForgetPreparedPGDB((*uploader)->conn);
+		PQfinish((*uploader)->conn);
+	}
+	if((*uploader)->rows)	CopyBinary_Free(&((*uploader)->rows));
+	free(*uploader);
+	*uploader = NULL;
+}
+
+//Body of the uploader thread. The gathered rows are copied into the child archive table for their forecast time.
+//Errors are retried every retry_time seconds, just as the main loops do for synchronous uploads.
+static void* BackgroundUpload_Run(void* arg)
+{
+	BackgroundUpload* uploader = (BackgroundUpload*) arg;
+	ConnData session;
+	PGresult* res;
+	int table_index,slot,error;
+	unsigned int current_day;
+	char table[strlen(uploader->schema) + strlen(uploader->model_name) + 64];
+	time_t start,stop;
+
+	time(&start);
+	memset(&session,0,sizeof(ConnData));
+	do
+	{
+		error = 0;
+		slot = -1;
+
+		//Open or repair the uploader's session
+		if(!uploader->conn)	uploader->conn = PQconnectdb(uploader->conninfo->connectinfo);
+		else if(PQstatus(uploader->conn) != CONNECTION_OK)	PQreset(uploader->conn);
+		if(PQstatus(uploader->conn) != CONNECTION_OK)
+		{
+			printf("[%i]: Error: Uploader could not connect to the database.\n%s",my_rank,PQerrorMessage(uploader->conn));
+			error = 1;
+		}
+		session.conn = uploader->conn;
+
+		if(!error && uploader->upload_slots)
+		{
+			slot = TakeUploadSlot(uploader->conn,uploader->upload_slots);
+			if(slot < 0)	error = 1;
+		}
+
+		//The child table is found and filled in one transaction, so a rotation cannot shift it in between
+		if(!error && !(error = BeginPGTransaction(&session,ROTATION_LOCK_TIMEOUT)))
+		{
+			error = LockArchiveMaster(&session,uploader->schema,"archive_hydroforecast",uploader->model_name,"ROW EXCLUSIVE");
+
+			//The statement registry belongs to the main thread, so nothing is prepared here
+			if(!error)
+			{
+				res = PQexec(uploader->conn,CURRENT_DAY_QUERY);
+				error = CheckResError(res,"getting the current day");
+				if(!error)	current_day = (unsigned int) rint(atof(PQgetvalue(res,0,0)));
+				PQclear(res);
+			}
+
+			if(!error)
+			{
+				table_index = ArchiveTableIndex(uploader->forecast_time,current_day);
+				if(table_index < 0 || table_index >= (int) uploader->num_tables)
+					printf("[%i]: Warning: No archive table for hydrographs with forecast time %u.\n",my_rank,uploader->forecast_time);
+				else
+				{
+					sprintf(table,"%sarchive_hydroforecast_%s_%i",uploader->schema,uploader->model_name,table_index);
+					error = CopyBinary_Send(uploader->conn,table,"(link_id,time_utc,discharge,baseflow,forecast_time)",uploader->rows->buffer,uploader->rows->size);
+				}
+			}
+
+			error = EndPGTransaction(&session,error);
+		}
+
+		if(slot >= 0)	GiveUploadSlot(uploader->conn,slot);
+
+		if(error)
+		{
+			printf("[%i]: Attempting resend of hydrographs to the archive in the background.\n",my_rank);
+			sleep(uploader->retry_time);
+		}
+	} while(error);
+
+	time(&stop);
+	printf("[%i]: Background upload of hydrographs for forecast %u complete. Total time %.2f.\n",my_rank,uploader->forecast_time,difftime(stop,start));
+	fflush(stdout);
+	return NULL;
+}
+
+//Hands the captured hydrographs of every process to the uploader thread on proc 0 and returns without waiting
+//for the database. The rows are gathered into the uploader's own buffer, so archive can be reset right away.
+//If the previous upload is still running, proc 0 waits for it first. This must be called by all procs.
+void BackgroundUpload_Start(BackgroundUpload* uploader,HydroArchive* archive,unsigned int forecast_time)
+{
+	if(!uploader || !archive)	return;
+
+	BackgroundUpload_Wait(uploader);
+	CopyBinary_Gather(archive->rows,uploader->rows);
+
+	if(my_rank == 0)
+	{
+		uploader->forecast_time = forecast_time;
+		if(pthread_create(&(uploader->thread),NULL,BackgroundUpload_Run,uploader))
+		{
+			printf("[%i]: Warning: Could not start the uploader thread. Uploading now.\n",my_rank);
+			BackgroundUpload_Run(uploader);
+		}
+		else	uploader->running = 1;
+	}
+}
+
+//Blocks proc 0 until the upload in progress (if any) is finished.
+void BackgroundUpload_Wait(BackgroundUpload* uploader)
+{
+	if(uploader && uploader->running)
+	{
+		pthread_join(uploader->thread,NULL);
+		uploader->running = 0;
+	}
+}
+
+
+//State checkpoints ***************************************************************************
+
+//Creates a checkpoint for the states of the links stored on this proc (owned and ghost links).
+//The states are kept in one contiguous buffer, in the order of the local links.
+StateCheckpoint* Init_StateCheckpoint(Link** sys,unsigned int N,int* assignments,short int* getting)
+{
+	unsigned int i,k,size = 0,num_links = 0;
+	StateCheckpoint* checkpoint = (StateCheckpoint*) malloc(sizeof(StateCheckpoint));
+
+	for(i=0;i<N;i++)
+	{
+		if(assignments[i] == my_rank || getting[i] == 1)
+		{
+			num_links++;
+			size += sys[i]->dim;
+		}
+	}
+
+	checkpoint->num_links = num_links;
+	checkpoint->size = size;
+	checkpoint->locs = (unsigned int*) malloc(num_links*sizeof(unsigned int));
+	checkpoint->states = (double*) calloc(size,sizeof(double));
+	checkpoint->views = (VEC*) malloc(num_links*sizeof(VEC));
+	checkpoint->backup = (VEC**) calloc(N,sizeof(VEC*));
+
+	for(i=0,k=0,size=0;i<N;i++)
+	{
+		if(assignments[i] == my_rank || getting[i] == 1)
+		{
+			checkpoint->locs[k] = i;
+			checkpoint->views[k].ve = &(checkpoint->states[size]);
+			checkpoint->views[k].dim = sys[i]->dim;
+			checkpoint->backup[i] = &(checkpoint->views[k]);
+			size += sys[i]->dim;
+			k++;
+		}
+	}
+
+	return checkpoint;
+}
+
+void Free_StateCheckpoint(StateCheckpoint** checkpoint)
+{
+	if(!(*checkpoint))	return;
+	free((*checkpoint)->locs);
+	free((*checkpoint)->states);
+	free((*checkpoint)->views);
+	free((*checkpoint)->backup);
+	free(*checkpoint);
+	*checkpoint = NULL;
+}
+
+//Copies the most recent state of each local link into the checkpoint.
+void StateCheckpoint_Save(StateCheckpoint* checkpoint,Link** sys)
+{
+	unsigned int k;
+	double* states = checkpoint->states;
+	Link* current;
+
+	for(k=0;k<checkpoint->num_links;k++)
+	{
+		current = sys[checkpoint->locs[k]];
+		memcpy(states,current->list->tail->y_approx->ve,current->dim*sizeof(double));
+		states += current->dim;
+	}
+}
+
+//Copies the checkpoint back into the most recent state of each local link.
+//This does not reset the solution lists. Use Asynch_Set_System_State with checkpoint->backup for that.
+void StateCheckpoint_Load(StateCheckpoint* checkpoint,Link** sys)
+{
+	unsigned int k;
+	double* states = checkpoint->states;
+	Link* current;
+
+	for(k=0;k<checkpoint->num_links;k++)
+	{
+		current = sys[checkpoint->locs[k]];
+		memcpy(current->list->tail->y_approx->ve,states,current->dim*sizeof(double));
+		states += current->dim;
+	}
+}
+
+//Resets the owned and ghost links for the start of the next phase, then saves their states into checkpoint.
+//This is the reset loop the executables used to run inline, limited to the local links. It keeps no pool of list
+//nodes. ASYNCH allocates each solution list as a ring of nodes when the link is set up, and Remove_Head_Node only
+//moves the head around that ring, so trimming a list to its most recent node frees and allocates nothing.
+void StateCheckpoint_ResetLinks(StateCheckpoint* checkpoint,Link** sys)
+{
+	unsigned int k;
+	Link* current;
+
+	for(k=0;k<checkpoint->num_links;k++)
+	{
+		current = sys[checkpoint->locs[k]];
+		while(current->current_iterations > 1)
+		{
+			Remove_Head_Node(current->list);
+			(current->current_iterations)--;
+		}
+
+		current->steps_on_diff_proc = 1;
+		current->iters_removed = 0;
+		current->rejected = 0;
+		if(current->numparents == 0)	current->ready = 1;
+		else				current->ready = 0;
+	}
+
+	StateCheckpoint_Save(checkpoint,sys);
+}
+
+//Warm starts *********************************************************************************
+
+//Points the initial conditions at the warm start file for init_time, if one was left by an earlier run.
+//Otherwise, the initial conditions from the global file are used. This must be called by all procs
+//before Asynch_Load_Initial_Conditions. Returns 1 if the warm start file is used, 0 if not.
+int UseWarmStart(UnivVars* GlobalVars,ForecastData* Forecaster,unsigned int init_time)
+{
+	char filename[512];
+	int found = 0;
+
+	if(!Forecaster->warm_start)	return 0;
+
+	if(!Forecaster->gbl_init_filename)
+	{
+		Forecaster->gbl_init_flag = GlobalVars->init_flag;
+		Forecaster->gbl_init_filename = (char*) malloc(GlobalVars->string_size*sizeof(char));
+		snprintf(Forecaster->gbl_init_filename,GlobalVars->string_size,"%s",GlobalVars->init_filename ? GlobalVars->init_filename : "");
+	}
+	if(!GlobalVars->init_filename)	GlobalVars->init_filename = (char*) malloc(GlobalVars->string_size*sizeof(char));
+
+	sprintf(filename,"%s/%s_%u.rec",Forecaster->warm_start,Forecaster->model_name,init_time);
+	if(my_rank == 0)
+	{
+		found = !access(filename,R_OK);
+		if(found)	printf("Warm starting from %s.\n",filename);
+	}
+	MPI_Bcast(&found,1,MPI_INT,0,MPI_COMM_WORLD);
+
+	if(found)
+	{
+		GlobalVars->init_flag = 2;
+		snprintf(GlobalVars->init_filename,GlobalVars->string_size,"%s",filename);
+		strcpy(Forecaster->warm_start_used,filename);
+	}
+	else
+	{
+		GlobalVars->init_flag = Forecaster->gbl_init_flag;
+		snprintf(GlobalVars->init_filename,GlobalVars->string_size,"%s",Forecaster->gbl_init_filename);
+	}
+
+	return found;
+}
+
+//Writes the states in checkpoint to a .rec file for the next run to start from, if a warm start directory is set.
+//timestamp is the time the states were written to the snapshot table. The file is written under a temporary
+//name and renamed when complete. Older warm start files of this process are removed. This must be called by all procs.
+void SaveWarmStart(asynchsolver* asynch,StateCheckpoint* checkpoint,ForecastData* Forecaster,unsigned int timestamp)
+{
+	char filename[512],tempname[512];
+	char* dump_loc_filename;
+
+	if(!Forecaster->warm_start)	return;
+
+	sprintf(filename,"%s/%s_%u.rec",Forecaster->warm_start,Forecaster->model_name,timestamp);
+	sprintf(tempname,"%s.tmp",filename);
+
+	StateCheckpoint_Load(checkpoint,asynch->sys);
+	dump_loc_filename = asynch->GlobalVars->dump_loc_filename;
+	asynch->GlobalVars->dump_loc_filename = tempname;
+	DataDump2(asynch->sys,asynch->N,asynch->assignments,asynch->GlobalVars,NULL,NULL);
+	asynch->GlobalVars->dump_loc_filename = dump_loc_filename;
+
+	if(my_rank == 0)
+	{
+		if(rename(tempname,filename))	printf("[%i]: Warning: Could not write warm start file %s.\n",my_rank,filename);
+		else
+		{
+			printf("Wrote warm start file %s.\n",filename);
+			if(Forecaster->warm_start_used[0] && strcmp(Forecaster->warm_start_used,filename))	remove(Forecaster->warm_start_used);
+			if(Forecaster->warm_start_saved[0] && strcmp(Forecaster->warm_start_saved,filename))	remove(Forecaster->warm_start_saved);
+			strcpy(Forecaster->warm_start_saved,filename);
+			Forecaster->warm_start_used[0] = '\0';
+		}
+	}
+	MPI_Barrier(MPI_COMM_WORLD);
+}
+
+//Network cache *******************************************************************************
+
+//Adds size bytes of data to an FNV-1a hash
+static uint64_t HashBytes(uint64_t hash,const void* data,size_t size)
+{
+	size_t i;
+	const unsigned char* bytes = (const unsigned char*) data;
+
+	for(i=0;i<size;i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//Hashes everything that determines the topology and parameters of the network: the global file,
+//the queries of the topology and parameter .dbc files, and the version of the cache files.
+static uint64_t NetworkCacheKey(char* gbl_filename,ConnData* conninfo_topo,ConnData* conninfo_params)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	unsigned int i,version = NETWORK_CACHE_VERSION;
+	char buffer[4096];
+	size_t size;
+	FILE* gbl;
+
+	hash = HashBytes(hash,&version,sizeof(unsigned int));
+	gbl = fopen(gbl_filename,"rb");
+	if(gbl)
+	{
+		while((size = fread(buffer,1,sizeof(buffer),gbl)) > 0)
+			hash = HashBytes(hash,buffer,size);
+		fclose(gbl);
+	}
+	for(i=0;i<conninfo_topo->num_queries;i++)
+		hash = HashBytes(hash,conninfo_topo->queries[i],strlen(conninfo_topo->queries[i]));
+	for(i=0;i<conninfo_params->num_queries;i++)
+		hash = HashBytes(hash,conninfo_params->queries[i],strlen(conninfo_params->queries[i]));
+
+	return hash;
+}
+
+//Writes the topology (.rvr) and parameters (.prm) of the whole network from the database.
+//Each file is written under a temporary name and renamed when complete, so a partial file is never used.
+//Returns 0 if both files were written, 1 otherwise.
+static int WriteNetworkCache(ConnData* conninfo_topo,ConnData* conninfo_params,char* rvr_filename,char* prm_filename)
+{
+	PGresult *res_links,*res_parents,*res_params;
+	unsigned int i,j,k,N,num_rows,numparents,num_params,link_id;
+	char tempname[512];
+	FILE* outputfile;
+	int error = 0;
+
+	//Topology
+	if(ConnectPGDB(conninfo_topo))	return 1;
+	res_links = PQexec(conninfo_topo->conn,conninfo_topo->queries[0]);
+	error = CheckResError(res_links,"getting links for the network cache");
+	res_parents = PQexec(conninfo_topo->conn,conninfo_topo->queries[1]);
+	error |= CheckResError(res_parents,"getting parents for the network cache");
+	DisconnectPGDB(conninfo_topo);
+
+	if(!error)
+	{
+		sprintf(tempname,"%s.tmp%i",rvr_filename,(int) getpid());
+		outputfile = fopen(tempname,"w");
+		if(!outputfile)
+		{
+			printf("[%i]: Error: Could not create network cache file %s.\n",my_rank,tempname);
+			error = 1;
+		}
+		else
+		{
+			N = PQntuples(res_links);
+			num_rows = PQntuples(res_parents);
+			fprintf(outputfile,"%u\n\n",N);
+			for(i=0,j=0;i<N;i++)
+			{
+				link_id = atoi(PQgetvalue(res_links,i,0));
+				while(j < num_rows && (unsigned int) atoi(PQgetvalue(res_parents,j,0)) < link_id)	j++;
+				for(numparents=0;j+numparents < num_rows && (unsigned int) atoi(PQgetvalue(res_parents,j+numparents,0)) == link_id;numparents++);
+				fprintf(outputfile,"%u\n%u",link_id,numparents);
+				for(k=0;k<numparents;k++)	fprintf(outputfile," %s",PQgetvalue(res_parents,j+k,1));
+				fprintf(outputfile,"\n\n");
+				j += numparents;
+			}
+			error = (fclose(outputfile) != 0);
+			if(!error)	error = (rename(tempname,rvr_filename) != 0);
+			if(error)	remove(tempname);
+		}
+	}
+	PQclear(res_links);
+	PQclear(res_parents);
+	if(error)	return 1;
+
+	//Parameters. The values are written as text, exactly as the database returns them.
+	if(ConnectPGDB(conninfo_params))	return 1;
+	res_params = PQexec(conninfo_params->conn,conninfo_params->queries[0]);
+	error = CheckResError(res_params,"getting parameters for the network cache");
+	DisconnectPGDB(conninfo_params);
+
+	if(!error)
+	{
+		sprintf(tempname,"%s.tmp%i",prm_filename,(int) getpid());
+		outputfile = fopen(tempname,"w");
+		if(!outputfile)
+		{
+			printf("[%i]: Error: Could not create network cache file %s.\n",my_rank,tempname);
+			error = 1;
+		}
+		else
+		{
+			N = PQntuples(res_params);
+			num_params = PQnfields(res_params) - 1;
+			fprintf(outputfile,"%u\n\n",N);
+			for(i=0;i<N;i++)
+			{
+				fprintf(outputfile,"%s\n",PQgetvalue(res_params,i,0));
+				for(k=0;k<num_params;k++)	fprintf(outputfile,"%s ",PQgetvalue(res_params,i,k+1));
+				fprintf(outputfile,"\n\n");
+			}
+			error = (fclose(outputfile) != 0);
+			if(!error)	error = (rename(tempname,prm_filename) != 0);
+			if(error)	remove(tempname);
+		}
+	}
+	PQclear(res_params);
+
+	return error;
+}
+
+//Points the global file settings at topology and parameter files in the network cache of Forecaster,
+//so the network is loaded from files instead of the database. The files are named by a hash of the inputs
+//that determine them, and are made from the database by proc 0 the first time a hash is seen.
+//If anything goes wrong, the network is loaded from the database as usual. This must be called by all procs.
+//Returns 1 if the cache is used, 0 if not.
+int UseNetworkCache(UnivVars* GlobalVars,ConnData* conninfo_topo,ConnData* conninfo_params,ForecastData* Forecaster,char* gbl_filename)
+{
+	char rvr_filename[512],prm_filename[512];
+	unsigned long long key = 0;
+	int error = 0;
+
+	//Only networks loaded whole from the database are cached
+	if(!Forecaster->network_cache || GlobalVars->rvr_flag != 1 || GlobalVars->prm_flag != 1 || GlobalVars->outletlink != 0)	return 0;
+
+	if(my_rank == 0)
+	{
+		key = NetworkCacheKey(gbl_filename,conninfo_topo,conninfo_params);
+		sprintf(rvr_filename,"%s/%s_%016llx.rvr",Forecaster->network_cache,Forecaster->model_name,key);
+		sprintf(prm_filename,"%s/%s_%016llx.prm",Forecaster->network_cache,Forecaster->model_name,key);
+		if(access(rvr_filename,R_OK) || access(prm_filename,R_OK))
+		{
+			printf("Writing network cache %016llx...\n",key);
+			error = WriteNetworkCache(conninfo_topo,conninfo_params,rvr_filename,prm_filename);
+			if(error)	printf("[%i]: Warning: Could not write the network cache. Loading the network from the database.\n",my_rank);
+		}
+		else
+			printf("Using network cache %016llx.\n",key);
+	}
+
+	MPI_Bcast(&error,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(error)	return 0;
+	MPI_Bcast(&key,1,MPI_UNSIGNED_LONG_LONG,0,MPI_COMM_WORLD);
+	sprintf(rvr_filename,"%s/%s_%016llx.rvr",Forecaster->network_cache,Forecaster->model_name,key);
+	sprintf(prm_filename,"%s/%s_%016llx.prm",Forecaster->network_cache,Forecaster->model_name,key);
+
+	if(!GlobalVars->rvr_filename)	GlobalVars->rvr_filename = (char*) malloc(GlobalVars->string_size*sizeof(char));
+	if(!GlobalVars->prm_filename)	GlobalVars->prm_filename = (char*) malloc(GlobalVars->string_size*sizeof(char));
+	snprintf(GlobalVars->rvr_filename,GlobalVars->string_size,"%s",rvr_filename);
+	snprintf(GlobalVars->prm_filename,GlobalVars->string_size,"%s",prm_filename);
+	GlobalVars->rvr_flag = 0;
+	GlobalVars->prm_flag = 0;
+
+	return 1;
+}
+
+//Rainfall cache ******************************************************************************
+
+//Writes "SELECT * FROM (<forcing query for first_time to last_time>) AS block" to buffer.
+static void RainCacheBlockQuery(char* buffer,char* original,unsigned int first_time,unsigned int last_time)
+{
+	unsigned int i;
+
+	sprintf(buffer,"SELECT * FROM (");
+	sprintf(buffer + strlen(buffer),original,first_time,last_time);
+	for(i=strlen(buffer);i && (buffer[i-1] == ';' || isspace(buffer[i-1]));i--);
+	strcpy(buffer + i,") AS block");
+}
+
+//Sets up a cache of the forecast forcing shared by all forecasters with the same forcing query. The cache is an
+//unlogged table in the forcing database, named by a hash of the query, along with a table of the blocks it holds.
+//The forcing query is replaced on all procs by a function that reads a block from the cache if it is there,
+//and runs the original query otherwise. This must be called by all procs.
+//Returns NULL if no cache is set in Forecaster, or if it cannot be used.
+RainCache* Init_RainCache(ForecastData* Forecaster,ConnData* conninfo,UnivVars* GlobalVars)
+{
+	RainCache* cache;
+	PGresult* res;
+	char *query = NULL,*literal,*parameterized;
+	unsigned int i,length,num_params = 0;
+	int error = 0;
+
+	if(!Forecaster->rain_cache_age || !conninfo || !conninfo->num_queries || GlobalVars->outletlink != 0)	return NULL;
+
+	//The query must take only the first and last times of the block
+	length = strlen(conninfo->queries[0]);
+	for(i=0;i<length;i++)
+	{
+		if(conninfo->queries[0][i] != '%')	continue;
+		if(conninfo->queries[0][i+1] == '%')	i++;
+		else	num_params++;
+	}
+	if(num_params != 2)
+	{
+		if(my_rank == 0)	printf("[%i]: Warning: The forcing query does not take a first and last time. Not using the rain cache.\n",my_rank);
+		return NULL;
+	}
+
+	cache = (RainCache*) malloc(sizeof(RainCache));
+	cache->conninfo = conninfo;
+	cache->max_age = Forecaster->rain_cache_age;
+	cache->original = conninfo->queries[0];
+	cache->key = (unsigned int) (HashBytes(14695981039346656037ULL,cache->original,length) & 0x7fffffff);
+	sprintf(cache->table,"rain_cache_%08x",cache->key);
+	cache->column[0] = '\0';
+
+	if(my_rank == 0)
+	{
+		query = (char*) malloc((3*length + 2048)*sizeof(char));
+		if(ConnectPooledPGDB(conninfo))	error = 1;
+
+		//The first column of the forcing is the time
+		if(!error)
+		{
+			RainCacheBlockQuery(query,cache->original,0,0);
+			strcat(query," LIMIT 0;");
+			res = PQexec(conninfo->conn,query);
+			error = CheckResError(res,"describing the forcing query");
+			if(!error)	snprintf(cache->column,sizeof(cache->column),"%s",PQfname(res,0));
+			PQclear(res);
+		}
+
+		//Other forecasters may be creating the same cache
+		if(!error)	error = BeginPGTransaction(conninfo,RAIN_CACHE_LOCK_TIMEOUT);
+		if(!error)
+		{
+			sprintf(query,"SELECT pg_advisory_xact_lock(hashtext('%s'),%u);",RAIN_CACHE_LOCK_NAME,cache->key);
+			res = PQexec(conninfo->conn,query);
+			error = CheckResError(res,"locking the rain cache");
+			PQclear(res);
+
+			if(!error)
+			{
+				sprintf(query,"CREATE UNLOGGED TABLE IF NOT EXISTS %s AS ",cache->table);
+				RainCacheBlockQuery(query + strlen(query),cache->original,0,0);
+				sprintf(query + strlen(query)," LIMIT 0; CREATE INDEX IF NOT EXISTS %s_time ON %s (\"%s\"); \
+					CREATE TABLE IF NOT EXISTS %s_blocks (first_time integer, last_time integer, filled timestamp with time zone);",
+					cache->table,cache->table,cache->column,cache->table);
+				res = PQexec(conninfo->conn,query);
+				error = CheckResError(res,"creating the rain cache");
+				PQclear(res);
+			}
+
+			if(!error)
+			{
+				parameterized = ParameterizeQuery(cache->original);
+				literal = PQescapeLiteral(conninfo->conn,parameterized,strlen(parameterized));
+				free(parameterized);
+				sprintf(query,"CREATE OR REPLACE FUNCTION %s_read(integer,integer) RETURNS SETOF %s AS $rain_cache$ BEGIN \
+					PERFORM pg_advisory_xact_lock_shared(hashtext('%s_read'),%u); \
+					IF EXISTS (SELECT 1 FROM %s_blocks WHERE first_time <= $1 AND last_time >= $2) THEN \
+					RETURN QUERY SELECT * FROM %s WHERE \"%s\" >= $1 AND \"%s\" < $2 ORDER BY 1; \
+					ELSE RETURN QUERY EXECUTE %s USING $1,$2; END IF; END; $rain_cache$ LANGUAGE plpgsql VOLATILE;",
+					cache->table,cache->table,RAIN_CACHE_LOCK_NAME,cache->key,cache->table,cache->table,cache->column,cache->column,literal);
+				PQfreemem(literal);
+				res = PQexec(conninfo->conn,query);
+				error = CheckResError(res,"creating the rain cache function");
+				PQclear(res);
+			}
+
+			error = EndPGTransaction(conninfo,error);
+		}
+
+		DisconnectPooledPGDB(conninfo);
+		free(query);
+		if(error)	printf("[%i]: Warning: Could not set up the rain cache. Reading the forcing directly.\n",my_rank);
+		else	printf("Using rain cache %s.\n",cache->table);
+	}
+
+	MPI_Bcast(&error,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(error)
+	{
+		free(cache);
+		return NULL;
+	}
+
+	conninfo->queries[0] = (char*) malloc(128*sizeof(char));
+	sprintf(conninfo->queries[0],"SELECT * FROM %s_read(%%u,%%u);",cache->table);
+	return cache;
+}
+
+//Gives conninfo its original forcing query back.
+void Free_RainCache(RainCache** cache)
+{
+	if(!(*cache))	return;
+	free((*cache)->conninfo->queries[0]);
+	(*cache)->conninfo->queries[0] = (*cache)->original;
+	free(*cache);
+	*cache = NULL;
+}
+
+//Fills the rain cache on the open session of conninfo, as in RainCache_Fill. Returns 1 if an error occurred, 0 otherwise.
+static int RainCache_FillSession(RainCache* cache,ConnData* conninfo,unsigned int first_time,unsigned int last_time)
+{
+	PGresult* res;
+	char* query = (char*) malloc((strlen(cache->original) + 2048)*sizeof(char));
+	int error;
+
+	error = BeginPGTransaction(conninfo,RAIN_CACHE_LOCK_TIMEOUT);
+	if(!error)
+	{
+		sprintf(query,"SELECT pg_advisory_xact_lock(hashtext('%s'),%u);",RAIN_CACHE_LOCK_NAME,cache->key);
+		res = PQexec(conninfo->conn,query);
+		error = CheckResError(res,"locking the rain cache");
+		PQclear(res);
+
+		//A block still in use is kept
+		if(!error)
+		{
+			sprintf(query,"UPDATE %s_blocks SET filled = now() WHERE first_time <= %u AND last_time >= %u;",cache->table,first_time,last_time);
+			res = PQexec(conninfo->conn,query);
+			error = CheckResError(res,"refreshing the rain cache");
+			PQclear(res);
+		}
+
+		//Rows already held for a block overlapping this one are not added again
+		if(!error)
+		{
+			sprintf(query,"INSERT INTO %s ",cache->table);
+			RainCacheBlockQuery(query + strlen(query),cache->original,first_time,last_time);
+			sprintf(query + strlen(query)," WHERE NOT EXISTS (SELECT 1 FROM %s_blocks WHERE first_time <= %u AND last_time >= %u) \
+				AND NOT EXISTS (SELECT 1 FROM %s_blocks b WHERE block.\"%s\" >= b.first_time AND block.\"%s\" < b.last_time); \
+				INSERT INTO %s_blocks SELECT %u,%u,now() WHERE NOT EXISTS (SELECT 1 FROM %s_blocks WHERE first_time <= %u AND last_time >= %u);",
+				cache->table,first_time,last_time,cache->table,cache->column,cache->column,cache->table,first_time,last_time,cache->table,first_time,last_time);
+			res = PQexec(conninfo->conn,query);
+			error = CheckResError(res,"filling the rain cache");
+			PQclear(res);
+		}
+
+		//Readers hold this lock shared, so a block is not removed while it is being read.
+		//This is done last, so readers only wait on the delete.
+		if(!error)
+		{
+			sprintf(query,"SELECT pg_advisory_xact_lock(hashtext('%s_read'),%u); \
+				DELETE FROM %s_blocks WHERE filled < now() - interval '%u seconds'; \
+				DELETE FROM %s c WHERE NOT EXISTS (SELECT 1 FROM %s_blocks b WHERE c.\"%s\" >= b.first_time AND c.\"%s\" < b.last_time);",
+				RAIN_CACHE_LOCK_NAME,cache->key,cache->table,cache->max_age,cache->table,cache->table,cache->column,cache->column);
+			res = PQexec(conninfo->conn,query);
+			error = CheckResError(res,"clearing old blocks from the rain cache");
+			PQclear(res);
+		}
+
+		error = EndPGTransaction(conninfo,error);
+	}
+
+	free(query);
+	return error;
+}
+
+//Makes sure the block of forcing from first_time to last_time is in the cache. Only proc 0 does anything.
+//The first forecaster to get here reads the block with the original query. The others wait on the lock,
+//then find the block already there and mark it as recently used. Blocks not used within the maximum age are removed.
+//Errors are only reported, since the forcing is then read with the original query.
+void RainCache_Fill(RainCache* cache,unsigned int first_time,unsigned int last_time)
+{
+	int error;
+	time_t start,stop;
+
+	if(!cache || my_rank != 0)	return;
+
+	time(&start);
+	if(ConnectPooledPGDB(cache->conninfo))	return;
+	error = RainCache_FillSession(cache,cache->conninfo,first_time,last_time);
+	DisconnectPooledPGDB(cache->conninfo);
+	time(&stop);
+	if(!error)	printf("Rain cache holds %u to %u. Total time %.2f.\n",first_time,last_time,difftime(stop,start));
+}
+
+//Rainfall prefetch ***************************************************************************
+
+//Creates the prefetcher for the forecast forcing on proc 0. The next block is read into cache, so the forcing
+//query finds it there. Returns NULL on the other procs, if prefetching is not set in Forecaster, or if there is no cache.
+RainPrefetch* Init_RainPrefetch(ForecastData* Forecaster,RainCache* cache)
+{
+	RainPrefetch* prefetch;
+
+	if(my_rank != 0 || !Forecaster->rain_prefetch)	return NULL;
+	if(!cache)
+	{
+		printf("[%i]: Warning: rain_prefetch needs rain_cache to hold the rows. Not prefetching.\n",my_rank);
+		return NULL;
+	}
+
+	prefetch = (RainPrefetch*) malloc(sizeof(RainPrefetch));
+	prefetch->running = 0;
+	prefetch->cache = cache;
+	prefetch->conn = NULL;
+	prefetch->probe_info = Forecaster->rainmaps_db;
+	prefetch->probe = Forecaster->rainmaps_probe;
+	prefetch->probe_conn = NULL;
+	prefetch->first_time = 0;
+	prefetch->last_time = 0;
+	prefetch->probe_time = 0;
+	return prefetch;
+}
+
+//Waits for the prefetch in progress (if any) and closes the prefetcher's sessions.
+void Free_RainPrefetch(RainPrefetch** prefetch)
+{
+	if(!(*prefetch))	return;
+	RainPrefetch_Wait(*prefetch);
+	if((*prefetch)->conn)	PQfinish((*prefetch)->conn);
+	if((*prefetch)->probe_conn)	PQfinish((*prefetch)->probe_conn);
+	free(*prefetch);
+	*prefetch = NULL;
+}
+
+//Opens or repairs a session of the prefetcher. Returns 1 if it is not connected, 0 otherwise.
+static int RainPrefetch_Connect(PGconn** conn,ConnData* conninfo)
+{
+	if(!(*conn))	*conn = PQconnectdb(conninfo->connectinfo);
+	else if(PQstatus(*conn) != CONNECTION_OK)	PQreset(*conn);
+	if(PQstatus(*conn) != CONNECTION_OK)
+	{
+		printf("[%i]: Warning: Prefetcher could not connect to the database.\n%s",my_rank,PQerrorMessage(*conn));
+		return 1;
+	}
+	return 0;
+}
+
+//Body of the prefetcher thread. If the index shows the next block is in, the block is read into the rain cache.
+//A block that is not in yet is left alone, so the cache never holds part of a block. Errors are reported, not retried.
+static void* RainPrefetch_Run(void* arg)
+{
+	RainPrefetch* prefetch = (RainPrefetch*) arg;
+	ConnData session;
+	PGresult *res;
+	char param[16];
+	const char* params[1] = { param };
+	int isnull = 1;
+	time_t start,stop;
+
+	time(&start);
+
+	//The statement registry belongs to the main thread, so the probe is not prepared here
+	if(RainPrefetch_Connect(&(prefetch->probe_conn),prefetch->probe_info))	return NULL;
+	sprintf(param,"%u",prefetch->probe_time);
+	res = PQexecParams(prefetch->probe_conn,prefetch->probe,1,NULL,params,NULL,NULL,0);
+	if(!CheckResError(res,"checking for the next block of rainfall"))	isnull = PQgetisnull(res,0,0);
+	PQclear(res);
+	if(isnull)
+	{
+		printf("[%i]: Rainfall for %u to %u is not in yet. Nothing prefetched.\n",my_rank,prefetch->first_time,prefetch->last_time);
+		fflush(stdout);
+		return NULL;
+	}
+
+	if(RainPrefetch_Connect(&(prefetch->conn),prefetch->cache->conninfo))	return NULL;
+	memset(&session,0,sizeof(ConnData));
+	session.conn = prefetch->conn;
+	if(!RainCache_FillSession(prefetch->cache,&session,prefetch->first_time,prefetch->last_time))
+	{
+		time(&stop);
+		printf("[%i]: Prefetched rainfall for %u to %u into the rain cache. Total time %.2f.\n",my_rank,prefetch->first_time,prefetch->last_time,difftime(stop,start));
+	}
+	fflush(stdout);
+	return NULL;
+}
+
+//Starts reading the forcing from first_time to last_time into the rain cache in the background on proc 0.
+//step is the time between forcing values, so the last value of the block is at last_time - step.
+//If the previous prefetch is still running, this waits for it first.
+void RainPrefetch_Start(RainPrefetch* prefetch,unsigned int first_time,unsigned int last_time,unsigned int step)
+{
+	if(!prefetch)	return;
+	RainPrefetch_Wait(prefetch);
+
+	prefetch->first_time = first_time;
+	prefetch->last_time = last_time;
+	prefetch->probe_time = last_time - step;
+	if(pthread_create(&(prefetch->thread),NULL,RainPrefetch_Run,prefetch))
+		printf("[%i]: Warning: Could not start the prefetcher thread.\n",my_rank);
+	else	prefetch->running = 1;
+}
+
+//Blocks proc 0 until the prefetch in progress (if any) is finished.
+void RainPrefetch_Wait(RainPrefetch* prefetch)
+{
+	if(prefetch && prefetch->running)
+	{
+		pthread_join(prefetch->thread,NULL);
+		prefetch->running = 0;
+	}
+}
+
+//Ensembles ***********************************************************************************
+
+//Discharge threshold of a link, as read for the exceedance probabilities
+typedef struct LinkThreshold
+{
+	unsigned int link_id;
+	double discharge;
+} LinkThreshold;
+
+static int CompareLinkThresholds(const void* a,const void* b)
+{
+	unsigned int id_a = ((const LinkThreshold*) a)->link_id,id_b = ((const LinkThreshold*) b)->link_id;
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+//Reads the discharge thresholds for the exceedance probabilities, and gives each local link its threshold.
+//The query returns the link id and the threshold. Links without a threshold get -1.
+//This must be called by all procs. Returns 0 on success, 1 if the thresholds could not be read.
+static int EnsembleStats_LoadThresholds(EnsembleStats* ensemble,asynchsolver* asynch,char* filename)
+{
+	ConnData* conninfo;
+	PGresult* res;
+	LinkThreshold *thresholds = NULL,key,*found;
+	int i,num_thresholds = -1;
+
+	if(my_rank == 0)
+	{
+		conninfo = ReadDBC(filename,asynch->GlobalVars->string_size);
+		if(conninfo && conninfo->num_queries && !ConnectPGDB(conninfo))
+		{
+			res = PQexec(conninfo->conn,conninfo->queries[0]);
+			if(!CheckResError(res,"reading the ensemble thresholds"))
+			{
+				num_thresholds = PQntuples(res);
+				thresholds = (LinkThreshold*) malloc((num_thresholds + 1)*sizeof(LinkThreshold));
+				for(i=0;i<num_thresholds;i++)
+				{
+					thresholds[i].link_id = (unsigned int) atoi(PQgetvalue(res,i,0));
+					thresholds[i].discharge = atof(PQgetvalue(res,i,1));
+				}
+				qsort(thresholds,num_thresholds,sizeof(LinkThreshold),CompareLinkThresholds);
+			}
+			PQclear(res);
+			DisconnectPGDB(conninfo);
+		}
+		if(conninfo)	ConnData_Free(conninfo);
+		if(num_thresholds < 0)	printf("[%i]: Error: Could not read the ensemble thresholds from %s.\n",my_rank,filename);
+	}
+
+	MPI_Bcast(&num_thresholds,1,MPI_INT,0,MPI_COMM_WORLD);
+	if(num_thresholds < 0)	return 1;
+	if(my_rank != 0)	thresholds = (LinkThreshold*) malloc((num_thresholds + 1)*sizeof(LinkThreshold));
+	MPI_Bcast(thresholds,num_thresholds*sizeof(LinkThreshold),MPI_BYTE,0,MPI_COMM_WORLD);
+
+	for(i=0;i<(int) ensemble->num_links;i++)
+	{
+		key.link_id = asynch->sys[asynch->my_sys[i]]->ID;
+		found = (LinkThreshold*) bsearch(&key,thresholds,num_thresholds,sizeof(LinkThreshold),CompareLinkThresholds);
+		ensemble->thresholds[i] = found ? found->discharge : -1.0;
+	}
+
+	free(thresholds);
+	return 0;
+}
+
+//Sets up an ensemble of second phases. Each member has its own query of the forecast forcing, read from the
+//members .dbc file of the forecast file. Samples are kept for each of the my_N local links, in the order of my_sys.
+//This must be called by all procs. Returns NULL if no ensemble is set in Forecaster, or if it cannot be run.
+EnsembleStats* Init_EnsembleStats(ForecastData* Forecaster,asynchsolver* asynch)
+{
+	EnsembleStats* ensemble;
+	unsigned int i,my_N = asynch->my_N;
+
+	if(!Forecaster->ensemble_filename)	return NULL;
+	if(asynch->GlobalVars->outletlink != 0)
+	{
+		if(my_rank == 0)	printf("[%i]: Error: Ensembles are not available for a subbasin.\n",my_rank);
+		return NULL;
+	}
+	if(my_N && Forecaster->ensemble_discharge_idx >= asynch->sys[asynch->my_sys[0]]->dim)
+	{
+		printf("[%i]: Error: ensemble state index %u must be less than %u.\n",my_rank,Forecaster->ensemble_discharge_idx,asynch->sys[asynch->my_sys[0]]->dim);
+		return NULL;
+	}
+
+	ensemble = (EnsembleStats*) malloc(sizeof(EnsembleStats));
+	ensemble->members = ReadDBC(Forecaster->ensemble_filename,asynch->GlobalVars->string_size);
+	if(!ensemble->members || !ensemble->members->num_queries)
+	{
+		if(my_rank == 0)	printf("[%i]: Error: No ensemble members found in %s.\n",my_rank,Forecaster->ensemble_filename);
+		if(ensemble->members)	ConnData_Free(ensemble->members);
+		free(ensemble);
+		return NULL;
+	}
+
+	ensemble->num_members = ensemble->members->num_queries;
+	ensemble->member = -1;
+	ensemble->horizon = 60 * Forecaster->ensemble_horizon;
+	ensemble->discharge_idx = Forecaster->ensemble_discharge_idx;
+	ensemble->num_links = my_N;
+	ensemble->link_ids = (unsigned int*) calloc(my_N + 1,sizeof(unsigned int));
+	ensemble->num_samples = (unsigned int*) calloc(my_N + 1,sizeof(unsigned int));
+	ensemble->next_sample = (unsigned int*) calloc(my_N + 1,sizeof(unsigned int));
+	ensemble->capacity = (unsigned int*) calloc(my_N + 1,sizeof(unsigned int));
+	ensemble->times = (unsigned int**) calloc(my_N + 1,sizeof(unsigned int*));
+	ensemble->values = (double**) calloc(my_N + 1,sizeof(double*));
+	ensemble->thresholds = (double*) malloc((my_N + 1)*sizeof(double));
+	ensemble->rows = CopyBinary_Create(1048576);
+	for(i=0;i<my_N;i++)	ensemble->thresholds[i] = -1.0;
+
+	if(Forecaster->ensemble_thresholds && EnsembleStats_LoadThresholds(ensemble,asynch,Forecaster->ensemble_thresholds))
+	{
+		Free_EnsembleStats(&ensemble);
+		return NULL;
+	}
+
+	if(my_rank == 0)	printf("Ensemble has %u members.\n",ensemble->num_members);
+	return ensemble;
+}
+
+void Free_EnsembleStats(EnsembleStats** ensemble)
+{
+	unsigned int i;
+
+	if(!(*ensemble))	return;
+	for(i=0;i<(*ensemble)->num_links;i++)
+	{
+		free((*ensemble)->times[i]);
+		free((*ensemble)->values[i]);
+	}
+	free((*ensemble)->link_ids);
+	free((*ensemble)->num_samples);
+	free((*ensemble)->next_sample);
+	free((*ensemble)->capacity);
+	free((*ensemble)->times);
+	free((*ensemble)->values);
+	free((*ensemble)->thresholds);
+	CopyBinary_Free(&((*ensemble)->rows));
+	ConnData_Free((*ensemble)->members);
+	free(*ensemble);
+	*ensemble = NULL;
+}
+
+//Keeps one sample of the hydrograph at the local link slot for the member being computed.
+//The first member sets the times of the samples. The values of all members at a sample are stored together.
+void EnsembleStats_AddSample(EnsembleStats* ensemble,unsigned int slot,unsigned int link_id,unsigned int timestamp,VEC* y)
+{
+	unsigned int j,member = (unsigned int) ensemble->member,K = ensemble->num_members;
+
+	if(ensemble->member < 0)	return;
+	j = ensemble->next_sample[slot]++;
+
+	if(member == 0)
+	{
+		if(j >= ensemble->capacity[slot])
+		{
+			ensemble->capacity[slot] = (ensemble->capacity[slot]) ? 2 * ensemble->capacity[slot] : 64;
+			ensemble->times[slot] = (unsigned int*) realloc(ensemble->times[slot],ensemble->capacity[slot]*sizeof(unsigned int));
+			ensemble->values[slot] = (double*) realloc(ensemble->values[slot],ensemble->capacity[slot]*K*sizeof(double));
+		}
+		ensemble->link_ids[slot] = link_id;
+		ensemble->times[slot][j] = timestamp;
+		ensemble->num_samples[slot] = j + 1;
+	}
+
+	if(j < ensemble->num_samples[slot])	ensemble->values[slot][j*K + member] = y->ve[ensemble->discharge_idx];
+}
+
+//Runs each member as a second phase from the states in checkpoint. The members run one after another. The states are at time t0 of the simulation,
+//which is first_time in unix time. Each member's forcing covers the ensemble horizon after first_time, and the
+//rest of the forecast has no rain, as in the second phase. The samples of each member are taken by
+//EnsembleStats_AddSample from the output routines. A member that does not reach a sample leaves it NaN.
+//Nothing a member writes to the temporary files is kept.
+void EnsembleStats_Run(EnsembleStats* ensemble,asynchsolver* asynch,StateCheckpoint* checkpoint,unsigned int forecast_idx,double t0,unsigned int first_time,double forecast_time)
+{
+	ConnData* conninfo = asynch->db_connections[ASYNCH_DB_LOC_FORCING_START + forecast_idx];
+	char *connectinfo = conninfo->connectinfo,*query = conninfo->queries[0];
+	unsigned int i,j,K = ensemble ? ensemble->num_members : 0;
+	time_t start,stop;
+
+	if(!ensemble)	return;
+	MPI_Barrier(MPI_COMM_WORLD);
+	time(&start);
+
+	for(ensemble->member=0;ensemble->member<(int) ensemble->num_members;ensemble->member++)
+	{
+		for(i=0;i<ensemble->num_links;i++)	ensemble->next_sample[i] = 0;
+		if(ensemble->member == 0)
+		{
+			for(i=0;i<ensemble->num_links;i++)	ensemble->num_samples[i] = 0;
+		}
+
+		//Clear the member's values from the last forecast
+		for(i=0;i<ensemble->num_links;i++)
+		{
+			for(j=0;j<ensemble->num_samples[i];j++)	ensemble->values[i][j*K + ensemble->member] = NAN;
+		}
+
+		//Point the forecast forcing at the member
+		conninfo->connectinfo = ensemble->members->connectinfo;
+		conninfo->queries[0] = ensemble->members->queries[ensemble->member];
+
+		Asynch_Set_System_State(asynch,t0,checkpoint->backup);
+		Asynch_Set_Forcing_State(asynch,forecast_idx,t0,first_time,first_time + ensemble->horizon);
+		Asynch_Activate_Forcing(asynch,forecast_idx);
+		Asynch_Set_Total_Simulation_Time(asynch,forecast_time);
+		Asynch_Reset_Temp_Files(asynch,0.0);	//The temp files only have room for one window
+		Asynch_Advance(asynch,1);
+		Asynch_Reset_Peakflow_Data(asynch);
+	}
+
+	ensemble->member = -1;
+	conninfo->connectinfo = connectinfo;
+	conninfo->queries[0] = query;
+	Asynch_Reset_Temp_Files(asynch,0.0);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	if(my_rank == 0)
+	{
+		time(&stop);
+		printf("Time for %u ensemble members: %.2f\n",ensemble->num_members,difftime(stop,start));
+	}
+}
+
+//Linear interpolation between the order statistics of sorted, for 0 <= p <= 1.
+static double SortedQuantile(double* sorted,unsigned int n,double p)
+{
+	double position = p * (n - 1);
+	unsigned int below = (unsigned int) position;
+
+	if(below + 1 >= n)	return sorted[n-1];
+	return sorted[below] + (position - below) * (sorted[below+1] - sorted[below]);
+}
+
+//Reduces the members at each sample to the mean, the 10th, 50th, and 90th percentiles, and the probability of
+//exceeding the link's threshold, then replaces the contents of schema.ensemble_hydroforecast_modelname with them.
+//The table is created if needed. Only these statistics leave the processes. Members without a value at a sample (NaN)
+//are left out of its statistics, and a sample without any values gets NULL statistics.
+//Returns 0 if the statistics were uploaded, 1 if an error occurred.
+int EnsembleStats_Upload(EnsembleStats* ensemble,ConnData* conninfo,ForecastData* Forecaster,char* schema,unsigned int forecast_time)
+{
+	unsigned int i,j,m,n,exceed,count,K = ensemble->num_members;
+	double *sorted = (double*) malloc(K*sizeof(double)),*values,holder,sum;
+	char table[strlen(schema) + strlen(Forecaster->model_name) + 64],query[2*sizeof(table) + 512];
+	CopyBinary* gathered = NULL;
+	PGresult* res;
+	int error = 0;
+
+	CopyBinary_Reset(ensemble->rows);
+	for(i=0;i<ensemble->num_links;i++)
+	{
+		for(j=0;j<ensemble->num_samples[i];j++)
+		{
+			//Insertion sort, as there are few members
+			values = &(ensemble->values[i][j*K]);
+			sum = 0.0;
+			exceed = 0;
+			for(m=0,count=0;m<K;m++)
+			{
+				holder = values[m];
+				if(isnan(holder))	continue;
+				sum += holder;
+				if(ensemble->thresholds[i] >= 0.0 && holder > ensemble->thresholds[i])	exceed++;
+				for(n=count;n>0 && sorted[n-1] > holder;n--)	sorted[n] = sorted[n-1];
+				sorted[n] = holder;
+				count++;
+			}
+
+			CopyBinary_StartRow(ensemble->rows,8);
+			CopyBinary_PutInt(ensemble->rows,(int) ensemble->link_ids[i]);
+			CopyBinary_PutTimestamp(ensemble->rows,ensemble->times[i][j]);
+			CopyBinary_PutInt(ensemble->rows,(int) forecast_time);
+			if(!count)
+			{
+				for(m=0;m<5;m++)	CopyBinary_PutNull(ensemble->rows);
+				continue;
+			}
+			CopyBinary_PutDouble(ensemble->rows,sum / count);
+			CopyBinary_PutDouble(ensemble->rows,SortedQuantile(sorted,count,0.1));
+			CopyBinary_PutDouble(ensemble->rows,SortedQuantile(sorted,count,0.5));
+			CopyBinary_PutDouble(ensemble->rows,SortedQuantile(sorted,count,0.9));
+			if(ensemble->thresholds[i] >= 0.0)	CopyBinary_PutDouble(ensemble->rows,(double) exceed / count);
+			else	CopyBinary_PutNull(ensemble->rows);
+		}
+	}
+	free(sorted);
+
+	//Replace the statistics in one transaction, so readers never see the table empty
+	if(my_rank == 0)	gathered = CopyBinary_Create(1048576);
+	CopyBinary_Gather(ensemble->rows,gathered);
+
+	sprintf(table,"%sensemble_hydroforecast_%s",schema,Forecaster->model_name);
+	if(my_rank == 0)
+	{
+		if(ConnectPooledPGDB(conninfo))	error = 1;
+		else
+		{
+			sprintf(query,"BEGIN; CREATE TABLE IF NOT EXISTS %s (link_id integer,time_utc timestamp with time zone,forecast_time integer,mean double precision,\
+				q10 double precision,q50 double precision,q90 double precision,exceedance double precision); TRUNCATE %s;",table,table);
+			res = PQexec(conninfo->conn,query);
+			error = CheckResError(res,"clearing the ensemble table");
+			PQclear(res);
+
+			if(!error)	error = CopyBinary_Send(conninfo->conn,table,"(link_id,time_utc,forecast_time,mean,q10,q50,q90,exceedance)",gathered->buffer,gathered->size);
+			if(!error)
+			{
+				res = PQexec(conninfo->conn,"COMMIT;");
+				error = CheckResError(res,"committing the ensemble statistics");
+				PQclear(res);
+			}
+			else	PQclear(PQexec(conninfo->conn,"ROLLBACK;"));
+			DisconnectPooledPGDB(conninfo);
+		}
+		CopyBinary_Free(&gathered);
+	}
+	MPI_Bcast(&error,1,MPI_INT,0,MPI_COMM_WORLD);
+
+	if(!error && my_rank == 0)	printf("[%i]: Uploaded ensemble statistics into %s.\n",my_rank,table);
+	return error;
+}
+
+//Dry blocks **********************************************************************************
+
+//Checks if the forecast forcing has a nonzero value anywhere in the network from first_time to last_time.
+//The forcing query must return the time, value, and link id, as ASYNCH expects. This must be called by all procs.
+//Returns 1 if rain was found or the check failed, 0 if the block is dry.
+int ForcingHasRain(ConnData* conninfo,UnivVars* GlobalVars,unsigned int first_time,unsigned int last_time)
+{
+	PGresult* res;
+	char *query,*block;
+	unsigned int i;
+	int has_rain = 1;
+
+	if(my_rank == 0 && conninfo && conninfo->num_queries > (GlobalVars->outletlink ? 1 : 0) && !ConnectPooledPGDB(conninfo))
+	{
+		//The subbasin query takes the outlet before the times
+		query = (char*) malloc((strlen(conninfo->queries[0]) + ((conninfo->num_queries > 1) ? strlen(conninfo->queries[1]) : 0) + 1024)*sizeof(char));
+		sprintf(query,"SELECT EXISTS (SELECT 1 FROM (");
+		block = query + strlen(query);
+		if(GlobalVars->outletlink)	sprintf(block,conninfo->queries[1],GlobalVars->outletlink,first_time,last_time);
+		else				sprintf(block,conninfo->queries[0],first_time,last_time);
+		for(i=strlen(query);i && (query[i-1] == ';' || isspace(query[i-1]));i--);
+		strcpy(query + i,") AS block(unix_time,value,link_id) WHERE value <> 0);");
+
+		res = PQexec(conninfo->conn,query);
+		if(!CheckResError(res,"checking the forcing for rain"))
+			has_rain = (PQgetvalue(res,0,0)[0] == 't');
+		PQclear(res);
+		DisconnectPooledPGDB(conninfo);
+		free(query);
+	}
+
+	MPI_Bcast(&has_rain,1,MPI_INT,0,MPI_COMM_WORLD);
+	return has_rain;
+}
+
+//Connection pool *****************************************************************************
+
+//Sets conninfo->conn to a session that stays open across calls. This is used like ConnectPGDB.
+//A session idle for more than POOL_VALIDATE_TIME seconds is checked with an empty query before reuse,
+//and is reset only if the check fails. Returns 0 if a good connection is available, 1 otherwise.
+int ConnectPooledPGDB(ConnData* conninfo)
+{
+	unsigned int i;
+	PGresult* res;
+	PooledConn* pooled = NULL;
+	time_t now = time(NULL);
+	int good;
+
+	if(!conninfo)	return 1;
+
+	//Find the session for this connection
+	for(i=0;i<conn_pool_size;i++)
+	{
+		if(conn_pool[i].conninfo == conninfo)
+		{
+			pooled = &(conn_pool[i]);
+			break;
+		}
+	}
+
+	//Open a new session
+	if(!pooled)
+	{
+		conninfo->conn = NULL;
+		if(ConnectPGDB(conninfo))
+		{
+			DisconnectPGDB(conninfo);
+			return 1;
+		}
+
+		conn_pool = (PooledConn*) realloc(conn_pool,(conn_pool_size+1)*sizeof(PooledConn));
+		pooled = &(conn_pool[conn_pool_size++]);
+		pooled->conninfo = conninfo;
+		pooled->conn = conninfo->conn;
+		pooled->last_used = now;
+		return 0;
+	}
+
+	//Validate the session
+	good = (PQstatus(pooled->conn) == CONNECTION_OK);
+	if(good && PQtransactionStatus(pooled->conn) != PQTRANS_IDLE)	//Left inside a transaction by an earlier error
+	{
+		res = PQexec(pooled->conn,"ROLLBACK;");
+		PQclear(res);
+	}
+	if(good && difftime(now,pooled->last_used) > POOL_VALIDATE_TIME)
+	{
+		res = PQexec(pooled->conn,"");
+		good = (PQresultStatus(res) == PGRES_EMPTY_QUERY);
+		PQclear(res);
+	}
+
+	//Reconnect only if the session is bad
+	if(!good)
+	{
+		printf("[%i]: Pooled database connection lost. Attempting to reconnect...\n",my_rank);
+		ForgetPreparedPGDB(pooled->conn);
+		PQreset(pooled->conn);
+		if(PQstatus(pooled->conn) != CONNECTION_OK)
+		{
+			printf("[%i]: Error: Could not reconnect to the database.\n%s",my_rank,PQerrorMessage(pooled->conn));
+			conninfo->conn = NULL;
+			return 1;
+		}
+	}
+
+	conninfo->conn = pooled->conn;
+	pooled->last_used = now;
+	return 0;
+}
+
+//Hands the session of conninfo back to the pool. This is used like DisconnectPGDB. The session stays open.
+void DisconnectPooledPGDB(ConnData* conninfo)
+{
+	unsigned int i;
+
+	if(!conninfo)	return;
+
+	for(i=0;i<conn_pool_size;i++)
+	{
+		if(conn_pool[i].conninfo == conninfo)
+		{
+			conn_pool[i].last_used = time(NULL);
+			conninfo->conn = NULL;
+			return;
+		}
+	}
+
+	//Not a pooled connection
+	DisconnectPGDB(conninfo);
+}
+
+//Closes every session in the pool. This should be called before any pooled ConnData is freed.
+void ClosePooledPGDB()
+{
+	unsigned int i;
+
+	for(i=0;i<conn_pool_size;i++)
+	{
+		if(conn_pool[i].conninfo->conn == conn_pool[i].conn)	conn_pool[i].conninfo->conn = NULL;
+		ForgetPreparedPGDB(conn_pool[i].conn);
+		PQfinish(conn_pool[i].conn);
+	}
+	free(conn_pool);
+	conn_pool = NULL;
+	conn_pool_size = 0;
+}
+
+//Runs sql on the session of conninfo as a prepared statement. The statement is prepared the first time it is
+//seen on a session and only executed afterwards. The parameters $1,...,$num_params are the integers in params,
+//sent in binary. Results are in text format. As with PQexec, the caller checks and clears the result.
+PGresult* ExecPreparedPGDB(ConnData* conninfo,char* sql,int num_params,int* params)
+{
+	unsigned int i;
+	int j,attempt,found;
+	PreparedStatement* statement;
+	PGresult* res;
+	char name[32];
+	uint32_t values[num_params > 0 ? num_params : 1];
+	const char* value_ptrs[num_params > 0 ? num_params : 1];
+	int lengths[num_params > 0 ? num_params : 1],formats[num_params > 0 ? num_params : 1];
+	char* sqlstate;
+
+	for(j=0;j<num_params;j++)
+	{
+		values[j] = htonl((uint32_t) params[j]);
+		value_ptrs[j] = (const char*) &(values[j]);
+		lengths[j] = sizeof(uint32_t);
+		formats[j] = 1;
+	}
+
+	for(attempt=0;attempt<2;attempt++)
+	{
+		//Look for the statement on this session. Only its name is used once the lock is released.
+		found = 0;
+		pthread_mutex_lock(&prepared_lock);
+		for(i=0;i<num_prepared;i++)
+		{
+			if(prepared[i].conn == conninfo->conn && strcmp(prepared[i].sql,sql) == 0)
+			{
+				strcpy(name,prepared[i].name);
+				found = 1;
+				break;
+			}
+		}
+		if(!found)	sprintf(name,"fcst_stmt_%u",next_prepared_id++);
+		pthread_mutex_unlock(&prepared_lock);
+
+		//Prepare it
+		if(!found)
+		{
+			res = PQprepare(conninfo->conn,name,sql,num_params,NULL);
+			if(PQresultStatus(res) != PGRES_COMMAND_OK)	return res;
+			PQclear(res);
+
+			pthread_mutex_lock(&prepared_lock);
+			prepared = (PreparedStatement*) realloc(prepared,(num_prepared+1)*sizeof(PreparedStatement));
+			statement = &(prepared[num_prepared++]);
+			statement->conn = conninfo->conn;
+			statement->sql = (char*) malloc((strlen(sql)+1)*sizeof(char));
+			strcpy(statement->sql,sql);
+			strcpy(statement->name,name);
+			pthread_mutex_unlock(&prepared_lock);
+		}
+
+		res = PQexecPrepared(conninfo->conn,name,num_params,value_ptrs,lengths,formats,0);
+
+		//The session was replaced since the statement was prepared. Prepare it again.
+		sqlstate = PQresultErrorField(res,PG_DIAG_SQLSTATE);
+		if(attempt == 0 && sqlstate && strcmp(sqlstate,"26000") == 0)
+		{
+			PQclear(res);
+			ForgetPreparedPGDB(conninfo->conn);
+			continue;
+		}
+		break;
+	}
+
+	return res;
+}
+
+//Drops the registry entries of every statement prepared on conn. This is called when a session is reset or closed.
+void ForgetPreparedPGDB(PGconn* conn)
+{
+	unsigned int i,j = 0;
+
+	pthread_mutex_lock(&prepared_lock);
+	for(i=0;i<num_prepared;i++)
+	{
+		if(prepared[i].conn == conn)	free(prepared[i].sql);
+		else				prepared[j++] = prepared[i];
+	}
+	num_prepared = j;
+	pthread_mutex_unlock(&prepared_lock);
+}
+
+//Replaces the integer conversions (%u, %d, %i) of a printf style query with the parameters $1, $2, ...
+//so the query can be used with ExecPreparedPGDB. The returned string should be freed.
+char* ParameterizeQuery(char* format)
+{
+	unsigned int i,k = 0,param = 0,length = strlen(format);
+	char* sql = (char*) malloc((2*length+1)*sizeof(char));
+
+	for(i=0;i<length;i++)
+	{
+		if(format[i] == '%' && i+1 < length && (format[i+1] == 'u' || format[i+1] == 'd' || format[i+1] == 'i'))
+		{
+			k += sprintf(sql + k,"$%u",++param);
+			i++;
+		}
+		else if(format[i] == '%' && i+1 < length && format[i+1] == '%')
+		{
+			sql[k++] = '%';
+			i++;
+		}
+		else	sql[k++] = format[i];
+	}
+	sql[k] = '\0';
+	return sql;
+}
+
+//Subscribes the pooled session of conninfo to channel. LISTEN is idempotent, so this can be
+//called before every poll. This also covers a session that was reset by the pool.
+//Returns 0 on success, 1 on error.
+int ListenPGDB(ConnData* conninfo,char* channel)
+{
+	PGresult* res;
+	char* ident;
+	int error;
+
+	if(!conninfo || !conninfo->conn)	return 1;
+
+	ident = PQescapeIdentifier(conninfo->conn,channel,strlen(channel));
+	if(!ident)
+	{
+		printf("[%i]: Error: Invalid notification channel %s.\n%s",my_rank,channel,PQerrorMessage(conninfo->conn));
+		return 1;
+	}
+	sprintf(conninfo->query,"LISTEN %s;",ident);
+	PQfreemem(ident);
+	res = PQexec(conninfo->conn,conninfo->query);
+	error = CheckResError(res,"listening for notifications");
+	PQclear(res);
+	return error;
+}
+
+//Blocks until a notification arrives on the pooled session of conninfo, or until wait_time seconds pass.
+//ListenPGDB must have been called on the session first. Any queued notifications are consumed.
+//Returns 1 if a notification arrived, 0 on timeout, -1 on error.
+int WaitForNotify(ConnData* conninfo,unsigned int wait_time)
+{
+	PGnotify* notify;
+	int sock,received = 0;
+	fd_set input_mask;
+	struct timeval timeout;
+	time_t start,now;
+
+	if(ConnectPooledPGDB(conninfo))	return -1;
+	sock = PQsocket(conninfo->conn);
+	if(sock < 0)
+	{
+		DisconnectPooledPGDB(conninfo);
+		return -1;
+	}
+
+	time(&start);
+	now = start;
+	while(!received && difftime(now,start) < wait_time)
+	{
+		//Collect anything already on the socket
+		if(!PQconsumeInput(conninfo->conn))
+		{
+			printf("[%i]: Error: Lost connection while waiting for notifications.\n%s",my_rank,PQerrorMessage(conninfo->conn));
+			DisconnectPooledPGDB(conninfo);
+			return -1;
+		}
+		while((notify = PQnotifies(conninfo->conn)) != NULL)
+		{
+			received = 1;
+			PQfreemem(notify);
+		}
+		if(received)	break;
+
+		//Wait for more data
+		FD_ZERO(&input_mask);
+		FD_SET(sock,&input_mask);
+		timeout.tv_sec = wait_time - (unsigned int) difftime(now,start);
+		timeout.tv_usec = 0;
+		if(select(sock+1,&input_mask,NULL,NULL,&timeout) < 0 && errno != EINTR)
+		{
+			printf("[%i]: Error: select() failed while waiting for notifications.\n",my_rank);
+			DisconnectPooledPGDB(conninfo);
+			return -1;
+		}
+		time(&now);
+	}
+
+	DisconnectPooledPGDB(conninfo);
+	return received;
+}
@@ -4,14 +4,46 @@
 #include "structs.h"
 #include "comm.h"
 #include "riversys.h"
+#include "asynch_interface.h"
 #include <time.h>
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/select.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <libssh2.h>
 #include <arpa/inet.h>
 
+//Seconds a pooled connection can sit idle before it is checked
+#define POOL_VALIDATE_TIME 60
+
+//Seconds archive table rotation waits on a lock before giving up
+#define ROTATION_LOCK_TIMEOUT 5
+
+//Seconds a forecaster waits for another to fill the rain cache, and the name of the lock
+#define RAIN_CACHE_LOCK_TIMEOUT 60
+#define RAIN_CACHE_LOCK_NAME "forecaster_rain_cache"
+
+//Version of the topology and parameter files in the network cache. Change this if their format changes.
+#define NETWORK_CACHE_VERSION 1
+
+//Name of the advisory locks used to limit concurrent uploads, and the longest wait (secs) between checks for a free one
+#define UPLOAD_LOCK_NAME "forecaster_upload"
+#define UPLOAD_SLOT_MAX_WAIT 8
+
+//Largest piece of binary rows passed to MPI or libpq at once. Their counts are ints.
+#define COPY_CHUNK_SIZE 67108864ULL
+
+//Columnar hydrograph files. The magic number is "HCOL".
+#define HYDRO_FILE_MAGIC 0x48434F4C
+#define HYDRO_FILE_VERSION 1
+#define HYDRO_FILE_HEADER_SIZE 16
+#define HYDRO_FILE_TRAILER_SIZE 16
 
 typedef struct ForecastData
 {
@@ -22,19 +54,234 @@ typedef struct ForecastData
 	short int ifis_display;
 	char* rainmaps_filename;
 	ConnData* rainmaps_db;
+	char* rainmaps_probe;	//queries[0] of rainmaps_db with $1 in place of the time
 	double forecast_window;
+	short int archive_copy;
+	unsigned int archive_discharge_idx;
+	unsigned int archive_baseflow_idx;
+	short int hydro_columnar;
+	char* rain_channel;
+	unsigned int upload_slots;
+	unsigned int upload_ranks;
+	short int background_upload;
+	unsigned int num_peakflow_horizons;
+	double* peakflow_horizons;
+	short int peakflow_batch;
+	short int peakflow_text;
+	char* control_request;	//Fifos for daemon mode. NULL if windows come from the command line.
+	char* control_reply;
+	char* network_cache;
+	char* warm_start;
+	unsigned short int gbl_init_flag;	//Initial conditions from the global file, kept while warm starts replace them
+	char* gbl_init_filename;
+	char warm_start_used[512];	//Warm start files read and written for this forecast file
+	char warm_start_saved[512];
+	short int rain_prefetch;
+	unsigned int rain_cache_age;
+	unsigned int reuse_dry_forecasts;
+	char* ensemble_filename;	//.dbc file with the forcing query of each ensemble member. NULL if no ensemble.
+	char* ensemble_thresholds;
+	unsigned int ensemble_horizon;
+	unsigned int ensemble_discharge_idx;
 } ForecastData;
 
+//Rows in the binary format of COPY ... FROM STDIN
+typedef struct CopyBinary
+{
+	char* buffer;
+	unsigned long long int size;
+	unsigned long long int capacity;
+	unsigned int num_rows;
+} CopyBinary;
+
+//Hydrograph samples captured from the output routines for streaming into the archive.
+//The samples are kept by column. Consecutive samples of the same link form a block.
+typedef struct HydroArchive
+{
+	CopyBinary* rows;	//COPY rows for an upload, or scratch space for a columnar file
+	unsigned int discharge_idx;
+	unsigned int baseflow_idx;
+	short int columnar;	//1 if the samples are kept by column for a columnar file, 0 if they are encoded as rows
+	unsigned int num_samples;
+	unsigned int sample_capacity;
+	double* times;	//Simulation time (mins) of each sample
+	double* discharge;
+	double* baseflow;
+	int* timestamps;	//Scratch column for the timestamps of a block
+	unsigned int num_blocks;
+	unsigned int block_capacity;
+	unsigned int* block_ids;	//Link id of each block
+	unsigned int* block_starts;	//First sample of each block
+} HydroArchive;
+
+//Peakflows of each horizon, taken from the hydrograph samples while the second phase is advanced in one pass
+typedef struct PeakflowHorizons
+{
+	unsigned int num_horizons;
+	unsigned int num_links;	//Links of this process, in the order of my_sys
+	double* horizons;	//Length (mins) of each horizon after the first phase
+	double* starts;	//Simulation time (mins) at the start of each horizon
+	double* ends;	//Simulation time (mins) at the end of each horizon
+	double* peak_values;	//Largest discharge of each link in each horizon. NaN if the link has no sample there.
+	double* peak_times;
+	short int* peak_flags;	//peak_flag of each link, kept while the horizons are written
+	unsigned int num_skipped;
+	short int tracking;
+} PeakflowHorizons;
+
+//Uploader thread on proc 0 for streaming hydrographs into the archive while the next forecast is computed
+typedef struct BackgroundUpload
+{
+	pthread_t thread;
+	short int running;
+	CopyBinary* rows;	//Hydrographs gathered from every proc for the upload in progress
+	ConnData* conninfo;
+	PGconn* conn;		//Session used only by the uploader thread
+	char* model_name;
+	char* schema;
+	unsigned int num_tables;
+	unsigned int forecast_time;
+	unsigned int upload_slots;
+	unsigned int retry_time;
+} BackgroundUpload;
+
+//Cache of the forecast forcing in the database, shared by the forecasters using the same forcing query
+typedef struct RainCache
+{
+	ConnData* conninfo;	//Connection and queries of the forecast forcing
+	char* original;		//Forcing query before it was pointed at the cache
+	char table[32];
+	char column[64];	//Time column of the forcing
+	unsigned int key;
+	unsigned int max_age;	//Seconds a block is kept
+} RainCache;
+
+//Prefetcher thread on proc 0 for reading the next block of the forecast forcing into the rain cache
+typedef struct RainPrefetch
+{
+	pthread_t thread;
+	short int running;
+	RainCache* cache;	//Cache the block is read into. The forcing query reads from it.
+	PGconn* conn;		//Session on the forcing database, used only by the prefetcher thread
+	ConnData* probe_info;	//Forcing index database, and its query for a forcing time
+	char* probe;
+	PGconn* probe_conn;	//Session on the index database, used only by the prefetcher thread
+	unsigned int first_time;
+	unsigned int last_time;
+	unsigned int probe_time;	//Last forcing time of the block
+} RainPrefetch;
+
+//Hydrograph samples of every member of an ensemble at the local links. The members at one sample are contiguous.
+typedef struct EnsembleStats
+{
+	ConnData* members;	//Forcing query of each member
+	unsigned int num_members;
+	int member;		//Member being computed, or -1 outside the ensemble
+	unsigned int horizon;	//Seconds of member forcing
+	unsigned int discharge_idx;
+	unsigned int num_links;
+	unsigned int* link_ids;
+	unsigned int* num_samples;
+	unsigned int* next_sample;
+	unsigned int* capacity;
+	unsigned int** times;
+	double** values;	//Member m at sample j of a link is at values[link][j*num_members + m]
+	double* thresholds;	//Discharge for the exceedance probability of each link. Negative if none.
+	CopyBinary* rows;
+} EnsembleStats;
+
+//States of the owned and ghost links on a proc, stored contiguously by local link
+typedef struct StateCheckpoint
+{
+	unsigned int num_links;
+	unsigned int* locs;	//Location in sys of each local link
+	unsigned int size;	//Total number of states over all local links
+	double* states;
+	VEC* views;		//Vectors over states, one for each local link
+	VEC** backup;		//Indexed by location in sys, for Asynch_Set_System_State. NULL for links not on this proc.
+} StateCheckpoint;
+
 int DeleteFutureValues(ConnData* conninfo,unsigned int num_tables,UnivVars* GlobalVars,char* table_name,char* model_name,unsigned int clear_after,unsigned int equal,char* schema);
 void PerformTableMaintainance(ConnData* conninfo_hydros,UnivVars* GlobalVars,ForecastData* Forecaster,short int* vac,short unsigned int hr1,unsigned int num_tables,char* tablename,char* schema);
 void CheckPartitionedTable(ConnData* conninfo,UnivVars* GlobalVars,ForecastData* Forecaster,unsigned int num_tables,char* tablename,char* colname,char* schema);
+int BeginPGTransaction(ConnData* conninfo,unsigned int lock_timeout);
+int EndPGTransaction(ConnData* conninfo,int error);
+short int IsDeclarativePartitioned(ConnData* conninfo,ForecastData* Forecaster,char* tablename,char* schema);
+int CreateDayPartition(ConnData* conninfo,ForecastData* Forecaster,char* tablename,char* schema,char* suffix,unsigned int day_start);
+int RotateDeclarativePartitions(ConnData* conninfo,ForecastData* Forecaster,unsigned int num_tables,char* tablename,char* schema);
 void CreateHaltFile(char* filename);
 short int CheckFinished(char* filename);
-int WaitForDB(ConnData* conninfo,unsigned int naptime,int stale_time,unsigned int query_size);
-void FreeDBLock(ConnData* conninfo,unsigned int query_size);
+int WaitForDB(ConnData* conninfo,unsigned int num_slots);
+void FreeDBLock(ConnData* conninfo);
+int ReadControlWindow(ForecastData* Forecaster,unsigned int* window);
+void WriteControlReply(ForecastData* Forecaster,unsigned int timestamp);
 ForecastData* Init_ForecastData(char* fcst_filename,unsigned int string_size);
+int ReadForecastOption(ForecastData* Forecaster,char* linebuffer);
 void Free_ForecastData(ForecastData** Forecaster);
 int SendFilesTo51(char* loclfile,char* serverlocation);
 
+int ConnectPooledPGDB(ConnData* conninfo);
+void DisconnectPooledPGDB(ConnData* conninfo);
+void ClosePooledPGDB();
+PGresult* ExecPreparedPGDB(ConnData* conninfo,char* sql,int num_params,int* params);
+void ForgetPreparedPGDB(PGconn* conn);
+char* ParameterizeQuery(char* format);
+int ListenPGDB(ConnData* conninfo,char* channel);
+int WaitForNotify(ConnData* conninfo,unsigned int wait_time);
+unsigned int GetCurrentDay(ConnData* conninfo);
+int ArchiveTableIndex(unsigned int forecast_time,unsigned int current_day);
+CopyBinary* CopyBinary_Create(unsigned int capacity);
+void CopyBinary_Free(CopyBinary** copier);
+void CopyBinary_Reset(CopyBinary* copier);
+void CopyBinary_StartRow(CopyBinary* copier,short int num_fields);
+void CopyBinary_PutInt(CopyBinary* copier,int value);
+void CopyBinary_PutDouble(CopyBinary* copier,double value);
+void CopyBinary_PutNull(CopyBinary* copier);
+void CopyBinary_PutTimestamp(CopyBinary* copier,unsigned int unix_time);
+int CopyBinary_Send(PGconn* conn,char* table,char* columns,char* data,unsigned long long int size);
+void CopyBinary_Gather(CopyBinary* copier,CopyBinary* gathered);
+int CopyBinary_Upload(CopyBinary* copier,ConnData* conninfo,char* table,char* columns);
+int CopyBinary_UploadParallel(CopyBinary* copier,ConnData* conninfo,char* table,char* columns,unsigned int num_writers);
+HydroArchive* Init_HydroArchive(ForecastData* Forecaster,unsigned int dim,short int columnar);
+void Free_HydroArchive(HydroArchive** archive);
+void HydroArchive_Reset(HydroArchive* archive);
+void HydroArchive_AddSample(HydroArchive* archive,unsigned int link_id,double t,unsigned int timestamp,VEC* y,unsigned int forecast_time);
+int HydroArchive_Upload(HydroArchive* archive,ConnData* conninfo,ForecastData* Forecaster,unsigned int num_tables,unsigned int forecast_time,char* schema);
+int HydroArchive_WriteColumnar(HydroArchive* archive,char* filename,unsigned int forecast_time);
+PeakflowHorizons* Init_PeakflowHorizons(unsigned int num_links,double* horizons,unsigned int num_horizons);
+void Free_PeakflowHorizons(PeakflowHorizons** peaks);
+double PeakflowHorizons_Start(PeakflowHorizons* peaks,Link** sys,unsigned int* my_sys,double t,double shift);
+void PeakflowHorizons_AddSample(PeakflowHorizons* peaks,unsigned int slot,double t,VEC* y);
+void PeakflowHorizons_Set(PeakflowHorizons* peaks,Link** sys,unsigned int* my_sys,unsigned int horizon);
+void PeakflowHorizons_Finish(PeakflowHorizons* peaks,Link** sys,unsigned int* my_sys);
+void PeakflowBatch_Add(CopyBinary* rows,Link** sys,unsigned int* my_sys,unsigned int my_N,unsigned int forecast_time,unsigned int period);
+int PeakflowBatch_Upload(CopyBinary* rows,ConnData* conninfo,char* peak_table,unsigned int num_writers);
+void PeakflowBatch_Flush(CopyBinary* rows,ConnData* conninfo,char* peak_table,unsigned int num_writers,unsigned int retry_time);
+BackgroundUpload* Init_BackgroundUpload(ForecastData* Forecaster,ConnData* conninfo,unsigned int num_tables,char* schema,unsigned int retry_time);
+void Free_BackgroundUpload(BackgroundUpload** uploader);
+void BackgroundUpload_Start(BackgroundUpload* uploader,HydroArchive* archive,unsigned int forecast_time);
+void BackgroundUpload_Wait(BackgroundUpload* uploader);
+RainPrefetch* Init_RainPrefetch(ForecastData* Forecaster,RainCache* cache);
+void Free_RainPrefetch(RainPrefetch** prefetch);
+void RainPrefetch_Start(RainPrefetch* prefetch,unsigned int first_time,unsigned int last_time,unsigned int step);
+void RainPrefetch_Wait(RainPrefetch* prefetch);
+RainCache* Init_RainCache(ForecastData* Forecaster,ConnData* conninfo,UnivVars* GlobalVars);
+void Free_RainCache(RainCache** cache);
+void RainCache_Fill(RainCache* cache,unsigned int first_time,unsigned int last_time);
+EnsembleStats* Init_EnsembleStats(ForecastData* Forecaster,asynchsolver* asynch);
+void Free_EnsembleStats(EnsembleStats** ensemble);
+void EnsembleStats_AddSample(EnsembleStats* ensemble,unsigned int slot,unsigned int link_id,unsigned int timestamp,VEC* y);
+void EnsembleStats_Run(EnsembleStats* ensemble,asynchsolver* asynch,StateCheckpoint* checkpoint,unsigned int forecast_idx,double t0,unsigned int first_time,double forecast_time);
+int EnsembleStats_Upload(EnsembleStats* ensemble,ConnData* conninfo,ForecastData* Forecaster,char* schema,unsigned int forecast_time);
+int ForcingHasRain(ConnData* conninfo,UnivVars* GlobalVars,unsigned int first_time,unsigned int last_time);
+StateCheckpoint* Init_StateCheckpoint(Link** sys,unsigned int N,int* assignments,short int* getting);
+void Free_StateCheckpoint(StateCheckpoint** checkpoint);
+void StateCheckpoint_Save(StateCheckpoint* checkpoint,Link** sys);
+void StateCheckpoint_Load(StateCheckpoint* checkpoint,Link** sys);
+void StateCheckpoint_ResetLinks(StateCheckpoint* checkpoint,Link** sys);
+int UseWarmStart(UnivVars* GlobalVars,ForecastData* Forecaster,unsigned int init_time);
+void SaveWarmStart(asynchsolver* asynch,StateCheckpoint* checkpoint,ForecastData* Forecaster,unsigned int timestamp);
+int UseNetworkCache(UnivVars* GlobalVars,ConnData* conninfo_topo,ConnData* conninfo_params,ForecastData* Forecaster,char* gbl_filename);
+
 #endif
 